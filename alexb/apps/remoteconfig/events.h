@@ -51,24 +51,11 @@ public:
   static void portal_pf(EventService *tls, Utcb *utcb) __attribute__((regparm(0)));
 
   inline unsigned alloc_cap(unsigned num = 1, unsigned cpu = ~0U) {
-    unsigned cap, cap_last, first_cap;
-
-    first_cap = CapAllocatorAtomicPartition<1 << CONST_CAP_RANGE>::alloc_cap(1, cpu);
-    if (!first_cap) return 0;
-    cap_last = first_cap;
-
-    while (--num) { //XXX fix me
-      cap = CapAllocatorAtomicPartition<1 << CONST_CAP_RANGE>::alloc_cap(1, cpu);
-      assert(cap);
-      assert(cap_last + 1 == cap);
-      cap_last = cap;
-    }
-
-    return first_cap;
+    return CapAllocatorAtomicPartition<1 << CONST_CAP_RANGE>::alloc_cap(num, cpu);
   }
 
   inline void dealloc_cap(unsigned cap, unsigned count = 1) {
-    assert(count == 1); CapAllocatorAtomicPartition<1 << CONST_CAP_RANGE>::dealloc_cap(cap, count);
+    CapAllocatorAtomicPartition<1 << CONST_CAP_RANGE>::dealloc_cap(cap, count);
   }
 
   inline unsigned alloc_crd() { return Crd(alloc_cap(), 0, DESC_CAP_ALL).value(); }
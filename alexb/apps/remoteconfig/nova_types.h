@@ -26,6 +26,7 @@ enum LIBVIRT_NOVA_OPCODE {
   NOVA_GET_NET_INFO,
   EVENT_REBOOT = 0xbbbb,
   EVENT_UNSERVED_IOACCESS = 0xbbc0,
+  EVENT_EXIT_PROFILE = 0xbbc1,
   EVENT_DMAR_ACCESS = 0xbbd0,
   EVENT_VDEV_HONEYPOT = 0xbbd1,
 };
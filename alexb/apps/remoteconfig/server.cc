@@ -56,6 +56,7 @@ const char *op2string(unsigned op)
   case NOVA_GET_NET_INFO: return "NOVA_GET_NET_INFO";
   case EVENT_REBOOT: return "EVENT_REBOOT";
   case EVENT_UNSERVED_IOACCESS: return "EVENT_UNSERVED_IOACCESS";
+  case EVENT_EXIT_PROFILE: return "EVENT_EXIT_PROFILE";
   case EVENT_DMAR_ACCESS: return "EVENT_DMAR_ACCESS";
   case EVENT_VDEV_HONEYPOT: return "EVENT_VDEV_HONEYPOT";
   }
@@ -31,6 +31,7 @@ struct EventsProtocol : public GenericProtocol {
   enum {
     EVENT_REBOOT = 0xbbbb,
     EVENT_UNSERVED_IOACCESS = 0xbbc0,
+    EVENT_EXIT_PROFILE = 0xbbc1,
   };
 
   unsigned send_event(Utcb &utcb, unsigned id, unsigned data_len = 0, const void * data = 0) {
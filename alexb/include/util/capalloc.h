@@ -33,9 +33,95 @@ class CapAllocatorAtomic {
     unsigned volatile _bits[(BITS + BITS_PER_UNSIGNED - 1) / BITS_PER_UNSIGNED];
     cap_sel _cap_base;
 
+    /**
+     * Set the bits of mask in word i, if none of them is set yet.
+     */
+    bool claim(unsigned i, unsigned mask) {
+      unsigned _old;
+      do {
+        _old = _bits[i];
+        if (_old & mask) return false;
+      } while (_old != Cpu::cmpxchg4b(&_bits[i], _old, _old | mask));
+      return true;
+    }
+
+    void release(unsigned i, unsigned mask) {
+      unsigned _old;
+      do {
+        _old = _bits[i];
+        if ((_old & mask) != mask) Logging::panic("cap index already freed\n");
+      } while (_old != Cpu::cmpxchg4b(&_bits[i], _old, _old & ~mask));
+    }
+
+    static unsigned word_mask(unsigned pos, unsigned count) {
+      return (count >= BITS_PER_UNSIGNED) ? ~0U : ((1U << count) - 1) << pos;
+    }
+
+    /**
+     * Return the bits of count selectors starting at index idx.
+     */
+    void release_range(unsigned idx, unsigned count) {
+      while (count) {
+        unsigned pos = idx % BITS_PER_UNSIGNED;
+        unsigned n   = BITS_PER_UNSIGNED - pos;
+        if (n > count) n = count;
+        release(idx / BITS_PER_UNSIGNED, word_mask(pos, n));
+        idx += n; count -= n;
+      }
+    }
+
+    /**
+     * Claim count contiguous selectors starting at index idx. Either
+     * all or none of them are taken.
+     */
+    bool claim_range(unsigned idx, unsigned count) {
+      unsigned done = 0;
+      while (done < count) {
+        unsigned pos = (idx + done) % BITS_PER_UNSIGNED;
+        unsigned n   = BITS_PER_UNSIGNED - pos;
+        if (n > count - done) n = count - done;
+        if (!claim((idx + done) / BITS_PER_UNSIGNED, word_mask(pos, n))) {
+          if (done) release_range(idx, done);
+          return false;
+        }
+        done += n;
+      }
+      return true;
+    }
+
+    /**
+     * Search a run of count free selectors. The search starts at word
+     * word_start, so that allocations from different CPUs do not
+     * contend on the same words, and wraps around once.
+     */
+    cap_sel internal_alloc_range(unsigned count, unsigned word_start) {
+      unsigned run = 0, first = 0, idx = word_start * BITS_PER_UNSIGNED;
+      for (unsigned steps = 0; steps < idx_max(); steps++, idx++) {
+        if (idx == idx_max()) { idx = 0; run = 0; }
+
+        // skip full words quickly
+        if (!(idx % BITS_PER_UNSIGNED) && _bits[idx / BITS_PER_UNSIGNED] == ~0U) {
+          run = 0;
+          steps += BITS_PER_UNSIGNED - 1;
+          idx   += BITS_PER_UNSIGNED - 1;
+          continue;
+        }
+
+        if (_bits[idx / BITS_PER_UNSIGNED] & (1U << (idx % BITS_PER_UNSIGNED))) { run = 0; continue; }
+        if (!run++) first = idx;
+        if (run < count) continue;
+
+        if (claim_range(first, count)) return _cap_base + first;
+        // somebody was faster - continue behind the conflict
+        run = 0;
+      }
+      return 0;
+    }
+
     cap_sel internal_alloc_cap(unsigned count = 1, unsigned byte_start = 0) {
-      assert(count == 1);
       assert(_cap_base != ~0UL);
+      if (!count) return 0;
+      if (count > 1) return internal_alloc_range(count, byte_start);
 
       redo:
 
@@ -77,25 +163,11 @@ class CapAllocatorAtomic {
     void dealloc_cap(cap_sel cap, unsigned count = 1) {
       assert(_cap_base != ~0UL);
       assert (cap >= _cap_base && (cap - _cap_base + (count ? count - 1 : 0)) < idx_max());
-      while (count--) {
-        unsigned i   = (cap + count - _cap_base) / BITS_PER_UNSIGNED;
-        unsigned pos = (cap + count - _cap_base) % BITS_PER_UNSIGNED;
-
-        unsigned res = nova_revoke(Crd(cap + count, 0, DESC_CAP_ALL), true);
+      for (unsigned i = 0; i < count; i++) {
+        UNUSED unsigned res = nova_revoke(Crd(cap + i, 0, DESC_CAP_ALL), true);
         assert(res == NOVA_ESUCCESS);
-
-        redo:
-
-        unsigned _new, _old = _bits[i];
-        if (!(_old & (1U << pos))) {
-          Logging::panic("cap index already freed\n");
-          return;
-        }
-
-        _new = _old & ~(1U << pos);
-        unsigned _got = Cpu::cmpxchg4b(&_bits[i], _old, _new);
-        if (_got != _old) goto redo;
       }
+      release_range(cap - _cap_base, count);
     }
 };
 
@@ -16,23 +16,48 @@
 #pragma once
 
 #include <nul/baseprogram.h>
+#include <nul/config.h>
 #include "capalloc.h"
 
+/**
+ * Partition the selector bitmap between CPUs. Every CPU starts its
+ * search at its own part of the bitmap and remembers where it found
+ * the last free selector. Freed single selectors are kept in a small
+ * per-CPU cache and handed out again without touching the bitmap.
+ */
 template <unsigned BITS>
 class CapAllocatorAtomicPartition : public CapAllocatorAtomic<BITS> {
+  typedef CapAllocatorAtomic<BITS> Base;
+  enum { CACHE_SIZE = 8 };
 
 protected:
     unsigned _divider;
+    unsigned volatile _hint[Config::MAX_CPUS];
+    cap_sel  volatile _cache[Config::MAX_CPUS][CACHE_SIZE];
+
+    unsigned slot(unsigned cpu) const { return cpu % Config::MAX_CPUS; }
 
 public:
   CapAllocatorAtomicPartition(cap_sel _cap_start = ~0UL, unsigned divider = 1) //~0UL means disabled
-     : CapAllocatorAtomic<BITS>(_cap_start), _divider(divider) {}
+     : CapAllocatorAtomic<BITS>(_cap_start), _divider(divider), _hint(), _cache() {}
 
   cap_sel alloc_cap(unsigned count = 1, unsigned cpu = ~0U) {
     if (cpu == ~0U) cpu = BaseProgram::mycpu();
-    unsigned start = (cpu * (BITS / _divider / CapAllocatorAtomic<BITS>::BITS_PER_UNSIGNED));
-    start %= CapAllocatorAtomic<BITS>::bytes_max();
-    unsigned res = CapAllocatorAtomic<BITS>::internal_alloc_cap(count, start);
+
+    if (count == 1)
+      for (unsigned i = 0; i < CACHE_SIZE; i++) {
+        if (!_cache[slot(cpu)][i]) continue;
+        cap_sel res = Cpu::xchg(&_cache[slot(cpu)][i], 0U);
+        if (res) return res;
+      }
+
+    unsigned start = _hint[slot(cpu)];
+    if (!start) {
+      start = (cpu * (BITS / _divider / Base::BITS_PER_UNSIGNED));
+      start %= Base::bytes_max();
+    }
+    unsigned res = Base::internal_alloc_cap(count, start);
+    if (res) _hint[slot(cpu)] = (res - Base::_cap_base) / Base::BITS_PER_UNSIGNED;
 /*
     Logging::printf("cap=%x cpu %u/%u (valid range %x %x, cpu starts at %x)\n", res, cpu, _divider,
                     CapAllocatorAtomic<BITS>::_cap_base,
@@ -42,4 +67,28 @@ public:
 */
     return res;
   }
+
+  void dealloc_cap(cap_sel cap, unsigned count = 1) {
+    if (count != 1 || !cap) return Base::dealloc_cap(cap, count);
+
+    // Cached selectors stay allocated in the bitmap, so look for a
+    // double free before the base class cannot see it anymore.
+    assert (cap >= Base::_cap_base && cap - Base::_cap_base < Base::idx_max());
+    unsigned idx = cap - Base::_cap_base;
+    if (!(Base::_bits[idx / Base::BITS_PER_UNSIGNED] & (1U << (idx % Base::BITS_PER_UNSIGNED))))
+      Logging::panic("cap index already freed\n");
+    for (unsigned c = 0; c < Config::MAX_CPUS; c++)
+      for (unsigned i = 0; i < CACHE_SIZE; i++)
+        if (_cache[c][i] == cap) Logging::panic("cap index already freed\n");
+
+    UNUSED unsigned res = nova_revoke(Crd(cap, 0, DESC_CAP_ALL), true);
+    assert(res == NOVA_ESUCCESS);
+
+    // keep it allocated in the cache of the current CPU
+    unsigned cpu = slot(BaseProgram::mycpu());
+    for (unsigned i = 0; i < CACHE_SIZE; i++)
+      if (!_cache[cpu][i] && !Cpu::cmpxchg4b(&_cache[cpu][i], 0, cap)) return;
+
+    Base::release_range(cap - Base::_cap_base, 1);
+  }
 };
@@ -0,0 +1,40 @@
+/*
+ * Boot thread pool for sigma0.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "bootpool.h"
+
+BootPool *boot_pool;
+static bool boot_serial;
+
+PARAM_HANDLER(bootpool,
+	      "bootpool - start configs and prepare their memory in parallel on all CPUs",
+	      "Has to come after boot_s0_services, as the threads are admitted by the admission service.")
+{
+  if (boot_pool) return;
+  boot_pool = new BootPool(mb);
+  boot_pool->serial = boot_serial;
+  Logging::printf("bp: %u boot threads%s\n", boot_pool->threads(), boot_serial ? " - serial" : "");
+}
+
+PARAM_HANDLER(boot_serial,
+	      "boot_serial - do everything in the calling thread, e.g. to compare boot times")
+{
+  boot_serial = true;
+  if (boot_pool) boot_pool->serial = true;
+}
+
+// EOF
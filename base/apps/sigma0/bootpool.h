@@ -0,0 +1,177 @@
+/*
+ * Boot thread pool for sigma0.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#include "nul/motherboard.h"
+#include "sys/semaphore.h"
+
+/**
+ * A pool with one boot thread per CPU.
+ *
+ * Jobs are grouped into batches. The submitter of a batch waits at a
+ * barrier until all of its jobs are done. While waiting, it runs the
+ * jobs of its own batch that are still queued, so that a job may
+ * submit a nested batch without deadlocking the pool.
+ *
+ * A batch either has a semaphore that is upped when the last job
+ * finishes or the waiter spins, which is only useful for short jobs.
+ */
+class BootPool
+{
+public:
+  typedef void (*JobFunction)(void *arg, unsigned nr);
+
+  struct Batch {
+    long volatile    pending;
+    unsigned         count;
+    KernelSemaphore *done;
+    Batch(KernelSemaphore *_done = 0) : pending(0), count(0), done(_done) {}
+  };
+
+private:
+  enum {
+    SLOTS      = 64,
+    SLOT_FREE  = 0,
+    SLOT_FILL,
+    SLOT_READY,
+    SLOT_RUN,
+  };
+
+  struct Job {
+    unsigned volatile state;
+    JobFunction       func;
+    void             *arg;
+    unsigned          nr;
+    Batch            *batch;
+  };
+
+  Job             _jobs[SLOTS];
+  KernelSemaphore _work;
+  unsigned        _threads;
+
+  static void finish(Batch *batch) {
+    if (Cpu::atomic_xadd(&batch->pending, -1) == 1 && batch->done) batch->done->up();
+  }
+
+  /**
+   * Run a single queued job, optionally only one of the given batch.
+   */
+  bool run_one(Batch *only = 0) {
+    for (unsigned i = 0; i < SLOTS; i++) {
+      Job &job = _jobs[i];
+      if (job.state != SLOT_READY || (only && job.batch != only)) continue;
+      if (Cpu::cmpxchg4b(&job.state, SLOT_READY, SLOT_RUN) != SLOT_READY) continue;
+
+      JobFunction func = job.func;
+      void *arg        = job.arg;
+      unsigned nr      = job.nr;
+      Batch *batch     = job.batch;
+      MEMORY_BARRIER;
+      job.state = SLOT_FREE;
+
+      func(arg, nr);
+      finish(batch);
+      return true;
+    }
+    return false;
+  }
+
+  void work() __attribute__((noreturn)) {
+    while (1) {
+      _work.down();
+      run_one();
+    }
+  }
+
+  static void do_work(void *t) REGPARM(0) NORETURN { reinterpret_cast<BootPool *>(t)->work(); }
+
+public:
+  bool serial;
+
+  unsigned threads() { return serial ? 0 : _threads; }
+
+  /**
+   * Queue a job. Without a free slot or in serial mode the job is
+   * executed directly.
+   */
+  void submit(Batch &batch, JobFunction func, void *arg, unsigned nr) {
+    // the first job takes an extra reference that only barrier()
+    // drops, so that the semaphore is upped once per batch
+    if (!batch.count++) Cpu::atomic_xadd(&batch.pending, 1);
+    Cpu::atomic_xadd(&batch.pending, 1);
+    if (!serial)
+      for (unsigned i = 0; i < SLOTS; i++) {
+        Job &job = _jobs[i];
+        if (job.state != SLOT_FREE || Cpu::cmpxchg4b(&job.state, SLOT_FREE, SLOT_FILL) != SLOT_FREE) continue;
+        job.func  = func;
+        job.arg   = arg;
+        job.nr    = nr;
+        job.batch = &batch;
+        MEMORY_BARRIER;
+        job.state = SLOT_READY;
+        _work.up();
+        return;
+      }
+    func(arg, nr);
+    finish(&batch);
+  }
+
+  /**
+   * Wait until all jobs of the batch are done.
+   */
+  void barrier(Batch &batch) {
+    if (!batch.count) return;
+    while (batch.pending > 1 && run_one(&batch)) {}
+
+    // drop the extra reference, the semaphore is upped when the last one is gone
+    finish(&batch);
+    if (batch.done) batch.done->down();
+    else while (batch.pending) Cpu::pause();
+    assert(!batch.pending);
+    batch.count = 0;
+  }
+
+  /**
+   * Fork count jobs and join them again.
+   */
+  void parallel(JobFunction func, void *arg, unsigned count) {
+    Batch batch;
+    for (unsigned i = 0; i < count; i++) submit(batch, func, arg, i);
+    barrier(batch);
+  }
+
+  BootPool(Motherboard &mb) : _jobs(), _work(0), _threads(0), serial(false)
+  {
+    MessageHostOp msg(MessageHostOp::OP_ALLOC_SEMAPHORE, 0UL);
+    if (!mb.bus_hostop.send(msg)) Logging::panic("bp: could not allocate semaphore");
+    _work = KernelSemaphore(msg.value);
+
+    Hip *hip = mb.hip();
+    for (unsigned i = 0; i < hip->cpu_desc_count(); i++) {
+      if (not hip->cpus()[i].enabled()) continue;
+      MessageHostOp msg2 = MessageHostOp::alloc_service_thread(BootPool::do_work, this, "boot", 1UL, i);
+      if (!mb.bus_hostop.send(msg2)) Logging::panic("bp: alloc service thread on CPU %u failed", i);
+      _threads++;
+    }
+  }
+};
+
+/**
+ * The pool is created with the 'bootpool' parameter. Without it
+ * everything is done sequentially by the caller.
+ */
+extern BootPool *boot_pool;
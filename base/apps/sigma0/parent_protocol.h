@@ -27,6 +27,25 @@ PARAM_HANDLER(quota, "quota - used by parent protocol") {}
 
 class s0_ParentProtocol : public CapAllocator {
 
+public:
+
+  /**
+   * The parts of a client cmdline used by the parent protocol. They
+   * are parsed once, when the module is started.
+   */
+  struct Permissions {
+    enum { MAXNAMES = 32 };
+    struct Name {
+      char const *      name;     ///< postfix of the "name::" parameter (including the namespace)
+      unsigned          len;
+      unsigned volatile session;  ///< identity of the session opened via this name
+    } names[MAXNAMES];
+    unsigned     count;
+    char const * ns;              ///< postfix of the "namespace::" parameter
+    unsigned     ns_len;
+    bool         guid;            ///< "quota::guid" was given
+  };
+
 private:
 
   // data per physical CPU number
@@ -34,13 +53,19 @@ private:
     unsigned  cap_ec_parent;
   } _percpu[MAXCPUS];
 
+  static Permissions _permissions[MAXMODULES];
+
   /**
    * Missing: kill a client, mem+cap quota support
    */
   struct ClientData : public GenericClientData {
     char const    * name;
     unsigned        len;
+    unsigned        hash;
     unsigned        singleton;
+    Permissions::Name * perm;
+    /// Portal per CPU from the last TYPE_GET_PORTAL together with the registry generation.
+    unsigned long long portals[MAXCPUS];
 
     /* TODO: Move this to s0_modules.h */
     struct Cmdline {
@@ -84,9 +109,8 @@ private:
       if (!strcmp(quota_name, "mem") || !strcmp(quota_name, "cap")) return ENONE;
 
       if (!strcmp(quota_name, "guid")) {
-        unsigned long s0_cmdlen;
-        char const *pos, *cmdline = get_client_cmdline(input.identity(0), s0_cmdlen);
-        if (cmdline && (pos = strstr(cmdline, "quota::guid")) && pos < cmdline + s0_cmdlen) {
+        Permissions *perm = get_permissions(input.identity(0));
+        if (perm && perm->guid) {
           *value_out = get_client_number(parent_cap);
 //        Logging::printf("send clientid %lx from %x\n", *value_out, parent_cap);
           return ENONE;
@@ -133,8 +157,24 @@ private:
     unsigned        cpu;
     unsigned        pt;
     char *          mem_revoke;
+
+    // the name is freed only together with the data, as it is compared without holding a lock
+    ~ServerData() { delete [] name; }
   };
 
+  enum {
+    SERVICE_SLOTS   = 1024, // must be a power of two
+    SERVICE_DELETED = 1,
+  };
+
+  /**
+   * Service "registry" index - open addressing with the hash of the
+   * name and the CPU as key. Deleted entries are marked and reused by
+   * later registrations. The lookup has to hold a GuardS.
+   */
+  ServerData * volatile _services[SERVICE_SLOTS];
+  unsigned volatile     _generation; ///< incremented whenever a service is removed
+
   static char const * get_client_cmdline(unsigned identity, unsigned long &s0_cmdlen);
   static char * get_client_memory(unsigned identity, unsigned client_mem_revoke);
 
@@ -150,37 +190,96 @@ private:
     return cap >> CLIENT_PT_SHIFT;
   }
 
+  static Permissions * get_permissions(unsigned identity) {
+    unsigned clientnr = get_client_number(identity);
+    return clientnr < MAXMODULES ? _permissions + clientnr : 0;
+  }
+
+  static unsigned hash(char const *name, unsigned len) {
+    unsigned res = 2166136261u; // FNV-1a
+    for (unsigned i = 0; i < len; i++) res = (res ^ static_cast<unsigned char>(name[i])) * 16777619u;
+    return res;
+  }
+
+  static unsigned service_slot(unsigned hash, unsigned cpu, unsigned i) {
+    return (hash + cpu * 0x9e3779b9u + i) & (SERVICE_SLOTS - 1);
+  }
+
+  static bool portal_exists(unsigned pt) {
+    unsigned crdout;
+    return !nova_syscall(NOVA_LOOKUP, Crd(pt, 0, DESC_CAP_ALL).value(), 0, 0, 0, &crdout) && crdout;
+  }
+
+  ServerData * find_service(char const *name, unsigned len, unsigned hash, unsigned cpu) {
+    for (unsigned i = 0; i < SERVICE_SLOTS; i++) {
+      ServerData *s = _services[service_slot(hash, cpu, i)];
+      if (!s) break;
+      if (reinterpret_cast<unsigned long>(s) == SERVICE_DELETED) continue;
+      if (s->hash == hash && s->cpu == cpu && s->len == len + 1 && !memcmp(s->name, name, len)) return s;
+    }
+    return 0;
+  }
+
+  bool add_service(ServerData *sdata) {
+    for (unsigned i = 0; i < SERVICE_SLOTS; i++) {
+      ServerData * volatile *slot = _services + service_slot(sdata->hash, sdata->cpu, i);
+      unsigned long old = reinterpret_cast<unsigned long>(*slot);
+      if (old > SERVICE_DELETED) continue;
+      if (Cpu::cmpxchg4b(slot, old, reinterpret_cast<unsigned long>(sdata)) == old) return true;
+    }
+    return false;
+  }
+
+  void remove_service(ServerData *sdata) {
+    for (unsigned i = 0; i < SERVICE_SLOTS; i++) {
+      ServerData * volatile *slot = _services + service_slot(sdata->hash, sdata->cpu, i);
+      if (!*slot) return;
+      if (*slot == sdata) {
+        Cpu::cmpxchg4b(slot, reinterpret_cast<unsigned long>(sdata), SERVICE_DELETED);
+        return;
+      }
+    }
+  }
+
   unsigned get_portal(Utcb &utcb, unsigned cap_client, unsigned &portal) {
     ClientData *cdata;
-    ServerData *sdata;
-    unsigned res;
+    unsigned res, cpu = utcb.head.nul_cpunr;
 
     GuardC guard_c(&session);
     if ((res = session.get_client_data(utcb, cdata, cap_client))) return res;
     //Logging::printf("\tfound session cap %x for client %x %.*s\n", cap_client, cdata->pseudonym, cdata->len, cdata->name);
 
+    // the cached portal is valid as long as no service was removed
+    unsigned generation = _generation;
+    unsigned long long cached = Cpu::cmpxchg8b(&cdata->portals[cpu], 0, 0);
+    if (cached && (cached >> 32) == generation && portal_exists(static_cast<unsigned>(cached))) {
+      portal = static_cast<unsigned>(cached);
+      return ENONE;
+    }
+
     GuardS guard_s(&_server);
-    for (sdata = _server.next(); sdata; sdata = _server.next(sdata))
-       if (sdata->cpu == utcb.head.nul_cpunr && cdata->len == sdata->len-1 && !memcmp(cdata->name, sdata->name, cdata->len)) {
-         // check that the server portal still exists, if not free the server-data and tell the client to retry
-         unsigned crdout;
-         if (nova_syscall(NOVA_LOOKUP, Crd(sdata->pt, 0, DESC_CAP_ALL).value(), 0, 0, 0, &crdout) || !crdout) {
-           free_service(utcb, sdata);
-           return ERETRY;
-         }
-         portal = sdata->pt;
-         return ENONE;
-       }
-    //Logging::printf("s0: we have no service portal for '%10s...' yet - retry later\n", cdata->name);
-    // we do not have a server portal yet, thus tell the client to retry later
-    return ERETRY;
+    ServerData *sdata = find_service(cdata->name, cdata->len, cdata->hash, cpu);
+    if (!sdata) {
+      //Logging::printf("s0: we have no service portal for '%10s...' yet - retry later\n", cdata->name);
+      // we do not have a server portal yet, thus tell the client to retry later
+      return ERETRY;
+    }
+
+    // check that the server portal still exists, if not free the server-data and tell the client to retry
+    if (!portal_exists(sdata->pt)) {
+      free_service(utcb, sdata);
+      return ERETRY;
+    }
+    portal = sdata->pt;
+    Cpu::cmpxchg8b(&cdata->portals[cpu], cached, static_cast<unsigned long long>(generation) << 32 | portal);
+    return ENONE;
   }
 
   /**
    * Check whether a client has the permission to access a service.
    *
-   * Parse the client's cmdline for "name::" prefixes and check whether the
-   * postfix matches the requested name. In the current
+   * Search the "name::" parameters of the client and check whether
+   * the postfix matches the requested name. In the current
    * implementation, it is only checked whether the trailing part of
    * the postfix (without the namespace) matches the requested name.
    *
@@ -188,30 +287,19 @@ private:
    * @param request Name of the requested service
    * @param request_len Length of the name
    * @param instance Which instance of the service is requested
-   * @param[out] cmdline Pointer to the postfix of the matching "name::" parameter (including the namespace)
-   * @param[out] namelen The length the postfix
+   * @param[out] name The matching "name::" parameter
    */
   unsigned check_permission(
     unsigned identity, const char *request, unsigned request_len,
-    unsigned instance, char const * &cmdline, unsigned &namelen)
+    unsigned instance, Permissions::Name * &name)
   {
-    unsigned long s0_cmdlen;
-    cmdline = get_client_cmdline(identity, s0_cmdlen);
-    char const * cmdline_end = cmdline + s0_cmdlen;
-    if (!cmdline) return EPROTO;
-    cmdline = strstr(cmdline, "name::");
-    while (cmdline && cmdline < cmdline_end) {
-      cmdline += 6;
-      namelen = strcspn(cmdline, " \t\r\n\f");
-      if ((request_len > namelen) || (0 != memcmp(cmdline + namelen - request_len, request, request_len)) ||
-          (*(cmdline + namelen - request_len - 1) != '/')) {
-        cmdline = strstr(cmdline + namelen, "name::");
+    Permissions *perm = get_permissions(identity);
+    if (!perm) return EPROTO;
+    for (name = perm->names; name < perm->names + perm->count; name++) {
+      if ((request_len > name->len) || (0 != memcmp(name->name + name->len - request_len, request, request_len)) ||
+          (*(name->name + name->len - request_len - 1) != '/'))
         continue;
-      }
-      if (instance--) {
-        cmdline = strstr(cmdline + namelen, "name::");
-        continue;
-      }
+      if (instance--) continue;
       return ENONE;
     }
     //Logging::printf("s0: client has no permission to access service '%s'\n", request);
@@ -220,8 +308,9 @@ private:
   }
 
   unsigned free_service(Utcb &utcb, ServerData *sdata) {
+    remove_service(sdata);
+    Cpu::atomic_xadd(&_generation, 1U);
     if (sdata->pt) dealloc_cap(sdata->pt);
-    if (sdata->name) delete [] sdata->name;
     ServerData::get_quota(utcb, sdata->pseudonym, "cap", -1);
     ServerData::get_quota(utcb, sdata->pseudonym, "mem", -sdata->len);
     return _server.free_client_data(utcb, sdata, this);
@@ -235,13 +324,17 @@ private:
 
     {
       GuardS guard_s(&_server);
-      for (ServerData * sdata = _server.next(); sdata; sdata = _server.next(sdata))
-        if (sdata->cpu == utcb.head.nul_cpunr && c->len == sdata->len-1 &&
-            !memcmp(c->name, sdata->name, c->len) && sdata->mem_revoke)
-              *sdata->mem_revoke = 1; //flag revoke
+      ServerData * sdata = find_service(c->name, c->len, c->hash, utcb.head.nul_cpunr);
+      if (sdata && sdata->mem_revoke) *sdata->mem_revoke = 1; //flag revoke
     }
   }
 
+  unsigned free_session(Utcb &utcb, ClientData *c) {
+    notify_service(utcb, c);
+    if (c->perm) Cpu::cmpxchg4b(&c->perm->session, c->get_identity(), 0);
+    return session.free_client_data(utcb, c, this);
+  }
+
 public:
   unsigned portal_func(Utcb &utcb, Utcb::Frame &input, bool &free_cap, cap_sel pid) {
     unsigned res;
@@ -251,23 +344,24 @@ public:
     switch (op) {
     case ParentProtocol::TYPE_OPEN:
       {
-        unsigned instance, request_len, service_name_len;
-        const char *request, *service_name;
+        unsigned instance, request_len;
+        const char *request;
+        Permissions::Name *perm;
         ClientData *cdata;
 
         if (input.get_word(instance) || !(request = input.get_zero_string(request_len))) return EPROTO;
-        if (res = check_permission(input.identity(0), request, request_len, instance,
-                                   service_name, service_name_len)) return res;
+        if (res = check_permission(input.identity(0), request, request_len, instance, perm)) return res;
 
         // check whether such a session is already known from our client
         {
           GuardC guard_c(&session);
-          for (ClientData * c = session.next(); c; c = session.next(c))
-            if (c->name == service_name && c->pseudonym == input.identity()) {
-              utcb << Utcb::TypedMapCap(c->get_identity());
-              //Logging::printf("pp: has already a cap %s identity=0x%x pseudo=0x%x %10s\n", request, c->get_identity(), c->pseudonym, service_name);
-              return ENONE;
-            }
+          ClientData * c;
+          if (perm->session && !session.get_client_data(utcb, c, perm->session) &&
+              c->perm == perm && c->pseudonym == input.identity()) {
+            utcb << Utcb::TypedMapCap(c->get_identity());
+            //Logging::printf("pp: has already a cap %s identity=0x%x pseudo=0x%x %10s\n", request, c->get_identity(), c->pseudonym, perm->name);
+            return ENONE;
+          }
         }
 
         res = session.alloc_client_data(utcb, cdata, input.identity()/*becomes cdata->pseudonym*/, this);
@@ -281,18 +375,19 @@ public:
             //Logging::printf("pp: found dead client - freeing datastructure\n");
             count++;
 
-            notify_service(utcb, data);
-
-            session.free_client_data(utcb, data, this);
+            free_session(utcb, data);
             data = session.get_invalid_client(utcb, this, data);
           }
           if (count > 0) return ERETRY;
           else return ERESOURCE;
         }
 
-        cdata->name = service_name;
+        cdata->name = perm->name;
+        cdata->hash = hash(perm->name, perm->len);
+        cdata->perm = perm;
         MEMORY_BARRIER; //make sure cdata is complete, len could be used in parallel to decide to compare against cdata->name already
-        cdata->len  = service_name_len;
+        cdata->len  = perm->len;
+        perm->session = cdata->get_identity();
         //Logging::printf("pp: created new client  service='%.*s' identity=%#x pseudo=%#x\n", cdata->len, cdata->name, cdata->get_identity(), cdata->pseudonym);
         utcb << Utcb::TypedMapCap(cdata->get_identity());
         return ENONE;
@@ -305,8 +400,7 @@ public:
 
         if ((res = session.get_client_data(utcb, cdata, input.identity()))) return res;
         //Logging::printf("pp: close session for service='%.*s' identity=%#x pseudo=%#x\n", cdata->len, cdata->name, cdata->get_identity(), cdata->pseudonym);
-        notify_service(utcb, cdata); // XXX: Race - see below
-        return session.free_client_data(utcb, cdata, this);
+        return free_session(utcb, cdata); // XXX: Race - see below
       }
     case ParentProtocol::TYPE_GET_PORTAL:
       {
@@ -324,14 +418,11 @@ public:
         if (input.get_word(cpu) || !(request = input.get_zero_string(request_len))) return EPROTO;
 
         // search for an allowed namespace
-        unsigned long s0_cmdlen;
-        char const * cmdline, * _cmdline = get_client_cmdline(input.identity(0), s0_cmdlen);
-        if (!_cmdline) return EPROTO;
-        //Logging::printf("\tregister client %x @ cpu %x _cmdline '%.10s' servicename '%.10s'\n", input.identity(), cpu, _cmdline, request);
-        cmdline = strstr(_cmdline, "namespace::");
-        if (!cmdline || cmdline > _cmdline + s0_cmdlen) return EPERM;
-        cmdline += sizeof("namespace::")-1;
-        unsigned namespace_len = strcspn(cmdline, " \t");
+        Permissions *perm = get_permissions(input.identity(0));
+        if (!perm) return EPROTO;
+        //Logging::printf("\tregister client %x @ cpu %x servicename '%.10s'\n", input.identity(), cpu, request);
+        if (!perm->ns) return EPERM;
+        unsigned namespace_len = perm->ns_len;
 
         QuotaGuard<ServerData> guard1(utcb, input.identity(), "mem", request_len + namespace_len + 1);
         QuotaGuard<ServerData> guard2(utcb, input.identity(), "cap", 1, &guard1);
@@ -361,9 +452,10 @@ public:
           return ERESOURCE;
         }
 
-        memcpy(tmp, cmdline, namespace_len);
+        memcpy(tmp, perm->ns, namespace_len);
         memcpy(tmp + namespace_len, request, request_len);
         tmp[slen - 1] = 0;
+        sdata->hash = hash(tmp, slen - 1);
         sdata->cpu  = cpu;
         sdata->pt   = input.received_cap();
 
@@ -376,18 +468,25 @@ public:
         sdata->len  = slen;
         {
           GuardS guard_s(&_server);
-          for (ServerData * s2 = _server.next(); s2; s2 = _server.next(s2))
-            if (s2->len == sdata->len && !memcmp(sdata->name, s2->name, sdata->len) && sdata->cpu == s2->cpu && sdata->pt != s2->pt) {
-              free_service(utcb, sdata);
-              return EEXISTS;
-            }
+          ServerData * s2 = find_service(sdata->name, sdata->len - 1, sdata->hash, sdata->cpu);
+          if (s2 || !add_service(sdata)) {
+            free_service(utcb, sdata);
+            return s2 ? EEXISTS : ERESOURCE;
+          }
+
+          // a concurrent registration of the same name may have won the race
+          s2 = find_service(sdata->name, sdata->len - 1, sdata->hash, sdata->cpu);
+          if (s2 != sdata) {
+            free_service(utcb, sdata);
+            return EEXISTS;
+          }
         }
 
         // wakeup clients that wait for us
         {
           GuardC guard_c(&session);
           for (ClientData * c = session.next(); c; c = session.next(c))
-          if (c->len == sdata->len-1 && !memcmp(c->name, sdata->name, c->len)) {
+          if (c->hash == sdata->hash && c->len == sdata->len-1 && !memcmp(c->name, sdata->name, c->len)) {
             //Logging::printf("\tnotify client %x\n", c->pseudonym);
             unsigned res = nova_semup(c->get_identity());
             assert(res == ENONE); //c->identity is allocated by us
@@ -455,10 +554,9 @@ public:
         for (ClientData * c = session.next(); c; c = session.next(c)) {
           if (c->pseudonym != input.identity(1)) continue;
 
-          notify_service(utcb, c); // XXX: Race - clients can notice which client was killed only after we revoke pseudonym, i.e. after return from this block (Guard)
-
           //Logging::printf("s0: freeing session to service on behalf of a dying client\n");
-          res = session.free_client_data(utcb, c, this);
+          // XXX: Race - clients can notice which client was killed only after we revoke pseudonym, i.e. after return from this block (Guard)
+          res = free_session(utcb, c);
           assert(res == ENONE);
         }
         return ENONE;
@@ -484,9 +582,42 @@ public:
    * both.
    */
   s0_ParentProtocol(unsigned cap_start, unsigned cap_order, unsigned cap_all_start, unsigned cap_all_order)
-    : CapAllocator(cap_start, cap_start, cap_order), _cap_all_start(cap_all_start), _cap_all_order(cap_all_order)
+    : CapAllocator(cap_start, cap_start, cap_order), _generation(0), _cap_all_start(cap_all_start), _cap_all_order(cap_all_order)
   {
     assert((cap_all_start & ((1U << cap_all_order)-1)) == 0);
+    memset(const_cast<ServerData **>(_services), 0, sizeof(_services));
+  }
+
+  /**
+   * Parse the "name::", "namespace::" and "quota::guid" parameters
+   * in the sigma0 part of a client cmdline.
+   */
+  static void set_permissions(unsigned clientnr, char const *cmdline, unsigned long len) {
+    assert(clientnr < MAXMODULES);
+    Permissions &perm = _permissions[clientnr];
+    char const *end = cmdline + len;
+    memset(&perm, 0, sizeof(perm));
+
+    for (char const *p = strstr(cmdline, "name::"); p && p < end; p = strstr(p, "name::")) {
+      p += sizeof("name::") - 1;
+      unsigned namelen = strcspn(p, " \t\r\n\f");
+      if (perm.count < Permissions::MAXNAMES) {
+        perm.names[perm.count].name = p;
+        perm.names[perm.count].len  = namelen;
+        perm.count++;
+      } else
+        Logging::printf("s0: [%2u] too many name:: parameters - '%.*s' ignored\n", clientnr, namelen, p);
+      p += namelen;
+    }
+
+    char const *p = strstr(cmdline, "namespace::");
+    if (p && p <= end) {
+      perm.ns     = p + sizeof("namespace::") - 1;
+      perm.ns_len = strcspn(perm.ns, " \t");
+    }
+
+    p = strstr(cmdline, "quota::guid");
+    perm.guid = p && p < end;
   }
 
   unsigned alloc_crd() { return Crd(alloc_cap(), 0, DESC_CAP_ALL).value(); }
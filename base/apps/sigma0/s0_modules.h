@@ -50,6 +50,7 @@
     modinfo->cmdline        = cmdline;
     modinfo->sigma0_cmdlen  = sigma0_cmdlen;
     modinfo->type           = ModuleInfo::TYPE_APP;
+    s0_ParentProtocol::set_permissions(module, cmdline, sigma0_cmdlen);
 
     LOG_VERBOSE("s0: [%2u] module '", modinfo->id);
     if (verbose & VERBOSE_INFO) fancy_output(cmdline, 4096);
@@ -147,10 +148,18 @@
     unsigned long long msize, physaddr;
     char *addr;
     ModuleInfo * modinfo;
+    // Boot modules do not change, so their read-only pages can be shared.
+    bool share = !strcmp(fs_name, "fs/rom");
+    ImageCache * image = share ? find_image(file_name, namelen) : 0;
 
     FsProtocol fs_obj = FsProtocol(alloc_cap(FsProtocol::CAP_SERVER_PT + _hip->cpu_desc_count()), fs_name);
     FsProtocol::dirent fileinfo;
     FsProtocol::File file_obj(fs_obj, alloc_cap());
+    if (image) {
+      addr          = image->addr;
+      fileinfo.size = image->size;
+      goto start;
+    }
     if ((ENONE != fs_obj.get(*utcb, file_obj, file_name, namelen)) ||
         (ENONE != file_obj.get_info(*utcb, fileinfo))) { Logging::printf("s0: File not found '%s'\n", file_name); res = __LINE__; goto fs_out; }
 
@@ -164,17 +173,23 @@
     addr = map_self(utcb, physaddr, msize, DESC_MEM_ALL, true);
     if (!addr) { Logging::printf("s0: Could not map file\n"); res= __LINE__; goto phys_out; }
     if (file_obj.copy(*utcb, addr, fileinfo.size)) { Logging::printf("s0: Getting file failed %s.\n", file_name); res = __LINE__; goto map_out; }
+    share = share && cache_image(file_name, namelen, addr, fileinfo.size);
 
+  start:
     modinfo = alloc_module(mconfig, sigma0_cmdlen, part_of_s0);
-    if (!modinfo) { Logging::printf("s0: to many modules to start -- increase MAXMODULES in %s\n", __FILE__); res = __LINE__; goto map_out; }
+    if (!modinfo) { Logging::printf("s0: to many modules to start -- increase MAXMODULES in %s\n", __FILE__); res = __LINE__; goto started; }
     if ( modinfo->id == 1) modinfo->type = ModuleInfo::TYPE_ADMISSION; //XXX
 
-    res = _start_config(utcb, addr, fileinfo.size, client_cmdline, modinfo, sc_usage_cap, bswitch);
+    res = _start_config(utcb, addr, fileinfo.size, client_cmdline, modinfo, sc_usage_cap, bswitch, share);
 
     if (!res) internal_id = modinfo->id;
     if (!res) usage_mem   = modinfo->physsize;
     if (res) free_module(modinfo);
 
+  started:
+    // cached images stay mapped, clients may use their pages
+    if (share) goto fs_out;
+
   map_out:
     //don't try to unmap from ourself "revoke(..., true)"
     //map_self may return an already mapped page (backed by 4M) which contains the requested phys. page
@@ -245,8 +260,84 @@ bool map_exc_pts(const ModuleInfo * modinfo, unsigned pt)
   return false;
 }
 
+  struct ZeroJob {
+    char *mem;
+    unsigned long size;
+    unsigned long chunk;
+  };
+
+  static void do_zero(void *arg, unsigned nr) {
+    ZeroJob *job = reinterpret_cast<ZeroJob *>(arg);
+    unsigned long start = nr * job->chunk;
+    if (start < job->size) memset(job->mem + start, 0, MIN(job->chunk, job->size - start));
+  }
+
+  /**
+   * Zero client memory. Large areas are split over the boot pool.
+   */
+  static void zero_memory(char *mem, unsigned long size) {
+    enum { MIN_CHUNK = 4 << 20 };
+    unsigned parts = boot_pool ? boot_pool->threads() + 1 : 1;
+    if (parts > size / MIN_CHUNK) parts = size / MIN_CHUNK;
+    if (parts <= 1) { memset(mem, 0, size); return; }
+
+    ZeroJob job = { mem, size, ((size / parts) + 0xfff) & ~0xffful };
+    boot_pool->parallel(do_zero, &job, parts);
+  }
+
+  /**
+   * Find a cached boot module.
+   */
+  ImageCache * find_image(char const * name, unsigned namelen) {
+    for (unsigned i = 0; i < MAXIMAGES; i++)
+      if (_images[i].addr && !strncmp(_images[i].name, name, namelen) && !_images[i].name[namelen]) return _images + i;
+    return 0;
+  }
+
+  /**
+   * Keep a boot module in memory. Returns false if the cache is full
+   * or a parallel start was faster.
+   */
+  bool cache_image(char const * name, unsigned namelen, char * addr, unsigned long long size) {
+    if (namelen >= sizeof(_images[0].name)) return false;
+    SemaphoreGuard l(_lock_mem);
+    if (find_image(name, namelen)) return false;
+    for (unsigned i = 0; i < MAXIMAGES; i++)
+      if (!_images[i].addr) {
+        memcpy(_images[i].name, name, namelen);
+        _images[i].name[namelen] = 0;
+        _images[i].size = size;
+        MEMORY_BARRIER;
+        _images[i].addr = addr;
+        return true;
+      }
+    return false;
+  }
+
+  /**
+   * Record the read-only pages of a cached ELF image, which are
+   * mapped directly to the client instead of being copied.
+   */
+  void share_ro_pages(char * elf, ModuleInfo * modinfo) {
+    struct eh32 *eh = reinterpret_cast<struct eh32 *>(elf);
+    unsigned n = 0;
+    for (unsigned j = 0; j < eh->e_phnum; j++) {
+      struct ph32 *ph = reinterpret_cast<struct ph32 *>(elf + eh->e_phoff + j*eh->e_phentsize);
+      unsigned long offset, paddr, size;
+      if (!Elf::ro_pages(ph, offset, paddr, size)) continue;
+      if (n < ModuleInfo::MAXSHARED) {
+        modinfo->shared[n].client = paddr;
+        modinfo->shared[n].size   = size;
+        modinfo->shared[n].image  = elf + offset;
+        n++;
+      } else
+        memcpy(modinfo->mem + paddr - MEM_OFFSET, elf + offset, size);
+    }
+  }
+
   unsigned _start_config(Utcb * utcb, char * elf, unsigned long mod_size,
-                         char const * client_cmdline, ModuleInfo * modinfo, unsigned &sc_usage_cap, bool bswitch)
+                         char const * client_cmdline, ModuleInfo * modinfo, unsigned &sc_usage_cap, bool bswitch,
+                         bool share = false)
   {
     AdmissionProtocol::sched sched; //Qpd(1, 100000)
     unsigned res = 0, slen, pt = 0;
@@ -254,6 +345,7 @@ bool map_exc_pts(const ModuleInfo * modinfo, unsigned pt)
     unsigned long long phip = 0;
     Hip * modhip = 0;
     char * tmem;
+    bool locked = false;
 
     // Figure out how much memory we give the client. If the user
     // didn't give a limit, we give it enough to unpack the ELF.
@@ -292,10 +384,11 @@ bool map_exc_pts(const ModuleInfo * modinfo, unsigned pt)
      * deterministic run and not leak any information between
      * clients.
      */
-    memset(modinfo->mem, 0, modinfo->physsize);
+    zero_memory(modinfo->mem, modinfo->physsize);
 
     // decode ELF
-    check2(_free_pmem, (Elf::decode_elf(elf, mod_size, modinfo->mem, modinfo->rip, maxptr, modinfo->physsize, MEM_OFFSET, Config::NUL_VERSION)));
+    check2(_free_pmem, (Elf::decode_elf(elf, mod_size, modinfo->mem, modinfo->rip, maxptr, modinfo->physsize, MEM_OFFSET, Config::NUL_VERSION, share)));
+    if (share) share_ro_pages(elf, modinfo);
 
     // alloc memory for client hip
     {
@@ -306,6 +399,10 @@ bool map_exc_pts(const ModuleInfo * modinfo, unsigned pt)
     modinfo->hip = map_self(utcb, phip, 0x1000U, DESC_MEM_ALL, true);
     check2(_free_pmem, (modinfo->hip ? 0 : ERESOURCE), "\ns0: [%2u] hip(0x1000U) could not be mapped", modinfo->id);
 
+    // Consoles, drives and portals are set up for one module after the other.
+    _lock_start.down();
+    locked = true;
+
     // allocate a console for it
     alloc_console(modinfo, modinfo->cmdline, bswitch);
     attach_drives(modinfo->cmdline, modinfo->sigma0_cmdlen, modinfo->id);
@@ -396,6 +493,7 @@ bool map_exc_pts(const ModuleInfo * modinfo, unsigned pt)
       _free_phys.add(Region(pmem, modinfo->physsize, pmem));
       if (phip) _free_phys.add(Region(phip, 0x1000U, phip));
     }
+    if (locked) _lock_start.up();
 
     return res;
   }
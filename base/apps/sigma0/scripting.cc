@@ -21,6 +21,7 @@
 
 #include "nul/baseprogram.h"
 #include "nul/service_timer.h"
+#include "bootpool.h"
 
 /**
  * Single script item.
@@ -43,6 +44,9 @@ struct ScriptItem {
 
 /**
  * Simple scripting support.
+ *
+ * With a boot pool, consecutive start items are executed in
+ * parallel. Every other item waits until they are finished.
  */
 struct Script : public StaticReceiver<Script> {
   TimerProtocol       *_service_timer;
@@ -50,17 +54,48 @@ struct Script : public StaticReceiver<Script> {
   DBus<MessageHostOp> &_bus_hostop;
   Clock               *_clock;
   KernelSemaphore      _worker;
+  KernelSemaphore      _started;
   ScriptItem          *_head;
+
+  struct StartJob {
+    Script   *script;
+    StartJob *next;
+    MessageConsole msg;
+    bool      ok;
+    StartJob(Script *_script, unsigned long config) : script(_script), next(0), msg(MessageConsole::TYPE_START, config), ok(false) {}
+  };
+
+  static void do_start(void *arg, unsigned) {
+    StartJob *job = reinterpret_cast<StartJob *>(arg);
+    job->ok = job->script->_bus_console.send(job->msg);
+  }
+
+  /**
+   * Wait for the started configs and return the last child id.
+   */
+  unsigned finish_starts(BootPool::Batch &batch, StartJob *&jobs, unsigned last_child_id) {
+    if (!jobs) return last_child_id;
+    boot_pool->barrier(batch);
+    while (jobs) {
+      StartJob *job = jobs;
+      jobs = job->next;
+      if (job->ok) last_child_id = job->msg.id;
+      delete job;
+    }
+    return last_child_id;
+  }
   /**
    * Do the actual work.
    */
   void work() __attribute__((noreturn))  {
     Utcb &utcb = *BaseProgram::myutcb();
+    BootPool::Batch batch(&_started);
     while (1) {
       _worker.down();
 
       bool work_done = false;
       unsigned last_child_id = ~0U;
+      StartJob *jobs = 0, **tail = &jobs;
       while (_head) {
         work_done = true;
 
@@ -69,6 +104,22 @@ struct Script : public StaticReceiver<Script> {
         delete tmp;
         _head = item.next;
 
+        if (item.type == ScriptItem::TYPE_START && boot_pool) {
+          Logging::printf("sc: start %ld-%ld count %ld in parallel\n", item.param0, item.param1, item.param2);
+          while (item.param2--)
+            for (unsigned long nr = 0; nr < item.param1; nr++) {
+              StartJob *job = new StartJob(this, item.param0 + nr);
+              *tail = job;
+              tail  = &job->next;
+              boot_pool->submit(batch, do_start, job, nr);
+            }
+          continue;
+        }
+
+        // all other items are barriers
+        last_child_id = finish_starts(batch, jobs, last_child_id);
+        tail = &jobs;
+
         if (item.type == ScriptItem::TYPE_WAIT) {
           Logging::printf("sc: wait %ldms\n", item.param0);
           if (_service_timer->timer(utcb, _clock->abstime(item.param0, 1000)))
@@ -106,6 +157,7 @@ struct Script : public StaticReceiver<Script> {
           assert(0);
       }
 
+      finish_starts(batch, jobs, last_child_id);
       if (work_done)
         Logging::printf("sc: %s.\n", _head ? "waiting.." : "done");
     }
@@ -143,6 +195,11 @@ struct Script : public StaticReceiver<Script> {
 
     _worker = KernelSemaphore(_service_timer->get_notify_sm());
 
+    MessageHostOp msg1(MessageHostOp::OP_ALLOC_SEMAPHORE, 0UL);
+    if (!_bus_hostop.send(msg1))
+      Logging::panic("sc: %s alloc semaphore failed", __func__);
+    _started = KernelSemaphore(msg1.value);
+
     // create the worker thread
     MessageHostOp msg = MessageHostOp::alloc_service_thread(Script::do_work,
                                                             this, "scripting", 1UL);
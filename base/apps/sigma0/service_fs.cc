@@ -20,6 +20,7 @@
 #include "nul/generic_service.h"
 #include "nul/service_fs.h"
 #include "nul/baseprogram.h"
+#include "service/inflate.h"
 
 class Service_fs {
 protected:
@@ -122,23 +123,82 @@ public:
 
 };
 
+/**
+ * Provides the boot modules. A module 'name.gz' is also available
+ * as 'name'. It is then decompressed on the first access, so that
+ * clients on different CPUs inflate different modules in parallel.
+ */
 class Service_ModuleFs : public Service_fs {
+  enum { UNPACK_NONE = 0, UNPACK_BUSY, UNPACK_DONE, UNPACK_FAILED };
+
+  struct Unpacked {
+    unsigned volatile state;
+    char             *data;
+    unsigned long     size;
+  };
+
+  Unpacked *_unpacked;
+
+  unsigned modules() { return hip->mem_size ? (hip->length - hip->mem_offs) / hip->mem_size : 0; }
+
+  Hip_mem *module(unsigned i) {
+    return reinterpret_cast<Hip_mem *>(reinterpret_cast<char *>(hip) + hip->mem_offs + i * hip->mem_size);
+  }
+
+  bool unpack(Hip_mem *hmem, Unpacked &u, char const * text)
+  {
+    while (u.state != UNPACK_DONE) {
+      if (u.state == UNPACK_FAILED) return false;
+      if (u.state != UNPACK_NONE || Cpu::cmpxchg4b(&u.state, UNPACK_NONE, UNPACK_BUSY) != UNPACK_NONE) {
+        Cpu::pause();
+        continue;
+      }
+
+      char const *src = reinterpret_cast<char const *>(hmem->addr);
+      unsigned long size = Inflate::gzip_size(src, hmem->size);
+      unsigned long long tic = Cpu::rdtsc();
+      Inflate *inflate = new Inflate;
+      u.data = new (0x1000) char[size ? size : 1];
+      unsigned res = (inflate && u.data) ? inflate->gunzip(u.data, size, src, hmem->size) : ~0U;
+      delete inflate;
+      if (res) {
+        Logging::printf("romfs: inflating '%s' failed at %u\n", text, res);
+        delete [] u.data;
+        u.data = 0;
+      } else
+        Logging::printf("romfs: inflated '%s' %#llx -> %#lx bytes in %llu cycles\n", text, hmem->size, size, Cpu::rdtsc() - tic);
+      u.size = size;
+      MEMORY_BARRIER;
+      u.state = res ? UNPACK_FAILED : UNPACK_DONE;
+    }
+    return true;
+  }
+
 public:
   bool get_file(char const * text, Hip_mem &out)
   {
     Hip_mem *hmem;
-    //unsigned len;
+    unsigned textlen = strlen(text);
 
-    for (int i=0; hip->mem_size && i < (hip->length - hip->mem_offs) / hip->mem_size; i++)
+    for (unsigned i=0; i < modules(); i++)
       {
-        hmem = reinterpret_cast<Hip_mem *>(reinterpret_cast<char *>(hip) + hip->mem_offs + i * hip->mem_size);
+        hmem = module(i);
         if (hmem->type != -2 || !hmem->size || !hmem->aux) continue;
         char * virt_aux = reinterpret_cast<char *>(hmem->aux);
         //len = strcspn(virt_aux, " \t\r\n\f");
         //      if (len >= 10 && !strncmp(virt_aux + len - 10, ".nulconfig", 10)) continue; //skip configuration files for security/spying reasons
-        if (strcmp(virt_aux, text)) continue;
+        if (!strcmp(virt_aux, text)) {
+          out = *hmem;
+          return true;
+        }
 
+        // the compressed variant
+        if (strncmp(virt_aux, text, textlen) || strcmp(virt_aux + textlen, ".gz")) continue;
+        if (!Inflate::is_gzip(reinterpret_cast<char *>(hmem->addr), hmem->size)) continue;
+        if (!unpack(hmem, _unpacked[i], text)) return false;
         out = *hmem;
+        out.addr = reinterpret_cast<mword>(_unpacked[i].data);
+        out.size = _unpacked[i].size;
         return true;
       }
 
@@ -147,7 +207,10 @@ public:
 public:
   Service_ModuleFs(Motherboard &mb, bool readonly = true )
     : Service_fs(mb, readonly)
-  {}
+  {
+    _unpacked = new Unpacked[modules()];
+    memset(_unpacked, 0, modules() * sizeof(Unpacked));
+  }
 };
 
 #include <service/elf.h>
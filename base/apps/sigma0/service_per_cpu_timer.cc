@@ -752,6 +752,13 @@ public:
         // XXX We are leaking an abstimeout slot!! XXX
         return _storage.free_client_data(utcb, data, this);
       }
+    case ParentProtocol::TYPE_BATCH:
+      {
+        ClientData *data = 0;
+        ClientDataStorage<ClientData, PerCpuTimerService>::Guard guard_c(&_storage, utcb, this);
+        if (res = _storage.get_client_data(utcb, data, input.identity())) return res;
+        return handle_batch(this, utcb, input, free_cap, pid);
+      }
     case TimerProtocol::TYPE_REQUEST_TIMER:
       {
         ClientData *data = 0;
@@ -24,35 +24,165 @@
 /**
  * Tracebuffer service.
  *
- * Missing: trace-buffer output on debug key
+ * Lines are stored as timestamped records in one segment per CPU,
+ * so that the portal threads never share a write position. A dump
+ * merges the segments by time and can be filtered by time window,
+ * client and severity. The export prints the records in binary,
+ * base64 encoded, for tools/tbdecode.py.
+ *
+ * A line can carry a severity as "<n>" prefix like the Linux printk
+ * levels, "PANIC" lines are level 0. All other lines are level 6.
  */
-class Tracebuffer: public CapAllocator {
-  unsigned long _size;
-  unsigned long _pos;
-  char        * _buf;
+class Tracebuffer: public CapAllocator, public StaticReceiver<Tracebuffer> {
+public:
+  enum {
+    LEVEL_PANIC = 0,
+    LEVEL_WARN  = 4,
+    LEVEL_INFO  = 6,
+    LEVEL_ALL   = 7,
+    LEVEL_PAD   = 0xff,
+  };
+
+  struct Filter {
+    unsigned level;
+    long     guid;   ///< 0 means all clients
+    unsigned last;   ///< only the last ms, 0 means everything
+  };
+
+private:
+  /**
+   * A record as stored in a segment. The export uses the same layout,
+   * but without the alignment padding.
+   */
+  struct Record {
+    unsigned           size;
+    unsigned short     len;
+    unsigned char      level;
+    unsigned char      cpu;
+    long               guid;
+    unsigned long long tsc;
+    char               text[];
+  } PACKED;
+
+  /**
+   * The records of one CPU. Positions run freely, the oldest records
+   * are overwritten.
+   */
+  struct Segment {
+    char *            buf;
+    unsigned          size;
+    unsigned volatile head;
+    unsigned volatile tail;
+
+    Record *at(unsigned pos) { return reinterpret_cast<Record *>(buf + (pos & (size - 1))); }
+  };
+
+  Segment     * _segments;
+  unsigned      _cpus;
+  unsigned      _freq;
   bool          _verbose;
+  Filter        _filter;
   long          _anon_sessions;
   char        * _flag_revoke;
 
   struct ClientData : public GenericClientData {
     long guid;
+    LogRing *ring;
+    unsigned volatile draining;
+
+    ClientData() : ring(0), draining(0) {}
+    ~ClientData() {
+      if (!ring) return;
+      nova_revoke(Crd(reinterpret_cast<unsigned long>(ring) >> Utcb::MINSHIFT, LogRing::ORDER - Utcb::MINSHIFT, DESC_MEM_ALL), false);
+      delete [] reinterpret_cast<char *>(ring);
+    }
   };
 
   ALIGNED(8) ClientDataStorage<ClientData, Tracebuffer> _storage;
 
-  static void trace_putc(void *data, int value) {
-    if (value < 0) return;
-    Tracebuffer *t = reinterpret_cast<Tracebuffer *>(data);
-    t->_buf[(t->_pos++) % t->_size] = value;
+  bool match(Filter const &f, unsigned level, long guid, unsigned long long tsc, unsigned long long since) {
+    return level <= f.level && (!f.guid || guid == f.guid) && tsc >= since;
+  }
+
+  /**
+   * Drop the oldest records until [tail, end) fits into the segment.
+   */
+  void make_room(Segment &s, unsigned end) {
+    while (end - s.tail > s.size) s.tail += s.at(s.tail)->size;
+  }
+
+  /**
+   * Store a line. Only the portal thread of the CPU writes to its segment.
+   */
+  void append(unsigned cpu, unsigned char level, long guid, unsigned len, char const *text, unsigned long long tsc) {
+    Segment &s = _segments[cpu % _cpus];
+    if (len > s.size / 4) len = s.size / 4;
+    unsigned size = (sizeof(Record) + len + 3) & ~3u;
+    unsigned h = s.head;
+
+    // Records are never split at the end of the buffer. A record that
+    // would leave less than a header before the end takes the rest,
+    // so that a padding record always fits.
+    unsigned room = s.size - (h & (s.size - 1));
+    if (room >= size && room - size < sizeof(Record)) size = room;
+    if (room < size) {
+      make_room(s, h + room);
+      s.at(h)->size  = room;
+      s.at(h)->level = LEVEL_PAD;
+      h += room;
+    }
+    make_room(s, h + size);
+
+    Record *r = s.at(h);
+    r->size  = size;
+    r->len   = len;
+    r->level = level;
+    r->cpu   = cpu;
+    r->guid  = guid;
+    r->tsc   = tsc;
+    memcpy(r->text, text, len);
+    MEMORY_BARRIER;
+    s.head = h + size;
   }
 
+  void log(unsigned cpu, ClientData *data, unsigned len, char const *text, unsigned long long tsc) {
+    unsigned char level = LEVEL_INFO;
+    while (len && !text[len - 1]) len--;
+    if (len >= 3 && text[0] == '<' && text[1] >= '0' && text[1] <= '7' && text[2] == '>') {
+      level = text[1] - '0';
+      text += 3;
+      len  -= 3;
+    } else if (len >= 5 && !memcmp(text, "PANIC", 5)) level = LEVEL_PANIC;
 
-  void trace_printf(const char *format, ...)
-  {
-    va_list ap;
-    va_start(ap, format);
-    Vprintf::vprintf(trace_putc, this, format, ap);
-    va_end(ap);
+    if (_verbose && match(_filter, level, data->guid, 0, 0)) Logging::printf("(%ld) %.*s\n", data->guid, len, text);
+    append(cpu, level, data->guid, len, text, tsc);
+  }
+
+  struct Drain {
+    Tracebuffer *tb;
+    ClientData  *data;
+    unsigned     cpu;
+    unsigned long long now;
+    void operator()(char const *text, unsigned len, unsigned long long tsc) {
+      // the line was written when put() into the ring, but never in the future
+      tb->log(cpu, data, len, text, tsc < now ? tsc : now);
+    }
+  };
+
+  /**
+   * Copy the lines of a client ring into the tracebuffer.
+   */
+  void drain(Utcb &utcb, ClientData *data) {
+    if (!data->ring || Cpu::cmpxchg4b(&data->draining, 0, 1)) return;
+    Drain drain = { this, data, utcb.head.nul_cpunr, Cpu::rdtsc() };
+    data->ring->drain(drain);
+    unsigned dropped = Cpu::xchg(&data->ring->dropped, 0U);
+    if (dropped) {
+      char text[32];
+      Vprintf::snprintf(text, sizeof(text), "<4>%u lines dropped", dropped);
+      log(utcb.head.nul_cpunr, data, strlen(text), text, Cpu::rdtsc());
+    }
+    data->draining = 0;
   }
 
   void check_clients(Utcb &utcb) {
@@ -60,14 +190,122 @@ class Tracebuffer: public CapAllocator {
     ClientData * data = _storage.get_invalid_client(utcb, this);
     while (data) {
       if (_verbose) Logging::printf("tb: found dead client - freeing datastructure\n");
+      drain(utcb, data);
       _storage.free_client_data(utcb, data, this);
       data = _storage.get_invalid_client(utcb, this, data);
     }
   }
 
+  /**
+   * Walk over the records of all segments in time order. The segments
+   * are written concurrently, so a record may be overwritten while we
+   * look at it. This is fine for debugging output.
+   */
+  template <typename F>
+  void for_each(Filter const &f, F &func) {
+    unsigned pos[_cpus];
+    unsigned long long since = f.last ? Cpu::rdtsc() - static_cast<unsigned long long>(f.last) * _freq : 0;
+    for (unsigned i = 0; i < _cpus; i++) pos[i] = _segments[i].tail;
+
+    while (1) {
+      Record *next = 0;
+      unsigned cpu = 0;
+      for (unsigned i = 0; i < _cpus; i++) {
+        Segment &s = _segments[i];
+        if (pos[i] - s.tail > s.head - s.tail) pos[i] = s.tail;   // overtaken by the writer
+        while (pos[i] != s.head && s.at(pos[i])->level == LEVEL_PAD) pos[i] += s.at(pos[i])->size;
+        if (pos[i] == s.head) continue;
+        Record *r = s.at(pos[i]);
+        if (!next || r->tsc < next->tsc) { next = r; cpu = i; }
+      }
+      if (!next) break;
+      if (!next->size || next->size > _segments[cpu].size || next->len > next->size - sizeof(Record)) {
+        pos[cpu] = _segments[cpu].head;
+        continue;
+      }
+      pos[cpu] += next->size;
+      if (match(f, next->level, next->guid, next->tsc, since)) func(next);
+    }
+  }
+
+  struct Print {
+    void operator()(Record *r) { Logging::printf("(%ld) %.*s\n", r->guid, r->len, r->text); }
+  };
+
+  /**
+   * Base64 encoder that prints lines of 64 characters.
+   */
+  struct Export {
+    unsigned char chunk[48];
+    unsigned      count;
+
+    void flush() {
+      static char const table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+      char line[65];
+      unsigned n = 0;
+      for (unsigned i = 0; i < count; i += 3) {
+        unsigned v = chunk[i] << 16 | (i + 1 < count ? chunk[i + 1] << 8 : 0) | (i + 2 < count ? chunk[i + 2] : 0);
+        line[n++] = table[(v >> 18) & 0x3f];
+        line[n++] = table[(v >> 12) & 0x3f];
+        line[n++] = i + 1 < count ? table[(v >> 6) & 0x3f] : '=';
+        line[n++] = i + 2 < count ? table[v & 0x3f] : '=';
+      }
+      line[n] = 0;
+      if (n) Logging::printf("tb: %s\n", line);
+      count = 0;
+    }
+
+    void put(void const *data, unsigned len) {
+      unsigned char const *p = reinterpret_cast<unsigned char const *>(data);
+      for (unsigned i = 0; i < len; i++) {
+        chunk[count++] = p[i];
+        if (count == sizeof(chunk)) flush();
+      }
+    }
+
+    void operator()(Record *r) {
+      Record header = *r;
+      header.size = sizeof(Record) + r->len;
+      put(&header, sizeof(header));
+      put(r->text, r->len);
+    }
+
+    Export() : count(0) {}
+  };
+
 public:
   inline unsigned alloc_crd() { return Crd(alloc_cap(), 0, DESC_CAP_ALL).value(); }
 
+  void dump(Filter const &f) {
+    Logging::printf("tb: dump level %u guid %ld last %u ms\n", f.level, f.guid, f.last);
+    Print print;
+    for_each(f, print);
+    Logging::printf("tb: end of dump\n");
+  }
+
+  /**
+   * Export the records: a "NTB1" magic and the TSC frequency in kHz,
+   * followed by the records.
+   */
+  void export_records(Filter const &f) {
+    Logging::printf("tb: begin export\n");
+    Export out;
+    out.put("NTB1", 4);
+    out.put(&_freq, sizeof(_freq));
+    for_each(f, out);
+    out.flush();
+    Logging::printf("tb: end export\n");
+  }
+
+  bool receive(MessageConsole &msg) {
+    if (msg.type != MessageConsole::TYPE_DEBUG) return false;
+    switch (msg.id) {
+    case MessageConsole::DEBUG_TRACE_DUMP:   dump(_filter); return true;
+    case MessageConsole::DEBUG_TRACE_EXPORT: export_records(_filter); return true;
+    default: return false;
+    }
+  }
+
   unsigned portal_func(Utcb &utcb, Utcb::Frame &input, bool &free_cap, cap_sel pid) {
     unsigned res = ENONE;
     unsigned op;
@@ -101,6 +339,7 @@ public:
         check1(res, res = _storage.get_client_data(utcb, data, input.identity()));
 
         if (_verbose) Logging::printf("tb: close session for %lx\n", data->guid);
+        drain(utcb, data);
         return _storage.free_client_data(utcb, data, this);
       }
     case LogProtocol::TYPE_LOG:
@@ -112,8 +351,36 @@ public:
 
         char *text = input.get_string(len);
         check1(EPROTO, !text);
-        if (_verbose) Logging::printf("(%ld) %.*s\n", data->guid, len, text);
-        trace_printf("(%ld) %.*s\n", data->guid, len, text);
+        log(utcb.head.nul_cpunr, data, len, text, Cpu::rdtsc());
+      }
+      return ENONE;
+    case LogProtocol::TYPE_RING:
+      {
+        unsigned long addr;
+        ClientData *data = 0;
+        ClientDataStorage<ClientData, Tracebuffer>::Guard guard(&_storage);
+        if ((res = _storage.get_client_data(utcb, data, input.identity())))  return res;
+        check1(EPROTO, input.get_word(addr));
+        check1(EEXISTS, data->ring != 0);
+
+        LogRing *ring = reinterpret_cast<LogRing *>(new (LogRing::SIZE) char[LogRing::SIZE]);
+        check1(ERESOURCE, !ring);
+        memset(ring, 0, LogRing::SIZE);
+        ring->notify = _verbose;
+        if (Cpu::cmpxchg4b(&data->ring, 0, reinterpret_cast<unsigned long>(ring))) {
+          delete [] reinterpret_cast<char *>(ring);
+          return EEXISTS;
+        }
+        if (utcb.add_mappings(reinterpret_cast<unsigned long>(ring), LogRing::SIZE, addr | MAP_MAP, DESC_MEM_ALL, true))
+          return ERESOURCE;
+      }
+      return ENONE;
+    case LogProtocol::TYPE_FLUSH:
+      {
+        ClientData *data = 0;
+        ClientDataStorage<ClientData, Tracebuffer>::Guard guard(&_storage);
+        if ((res = _storage.get_client_data(utcb, data, input.identity())))  return res;
+        drain(utcb, data);
       }
       return ENONE;
     default:
@@ -124,35 +391,42 @@ public:
   void * operator new (unsigned size, unsigned alignment) { return  new (alignment) char [sizeof(Tracebuffer)]; }
 
 public:
-  Tracebuffer(unsigned long size, char *buf, bool verbose, unsigned _cap, unsigned _cap_order, char * flag_revoke)
-    : CapAllocator(_cap, _cap, _cap_order), _size(size), _pos(0), _buf(buf), _verbose(verbose), _flag_revoke(flag_revoke)  {
+  Tracebuffer(Hip *hip, unsigned long size, bool verbose, Filter const &filter, unsigned _cap, unsigned _cap_order, char * flag_revoke)
+    : CapAllocator(_cap, _cap, _cap_order), _cpus(hip->cpu_desc_count()), _freq(hip->freq_tsc), _verbose(verbose), _filter(filter),
+      _anon_sessions(0), _flag_revoke(flag_revoke)  {
+    _segments = new Segment[_cpus];
+    for (unsigned i = 0; i < _cpus; i++) {
+      _segments[i].size = size;
+      _segments[i].head = _segments[i].tail = 0;
+      _segments[i].buf  = hip->cpus()[i].enabled() ? new (16) char[size] : 0;
+    }
   }
-
-
-#if 0
-      case 4:
-	Logging::printf("Trace buffer at %x bytes (%x).\n\n", _trace_pos, TRACE_BUF_SIZE);
-	Logging::printf("%.*s", TRACE_BUF_SIZE - (_trace_pos % TRACE_BUF_SIZE), _trace_buf + (_trace_pos % TRACE_BUF_SIZE));
-	if (_trace_pos % TRACE_BUF_SIZE) Logging::printf("%.*s", _trace_pos % TRACE_BUF_SIZE, _trace_buf);
-	Logging::printf("\nEOF trace buffer\n\n");
-	break;
-      }
-#endif
 };
 
 static bool verbose = false;
 PARAM_HANDLER(tracebuffer_verbose, "when given before S0_DEFAULT, it makes the service_tracebuffer verbose")
 { verbose = true; }
 
-PARAM_HANDLER(service_tracebuffer, "service_tracebuffer:size=32768,verbose=1 - instantiate a tracebuffer for clients")
+static Tracebuffer::Filter filter = { Tracebuffer::LEVEL_ALL, 0, 0 };
+PARAM_HANDLER(tracebuffer_filter, "tracebuffer_filter:level=7,guid=0,last=0 - when given before S0_DEFAULT, it filters the verbose output and the dumps of the service_tracebuffer by severity, client and the last ms")
+{
+  if (~argv[0]) filter.level = argv[0];
+  if (~argv[1]) filter.guid  = argv[1];
+  if (~argv[2]) filter.last  = argv[2];
+}
+
+PARAM_HANDLER(service_tracebuffer, "service_tracebuffer:size=32768,verbose=1 - instantiate a tracebuffer for clients, size is per CPU and rounded up to a power of two")
 {
   unsigned long size = ~argv[0] ? argv[0] : 32768;
+  if (size < 0x1000) size = 0x1000;
+  size = 1UL << Cpu::bsr(size * 2 - 1);
   unsigned cap_region = alloc_cap_region(1 << 12, 12);
   char * revoke_mem = new (0x1000) char[0x1000];
 
-  Tracebuffer *t = new (8) Tracebuffer(size, new char[size], argv[1] == ~0UL ? verbose : argv[1] , cap_region, 12, revoke_mem);
+  Tracebuffer *t = new (8) Tracebuffer(mb.hip(), size, argv[1] == ~0UL ? verbose : argv[1], filter, cap_region, 12, revoke_mem);
   MessageHostOp msg(t, "/log", reinterpret_cast<unsigned long>(StaticPortalFunc<Tracebuffer>::portal_func), revoke_mem);
   msg.crd_t = Crd(cap_region, 12, DESC_CAP_ALL).value();
   if (!cap_region || !mb.bus_hostop.send(msg))
     Logging::panic("registering the service failed");
+  mb.bus_console.add(t, Tracebuffer::receive_static<MessageConsole>);
 }
@@ -31,6 +31,7 @@
 #include "nul/service_fs.h"
 #include <nul/service_events.h>
 #include "s0_admission.h"
+#include "bootpool.h"
 
 // global VARs
 Motherboard *global_mb;
@@ -49,7 +50,7 @@ PARAM_HANDLER(verbose, "verbose - print additional information during runtime")
 PARAM_ALIAS(S0_DEFAULT,   "an alias for the default sigma0 parameters",
             " ioio hostacpi pcicfg mmconfig atare"
             " hostreboot:0 hostreboot:1 hostreboot:2 hostreboot:3"
-            " service_tracebuffer service_per_cpu_timer service_romfs service_embeddedromfs boot_s0_services script")
+            " service_tracebuffer service_per_cpu_timer service_romfs service_embeddedromfs boot_s0_services script bootpool")
 
 #define S0_DEFAULT_CMDLINE "namespace::/s0 name::/s0/timer name::/s0/fs/rom name::/s0/admission name::/s0/fs/embedded quota::guid"
 
@@ -76,6 +77,14 @@ PARAM_ALIAS(S0_DEFAULT,   "an alias for the default sigma0 parameters",
     unsigned long long net_tx;
     unsigned long long net_tx_packets;
 
+    // Read-only ELF pages mapped directly from a cached image
+    enum { MAXSHARED = 2 };
+    struct {
+      unsigned long client;
+      unsigned long size;
+      char *        image;
+    } shared[MAXSHARED];
+
     char *          mem; //have to be last element - see free_module
   };
 
@@ -130,6 +139,8 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
   Semaphore _lock_gsi;
   // lock for memory allocator
   static Semaphore _lock_mem;
+  // serializes module starts once their memory is prepared
+  Semaphore _lock_start;
 
   // putc+vga
   char    * _vga;
@@ -148,6 +159,14 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
   ModuleInfo _modinfo[MAXMODULES];
   unsigned _mac;
 
+  // boot modules kept in memory to share their read-only pages
+  enum { MAXIMAGES = 16 };
+  struct ImageCache {
+    char               name[64];
+    unsigned long long size;
+    char *             addr;
+  } _images[MAXIMAGES];
+
   //initialization tracking
   bool initialized_console;
   bool initialized_s0_tasks;
@@ -373,6 +392,7 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
       _modinfo[0].sigma0_cmdlen = cmd_size;
     } else
       _modinfo[0].cmdline = cmdline;
+    s0_ParentProtocol::set_permissions(0, _modinfo[0].cmdline, _modinfo[0].sigma0_cmdlen);
 
     // init services required or provided by sigma0
     service_parent    = new (sizeof(void *)*2) s0_ParentProtocol(CLIENT_PT_OFFSET + (1 << CLIENT_PT_ORDER), CLIENT_PT_ORDER, CLIENT_PT_OFFSET, CLIENT_PT_ORDER + 1);
@@ -525,8 +545,13 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
     Logging::printf("s0: create locks\n");
     _lock_gsi    = Semaphore(alloc_cap());
     _lock_mem    = Semaphore(alloc_cap());
-    check1(2, nova_create_sm(_lock_gsi.sm()) || nova_create_sm(_lock_mem.sm()));
+    _lock_start  = Semaphore(alloc_cap());
+    check1(2, nova_create_sm(_lock_gsi.sm()) || nova_create_sm(_lock_mem.sm()) || nova_create_sm(_lock_start.sm()));
     _lock_mem.up();
+    _lock_start.up();
+    static LockProfile profile_gsi("s0 gsi"), profile_mem("s0 mem");
+    _lock_gsi.profile(&profile_gsi);
+    _lock_mem.profile(&profile_mem);
 
     Logging::printf("s0: create pf echo+worker threads\n");
     check1(3, create_worker_threads(hip, utcb->head.nul_cpunr));
@@ -911,15 +936,32 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
       // Fault in application heap (includes code). The
       // assertion above (1) prevents mapping too much memory
       // due to misconfiguration.
-
-      translated = mword(modinfo->mem) + fault - MEM_OFFSET;
-      begin      = mword(modinfo->mem);
-      rights     = DESC_MEM_ALL;
-      size       = modinfo->physsize;
-      return true;
+      mword lo = MEM_OFFSET, hi = MEM_OFFSET + modinfo->physsize;
+      for (unsigned i = 0; i < ModuleInfo::MAXSHARED && modinfo->shared[i].size; i++) {
+        mword client = modinfo->shared[i].client;
+        if (in_range(fault, client, modinfo->shared[i].size)) {
+          // Shared code, writing to it is fatal
+          if (err & 2) goto nomatch;
+          translated = mword(modinfo->shared[i].image) + fault - client;
+          begin      = mword(modinfo->shared[i].image);
+          size       = modinfo->shared[i].size;
+          rights     = DESC_MEM_RX;
+          return true;
+        }
+        if (client < fault) lo = MAX(lo, client + modinfo->shared[i].size);
+        else                hi = MIN(hi, client);
+      }
+      if (lo <= fault && fault < hi) {
+        translated = mword(modinfo->mem) + fault - MEM_OFFSET;
+        begin      = mword(modinfo->mem) + lo - MEM_OFFSET;
+        rights     = DESC_MEM_ALL;
+        size       = hi - lo;
+        return true;
+      }
     }
 
     // No region matches
+  nomatch:
     size   = 0;
     rights = 0;
     return false;
@@ -990,11 +1032,13 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
 	      unsigned long rest = utcb->add_mappings(reinterpret_cast<unsigned long>(modinfo->hip), 0x1000, CLIENT_HIP | MAP_MAP, DESC_MEM_ALL);
 	      assert(!rest); //should ever succeed, one page should ever fit
 	    } else {
-	      unsigned long rest = utcb->add_mappings(reinterpret_cast<unsigned long>(modinfo->mem), modinfo->physsize, MEM_OFFSET | MAP_MAP, DESC_MEM_ALL);
+	      // map the whole region, which is all of the client memory unless read-only pages are shared
+	      mword client = fault - (translated - begin);
+	      unsigned long rest = utcb->add_mappings(begin, size, client | MAP_MAP, rights);
 	      if (rest) {
 	        utcb->set_header(0,0);
-	        unsigned long offset = (utcb->qual[1] & ~((1UL << Utcb::MINSHIFT) - 1)) - MEM_OFFSET;  //XXX be more clever here, find out which is the biggest junk we can map
-	        rest = utcb->add_mappings(reinterpret_cast<unsigned long>(modinfo->mem) + offset, 1UL << Utcb::MINSHIFT, (MEM_OFFSET + offset) | MAP_MAP, DESC_MEM_ALL);
+	        unsigned long offset = (fault & ~page_mask) - client;  //XXX be more clever here, find out which is the biggest junk we can map
+	        rest = utcb->add_mappings(begin + offset, 1UL << Utcb::MINSHIFT, (client + offset) | MAP_MAP, rights);
 	        assert(!rest); //should ever succeed, one page should ever fit
 	      }
 	    }
@@ -1475,7 +1519,7 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
   bool  receive(MessageDiskCommit &msg)
   {
     // user provided write?
-    if (msg.usertag) {
+    if (msg.usertag && ~msg.usertag & MessageDiskCommit::USERTAG_HOST) {
       unsigned client = msg.usertag & 0xffff;
       unsigned short index = msg.usertag >> 16;
       assert(client <  MAXMODULES);
@@ -1656,6 +1700,9 @@ struct Sigma0 : public Sigma0Base, public NovaProgram, public StaticReceiver<Sig
     case MessageConsole::TYPE_DEBUG:
       switch (msg.id) {
       case 0:  _mb->dump_counters(); break;
+      case MessageConsole::DEBUG_TRACE_DUMP:
+      case MessageConsole::DEBUG_TRACE_EXPORT:
+        return false; // handled by the tracebuffer
       case 3:
         {
           static unsigned unmap_count;
@@ -1857,6 +1904,8 @@ PARAM_HANDLER(boot_s0_services, "Start embedded services running as separate tas
   sigma0->initialized_s0_tasks = true;
 }
 
+s0_ParentProtocol::Permissions s0_ParentProtocol::_permissions[MAXMODULES];
+
 char const * s0_ParentProtocol::get_client_cmdline(unsigned identity, unsigned long &s0_cmdlen) {
   unsigned clientnr = get_client_number(identity);
   if (clientnr >= MAXMODULES) return 0;
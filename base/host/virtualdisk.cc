@@ -25,40 +25,139 @@
 /**
  * Provide a memory backed disk.
  *
- * State: broken
+ * The disk memory is superpage aligned, so that the data is covered
+ * by 4M mappings.  The data is copied from and to the DMA
+ * descriptors, as MessageDisk names client memory that is already
+ * mapped and gives us no way to map disk pages into the client.
+ * Requests are completed synchronously with a single
+ * MessageDiskCommit per request, as there is nothing to wait for that
+ * could be batched.
+ *
+ * Writes can optionally be forwarded to a backing disk.  These writes
+ * are not waited for, as the data is read from our own memory.
+ * Instead the written blocks are marked dirty and written back one
+ * request at a time.
+ *
+ * State: testing
  */
 class VirtualDisk : public StaticReceiver<VirtualDisk>
 {
+  enum {
+    SUPERPAGE_SIZE    = 1 << 22,
+    WRITEBACK_CHUNK   = 1 << 21, // maximum bytes per DMA descriptor to the backing disk
+    WRITEBACK_DMA     = 16,      // maximum DMA descriptors per backing request
+    WRITEBACK_BLOCK   = 1 << 16, // granularity of the dirty bitmap
+  };
 
+  DBus<MessageDisk>       &_bus_disk;
   DBus<MessageDiskCommit> &_bus_commit;
   unsigned      _disknr;
   char *        _data;
   unsigned long _length;
+  unsigned      _backing;
   const char *  _cmdline;
+  unsigned *    _dirty;
+  unsigned      _blocks;
+  unsigned      _cursor;
+  bool          _inflight;
+  bool          _writeback;
+
+  /**
+   * Check that a DMA descriptor lies inside the client memory.
+   */
+  static bool dma_invalid(MessageDisk &msg, DmaDescriptor &dma)
+  {
+    return dma.byteoffset > msg.physsize || dma.bytecount > msg.physsize - dma.byteoffset;
+  }
+
+  /**
+   * Find the next run of dirty blocks starting at the cursor and
+   * mark them clean.
+   */
+  bool next_dirty(unsigned &start, unsigned &count)
+  {
+    for (unsigned i=0; i < _blocks; i++) {
+      start = (_cursor + i) % _blocks;
+      if (!Cpu::get_bit(_dirty, start)) continue;
+      for (count = 0; start + count < _blocks && count < (WRITEBACK_DMA * (WRITEBACK_CHUNK / WRITEBACK_BLOCK))
+	     && Cpu::get_bit(_dirty, start + count); count++)
+	Cpu::set_bit(_dirty, start + count, false);
+      _cursor = start + count;
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * Forward the dirty blocks to the backing disk.  Only a single
+   * request is outstanding, the next one is sent when the backing disk
+   * commits it.  This also keeps writes to the same sectors ordered.
+   */
+  void writeback()
+  {
+    if (_backing == ~0u || _writeback) return;
+
+    // the backing disk may commit synchronously from within send()
+    _writeback = true;
+    unsigned start, count;
+    while (!_inflight && next_dirty(start, count)) {
+      DmaDescriptor dma[WRITEBACK_DMA];
+      unsigned long offset = start * WRITEBACK_BLOCK;
+      unsigned long len = MIN(count * static_cast<unsigned long>(WRITEBACK_BLOCK), _length - offset);
+      unsigned dmacount;
+      for (dmacount = 0; len; dmacount++) {
+	unsigned chunk = MIN(len, static_cast<unsigned long>(WRITEBACK_CHUNK));
+	dma[dmacount].byteoffset = offset + dmacount * WRITEBACK_CHUNK;
+	dma[dmacount].bytecount  = chunk;
+	len -= chunk;
+      }
+      _inflight = true;
+      MessageDisk msg(MessageDisk::DISK_WRITE, _backing, MessageDiskCommit::USERTAG_HOST | _disknr, offset >> 9, dmacount, dma,
+		      reinterpret_cast<unsigned long>(_data), _length);
+      if (!_bus_disk.send(msg)) {
+	Logging::printf("vdisk: writeback to disk %u failed at sector %lx\n", _backing, offset >> 9);
+	_inflight = false;
+      }
+    }
+    _writeback = false;
+  }
 
 public:
   bool  receive(MessageDisk &msg)
   {
     if (msg.disknr != _disknr)  return false;
     MessageDisk::Status status = MessageDisk::DISK_OK;
-    unsigned long long offset = msg.sector << 9;
     switch (msg.type)
       {
       case MessageDisk::DISK_READ:
       case MessageDisk::DISK_WRITE:
-	for (unsigned i=0; i < msg.dmacount; i++) {
-	  char *start = _data + offset;
-	  char *end   = start + msg.dma[i].bytecount;
-	  if (end > _data + _length || start > _data + _length || msg.dma[i].byteoffset > msg.physsize || msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize)
-	    {
+	{
+	  unsigned long long offset = msg.sector << 9;
+	  if (offset > _length) {
+	    status = MessageDisk::DISK_STATUS_DEVICE;
+	    break;
+	  }
+
+	  unsigned long pos = offset;
+	  bool write = msg.type == MessageDisk::DISK_WRITE;
+	  for (unsigned i=0; i < msg.dmacount; i++) {
+	    unsigned long count = msg.dma[i].bytecount;
+	    if (count > _length - pos || dma_invalid(msg, msg.dma[i])) {
 	      status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE | (i << MessageDisk::DISK_STATUS_SHIFT));
 	      break;
 	    }
-	  if (msg.type == MessageDisk::DISK_READ)
-	    memcpy(reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset), start, end - start);
-	  else
-	    memcpy(start, reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset), end - start);
-	  offset += end - start;
+	    char *guest = reinterpret_cast<char *>(msg.dma[i].byteoffset + msg.physoffset);
+	    if (write)
+	      memcpy(_data + pos, guest, count);
+	    else
+	      memcpy(guest, _data + pos, count);
+	    pos += count;
+	  }
+	  if (write && pos != offset && _backing != ~0u) {
+	    for (unsigned long block = offset / WRITEBACK_BLOCK; block <= (pos - 1) / WRITEBACK_BLOCK; block++)
+	      Cpu::set_bit(_dirty, block);
+	    writeback();
+	  }
 	}
 	break;
       case MessageDisk::DISK_GET_PARAMS:
@@ -67,12 +166,16 @@ public:
 	  msg.params->sectors = _length >> 9;
 	  msg.params->sectorsize = 512;
 	  msg.params->maxrequestcount = msg.params->sectors;
-	  unsigned slen = strlen(_cmdline) + 1;
-	  memcpy(msg.params->name, _cmdline, slen < sizeof(msg.params->name) ? slen : sizeof(msg.params->name) - 1);
+	  unsigned slen = MIN(strlen(_cmdline), sizeof(msg.params->name) - 1);
+	  memcpy(msg.params->name, _cmdline, slen);
 	  msg.params->name[slen] = 0;
 	  return true;
 	}
       case MessageDisk::DISK_FLUSH_CACHE:
+	if (_backing != ~0u) {
+	  MessageDisk msg2(MessageDisk::DISK_FLUSH_CACHE, _backing, 0, 0, 0, 0, 0, 0);
+	  _bus_disk.send(msg2);
+	}
 	break;
       default:
 	assert(0);
@@ -83,17 +186,88 @@ public:
   }
 
 
-  VirtualDisk(DBus<MessageDiskCommit> &bus_commit, unsigned disknr, char *data, unsigned long length, const char *cmdline) :
-    _bus_commit(bus_commit), _disknr(disknr), _data(data), _length(length), _cmdline(cmdline) {}
+  bool  receive(MessageDiskCommit &msg)
+  {
+    if (msg.disknr != _backing || msg.usertag != (MessageDiskCommit::USERTAG_HOST | _disknr) || !_inflight) return false;
+    if (msg.status)
+      Logging::printf("vdisk: writeback to disk %u failed with %x\n", _backing, msg.status);
+    _inflight = false;
+    writeback();
+    return true;
+  }
+
+
+  /**
+   * Attach a new virtual disk to the disk bus.
+   */
+  static void create(Motherboard &mb, char *data, unsigned long length, unsigned backing, const char *cmdline)
+  {
+    if (backing != ~0u && backing >= mb.bus_disk.count()) {
+      Logging::printf("vdisk: backing disk %u does not exist.\n", backing);
+      backing = ~0u;
+    }
+    Logging::printf("vdisk: Attached as vdisk %u%s.\n", mb.bus_disk.count(), backing != ~0u ? " with backing disk" : "");
+    VirtualDisk *dev = new VirtualDisk(mb.bus_disk, mb.bus_diskcommit, mb.bus_disk.count(), data, length, backing, cmdline);
+    mb.bus_disk.add(dev, VirtualDisk::receive_static<MessageDisk>);
+    if (backing != ~0u)
+      mb.bus_diskcommit.add(dev, VirtualDisk::receive_static<MessageDiskCommit>);
+  }
+
+  /**
+   * Allocate disk memory. Large disks are superpage aligned to
+   * let sigma0 map them with 4M pages.
+   */
+  static char *alloc(unsigned long length)
+  {
+    return new (length >= SUPERPAGE_SIZE ? SUPERPAGE_SIZE : 0x1000) char[length];
+  }
+
+  VirtualDisk(DBus<MessageDisk> &bus_disk, DBus<MessageDiskCommit> &bus_commit, unsigned disknr,
+	      char *data, unsigned long length, unsigned backing, const char *cmdline) :
+    _bus_disk(bus_disk), _bus_commit(bus_commit), _disknr(disknr), _data(data), _length(length), _backing(backing), _cmdline(cmdline),
+    _dirty(0), _blocks((length + WRITEBACK_BLOCK - 1) / WRITEBACK_BLOCK), _cursor(0), _inflight(false), _writeback(false)
+  {
+    if (_backing == ~0u) return;
+    _dirty = new unsigned[(_blocks + 31) / 32];
+    memset(_dirty, 0, ((_blocks + 31) / 32) * sizeof(unsigned));
+  }
 };
 
+
+/**
+ * Find a boot module that is already mapped in our address space.
+ */
+static bool find_module(Hip *hip, const char *name, Hip_mem &out)
+{
+  for (int i=0; hip->mem_size && i < (hip->length - hip->mem_offs) / hip->mem_size; i++)
+    {
+      Hip_mem *hmem = reinterpret_cast<Hip_mem *>(reinterpret_cast<char *>(hip) + hip->mem_offs + i * hip->mem_size);
+      if (hmem->type != -2 || !hmem->size || !hmem->aux) continue;
+      if (strcmp(reinterpret_cast<char *>(hmem->aux), name)) continue;
+      out = *hmem;
+      return true;
+    }
+  return false;
+}
+
+
 PARAM_HANDLER(vdisk,
-	      "vdisk:file - create a virtual disk from the given file",
-	      "Example: vdisk:rom://foo/bar creates a virtual disk from the module foo/bar")
+	      "vdisk:file[,backing] - create a virtual disk from the given file",
+	      "Example: vdisk:rom://foo/bar creates a virtual disk from the module foo/bar",
+	      "Modules and other files are copied into memory.",
+	      "Writes are forwarded to the disk number 'backing' if given.")
 {
   char url[128];
-  memcpy(url, args, args_len);
-  url[args_len] = 0;
+  unsigned url_len = MIN(static_cast<unsigned>(strcspn(args, ",")), args_len);
+  if (url_len >= sizeof(url)) {
+    Logging::printf("vdisk: URL too long.\n");
+    return;
+  }
+  memcpy(url, args, url_len);
+  url[url_len] = 0;
+
+  unsigned backing = ~0u;
+  if (url_len < args_len) backing = strtoul(args + url_len + 1, 0, 0);
 
   char service_name[32] = "fs/";
   size_t service_name_len = sizeof(service_name) - 4;
@@ -103,6 +277,18 @@ PARAM_HANDLER(vdisk,
     return;
   }
 
+  // Boot modules are mapped by sigma0 anyway. Avoid the fs service,
+  // but copy them, as the module is shared and must not be modified.
+  Hip_mem hmem;
+  if (!strcmp(service_name, "fs/rom") && find_module(mb.hip(), filename, hmem)) {
+    char *module = VirtualDisk::alloc(hmem.size);
+    if (!module) { Logging::printf("vdisk: Out of memory.\n"); return; }
+    memcpy(module, reinterpret_cast<char *>(hmem.addr), hmem.size);
+    Logging::printf("vdisk: Copied module '%s' 0x%llx bytes.\n", filename, hmem.size);
+    VirtualDisk::create(mb, module, hmem.size, backing, "virtualdisk");
+    return;
+  }
+
   unsigned cap_base = alloc_cap_region(FsProtocol::CAP_SERVER_PT + mb.hip()->cpu_desc_count() + 1, 0);
   FsProtocol::dirent fileinfo;
   FsProtocol fs_obj(cap_base + 1, service_name);
@@ -113,41 +299,34 @@ PARAM_HANDLER(vdisk,
     return;
   }
 
-  char *module = new(4096) char[fileinfo.size];
+  char *module = VirtualDisk::alloc(fileinfo.size);
 
   unsigned res = file_obj.copy(*BaseProgram::myutcb(), module, fileinfo.size);
   fs_obj.close(*BaseProgram::myutcb(), FsProtocol::CAP_SERVER_PT + mb.hip()->cpu_desc_count());
   dealloc_cap_region(cap_base, FsProtocol::CAP_SERVER_PT + mb.hip()->cpu_desc_count());
 
-  if (res) { Logging::printf("vdisk: Couldn't read file.\n"); delete module; return; }
+  if (res) { Logging::printf("vdisk: Couldn't read file.\n"); delete [] module; return; }
 
-  Logging::printf("vdisk: Opened '%s' 0x%llx bytes.\n"
-		  "vdisk: Attached as vdisk %u.\n",
-		  fileinfo.name, fileinfo.size, mb.bus_disk.count());
-          
-
-  VirtualDisk * dev = new VirtualDisk(mb.bus_diskcommit,
-				      mb.bus_disk.count(),
-				      module,
-				      fileinfo.size,
-				      "virtualdisk");
-  mb.bus_disk.add(dev, VirtualDisk::receive_static<MessageDisk>);
+  Logging::printf("vdisk: Opened '%s' 0x%llx bytes.\n", fileinfo.name, fileinfo.size);
+  VirtualDisk::create(mb, module, fileinfo.size, backing, "virtualdisk");
 }
 
 PARAM_HANDLER(vdisk_empty,
-	      "vdisk_empty:size - create a virtual disk of a given size",
-	      "Example: vdisk_empty:1048576 creates a virtual disk of 1MiB size")
+	      "vdisk_empty:size[,backing] - create a virtual disk of a given size",
+	      "Example: vdisk_empty:1048576 creates a virtual disk of 1MiB size",
+	      "Writes are forwarded to the disk number 'backing' if given.")
 {
   size_t size = argv[0];
+  if (size == ~0ul || !size) {
+    Logging::printf("vdisk_empty: Invalid size.\n");
+    return;
+  }
 
-  char *buffer = new(4096) char[size];
-
-  Logging::printf("vdisk_empty: Attached as vdisk %u.\n", mb.bus_disk.count());
+  char *buffer = VirtualDisk::alloc(size);
+  if (!buffer) {
+    Logging::printf("vdisk_empty: Out of memory.\n");
+    return;
+  }
 
-  VirtualDisk * dev = new VirtualDisk(mb.bus_diskcommit,
-				      mb.bus_disk.count(),
-				      buffer,
-				      size,
-				      "virtualdisk");
-  mb.bus_disk.add(dev, VirtualDisk::receive_static<MessageDisk>);
+  VirtualDisk::create(mb, buffer, size, argv[1] == ~0ul ? ~0u : argv[1], "virtualdisk");
 }
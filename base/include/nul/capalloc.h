@@ -23,7 +23,15 @@
  * Allocates capabilities from a certain range. The range is given by
  * _cap_start and _cap_order parameters.
  *
- * Note: allocator and deallocator required which handle concurrency threads well XXX
+ * Allocation is a lock-free bump of _cap_. Freed selectors are
+ * recycled: the most recent allocation is simply rolled back, single
+ * selectors are parked in a small array and handed out again.
+ * Ranges that are neither the most recent allocation nor a single
+ * selector, and selectors that find all slots taken, are not reused.
+ *
+ * Freeing a selector twice is undefined, as it could be handed out
+ * twice. Selectors that were rolled back or are already parked are
+ * caught by an assertion.
  */
 class InternalCapAllocator {
   public:
@@ -32,6 +40,9 @@ class InternalCapAllocator {
 };
 
 class CapAllocator : public InternalCapAllocator {
+  enum { RECYCLE_SLOTS = 16 };
+  unsigned long volatile _recycled[RECYCLE_SLOTS];
+
   public:
 
   unsigned long _cap_;
@@ -39,19 +50,40 @@ class CapAllocator : public InternalCapAllocator {
   unsigned long _cap_order;
 
   CapAllocator(unsigned long cap_, unsigned long cap_start, unsigned long cap_order)
-    : _cap_(cap_), _cap_start(cap_start), _cap_order(cap_order)
+    : _recycled(), _cap_(cap_), _cap_start(cap_start), _cap_order(cap_order)
   { }
 
   unsigned alloc_cap(unsigned count = 1) {
 //    assert(_cap_ < _cap_start + (1 << _cap_order) - 1);
 //    assert(_cap_ + count < _cap_start + (1 << _cap_order) - 1);
 //    assert(_cap_ >= _cap_start);
+    if (count == 1)
+      for (unsigned i = 0; i < RECYCLE_SLOTS; i++) {
+        if (!_recycled[i]) continue;
+        unsigned long cap = Cpu::xchg(&_recycled[i], 0UL);
+        if (cap) return cap;
+      }
     return Cpu::atomic_xadd(&_cap_, count);
   }
   void dealloc_cap(unsigned cap, unsigned count = 1) {
 //    assert((cap >= _cap_start) && (count <= (1 << _cap_order)));
 //    assert( cap + count < _cap_start + (1 << _cap_order) - 1);
-    while (count--) { UNUSED unsigned res = nova_revoke(Crd(cap + count, 0, DESC_CAP_ALL), true); assert(res == NOVA_ESUCCESS); }
-    // XXX add it back to the cap-allocator
+    for (unsigned i = 0; i < count; i++) { UNUSED unsigned res = nova_revoke(Crd(cap + i, 0, DESC_CAP_ALL), true); assert(res == NOVA_ESUCCESS); }
+
+    // only recycle what we handed out
+    if (!cap || cap < _cap_start || cap + count > _cap_start + (1UL << _cap_order)) return;
+
+    // catch double frees that would hand out a selector twice
+    assert(cap + count <= _cap_);
+    if (cap + count > _cap_) return;
+    for (unsigned i = 0; i < RECYCLE_SLOTS; i++) {
+      assert(_recycled[i] < cap || _recycled[i] >= cap + count);
+      if (_recycled[i] >= cap && _recycled[i] < cap + count) return;
+    }
+
+    if (Cpu::cmpxchg4b(&_cap_, cap + count, cap) == cap + count) return;
+    if (count == 1)
+      for (unsigned i = 0; i < RECYCLE_SLOTS; i++)
+        if (!_recycled[i] && !Cpu::cmpxchg4b(&_recycled[i], 0, cap)) return;
   }
 };
@@ -47,6 +47,7 @@ template <class T> class QuotaGuard {
 struct BaseClientData {
   void * next;
   void * del;
+  unsigned           closing;   ///< Set by free_client_data(), keeps the data out of the identity cache.
   unsigned           pseudonym; ///< A capability identifying the client. This is also known to the parent.
   /**
    * We implement a get_quota here, so that derived classes can
@@ -96,10 +97,20 @@ public:
 
 /**
  * A generic container that stores per-client data.
- * Missing: iterator
+ *
+ * Clients are kept in a lock-free list. Lookups by identity go
+ * through a small set-associative cache that is filled on a miss, so
+ * that services with many sessions do not walk the whole list on
+ * every request. Cache entries are only removed, never freed - the
+ * client data itself is still freed by gc() when no Guard is active.
  */
 template <class T, class A, bool free_pseudonym = true, bool __DEBUG__ = false>
 class ClientDataStorage {
+  enum {
+    CACHE_SIZE = 1024, // must be a power of two
+    CACHE_WAYS = 4,
+  };
+
   struct recycl {
     T * head;
     unsigned long t_in;
@@ -114,6 +125,58 @@ class ClientDataStorage {
     ALIGNED(8) struct recycl recycling;
     ALIGNED(8) unsigned long long recyc64;
   };
+  /// Identity cache - every entry holds the identity in the lower and the client pointer in the upper half.
+  ALIGNED(8) unsigned long long _cache[CACHE_SIZE];
+
+  static unsigned long long cache_entry(unsigned identity, T * data) {
+    return (static_cast<unsigned long long>(reinterpret_cast<unsigned long>(data)) << 32) | identity;
+  }
+
+  static T * cache_data(unsigned long long entry) { return reinterpret_cast<T *>(static_cast<unsigned long>(entry >> 32)); }
+
+  static unsigned cache_slot(unsigned identity, unsigned way) {
+    return ((identity ^ (identity >> 10)) + way) & (CACHE_SIZE - 1);
+  }
+
+  T * cache_lookup(unsigned identity) {
+    for (unsigned i = 0; i < CACHE_WAYS; i++) {
+      unsigned long long *slot = _cache + cache_slot(identity, i);
+      // cheap unlocked check first, the entry is read atomically only on a hit
+      if (*reinterpret_cast<volatile unsigned *>(slot) != identity) continue;
+      unsigned long long entry = Cpu::cmpxchg8b(slot, 0, 0);
+      if (static_cast<unsigned>(entry) == identity) return cache_data(entry);
+    }
+    return 0;
+  }
+
+  void cache_insert(unsigned identity, T * data) {
+    unsigned long long entry = cache_entry(identity, data);
+    unsigned long long *slot = 0;
+    for (unsigned i = 0; i < CACHE_WAYS && !slot; i++)
+      if (!Cpu::cmpxchg8b(_cache + cache_slot(identity, i), 0, entry)) slot = _cache + cache_slot(identity, i);
+
+    if (!slot) {
+      // all ways are used - replace one of them
+      slot = _cache + cache_slot(identity, identity & (CACHE_WAYS - 1));
+      unsigned long long old = Cpu::cmpxchg8b(slot, 0, 0);
+      if (old != Cpu::cmpxchg8b(slot, old, entry)) return;
+    }
+
+    // free_client_data() may have flushed the cache before we inserted - undo it
+    if (reinterpret_cast<volatile T *>(data)->closing) Cpu::cmpxchg8b(slot, entry, 0);
+  }
+
+  /**
+   * Remove all cache entries of a client. The client is already
+   * marked as closing, so nobody can insert it again.
+   */
+  void cache_flush(T * data) {
+    for (unsigned i = 0; i < CACHE_SIZE; i++) {
+      if (cache_data(_cache[i]) != data) continue;
+      unsigned long long entry = Cpu::cmpxchg8b(_cache + i, 0, 0);
+      if (cache_data(entry) == data) Cpu::cmpxchg8b(_cache + i, entry, 0);
+    }
+  }
 
   /**
    * Garbage collect - remove clients which are marked for removal
@@ -215,6 +278,7 @@ public:
   ClientDataStorage() : _head(0), recyc64(0) {
     assert(sizeof(T *) == 4);
     assert(!(reinterpret_cast<unsigned long>(&recyc64) & 0x7));
+    memset(_cache, 0, sizeof(_cache));
   }
 
   unsigned alloc_identity(T * data, A * obj)
@@ -274,6 +338,10 @@ public:
   unsigned free_client_data(Utcb &utcb, T *data, A * obj) {
     Guard count(this, utcb, obj);
 
+    // The locked add orders the flag before the cache flush, see cache_insert().
+    Cpu::atomic_xadd(&data->closing, 1U);
+    cache_flush(data);
+
     for (T **prev = &_head; T *current = *prev; prev = reinterpret_cast<T**>(&current->next))
       if (current == data) {
 
@@ -377,9 +445,17 @@ public:
   }
 
   unsigned get_client_data(Utcb &utcb, T *&data, unsigned identity) {
-    T * client = 0;
-    for (client = next(client); client && identity; client = next(client))
+    if (!identity) return EEXISTS;
+
+    T * client = cache_lookup(identity);
+    if (client) {
+      data = client;
+      return ENONE;
+    }
+
+    for (client = next(client); client; client = next(client))
       if (client->get_identity() == identity) {
+        cache_insert(identity, client);
         data = reinterpret_cast<T *>(reinterpret_cast<unsigned long>(client));
         return ENONE;
       }
@@ -415,6 +491,58 @@ public:
 };
 
 
+/**
+ * Execute the requests of a ParentProtocol::TYPE_BATCH message one
+ * after another and reply with the result of every request. All other
+ * reply words and items of a request are dropped.
+ *
+ * A service opts in by calling this for TYPE_BATCH, after it checked
+ * the session of the client. func(request) handles a single request
+ * frame, which starts with the opcode.
+ */
+template <typename F>
+unsigned handle_batch(Utcb &utcb, Utcb::Frame &input, F &func)
+{
+  unsigned count;
+  check1(EPROTO, input.get_word(count));
+  for (unsigned i = 0; i < count; i++) {
+    Utcb::Frame request = input;
+    unsigned op, res;
+    check1(EPROTO, input.get_frame(request));
+
+    // nested batches and the generic operations need their own call
+    Utcb::Frame peek = request;
+    unsigned untyped = utcb.head.untyped, typed = utcb.head.typed;
+    if (peek.get_word(op) || op < ParentProtocol::TYPE_GENERIC_END) res = EPROTO;
+    else res = func(request);
+    utcb.head.untyped = untyped;
+    utcb.head.typed   = typed;
+    utcb << res;
+  }
+  return ENONE;
+}
+
+/**
+ * Adapter to execute the requests of a batch with the portal_func()
+ * of a service.
+ */
+template <class C> struct BatchPortalFunc {
+  C *     service;
+  Utcb &  utcb;
+  bool &  free_cap;
+  cap_sel pid;
+  unsigned operator()(Utcb::Frame &request) { return service->portal_func(utcb, request, free_cap, pid); }
+  BatchPortalFunc(C *_service, Utcb &_utcb, bool &_free_cap, cap_sel _pid) : service(_service), utcb(_utcb), free_cap(_free_cap), pid(_pid) {}
+};
+
+template <class C>
+unsigned handle_batch(C *service, Utcb &utcb, Utcb::Frame &input, bool &free_cap, cap_sel pid)
+{
+  BatchPortalFunc<C> func(service, utcb, free_cap, pid);
+  return handle_batch(utcb, input, func);
+}
+
+
 /**
  * Define a static portal function.
  */
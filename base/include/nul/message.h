@@ -365,6 +365,11 @@ struct MessageConsole
       // the user requests a debug feature
       TYPE_DEBUG
     } type;
+  // TYPE_DEBUG ids handled by the tracebuffer, LCTRL-F5 and LCTRL-F6 on hostvga
+  enum {
+    DEBUG_TRACE_DUMP = 4,
+    DEBUG_TRACE_EXPORT,
+  };
   unsigned short id;
   unsigned short view;
   union
@@ -697,6 +702,9 @@ struct MessageDisk
  */
 struct MessageDiskCommit
 {
+  enum {
+    USERTAG_HOST = 1u << 31	// tags of requests that host drivers send on their own
+  };
   unsigned disknr;
   unsigned long usertag;
   MessageDisk::Status status;
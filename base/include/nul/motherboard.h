@@ -61,6 +61,8 @@ class Motherboard : public StaticReceiver<Motherboard>
   DBus<MessageIOIn>         bus_ioin;       ///< I/O space reads from virtual machines
   DBus<MessageHwIOOut>      bus_hwioout;    ///< HW I/O space writes
   DBus<MessageIOOut>        bus_ioout;	    ///< I/O space writes from virtual machines
+  DBus<MessageIOIn>         bus_ioins;      ///< string I/O reads with a count and a buffer
+  DBus<MessageIOOut>        bus_ioouts;     ///< string I/O writes with a count and a buffer
   DBus<MessageInput>        bus_input;
   DBus<MessageIrq>          bus_hostirq;    ///< Host IRQs
   DBus<MessageIrqLines>	    bus_irqlines;   ///< Virtual IRQs before they reach (virtual) IRQ controller
@@ -186,6 +188,7 @@ class Motherboard : public StaticReceiver<Motherboard>
 	  Logging::printf("\t%12s %8ld %8lx  diff %8ld\n", name, v, v, v - *p);
 	*p++ = v;
       }
+    LockProfile::dump(full);
   }
 
   Motherboard(Clock *__clock, Hip *__hip) : _clock(__clock), _hip(__hip), last_vcpu(0)  {}
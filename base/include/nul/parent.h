@@ -40,6 +40,7 @@ struct ParentProtocol {
     TYPE_INVALID = 0, ///< used as error indicator
     TYPE_OPEN, 	      ///< Get pseudonym (when sent to the parent) or open session (when sent to a service)
     TYPE_CLOSE,
+    TYPE_BATCH,       ///< Several service specific requests in one message, see RequestBatch
     TYPE_GENERIC_END, ///< Marks the end of generic operations - service specific operations can start here.
 
     // Parent specific operations
@@ -362,3 +363,70 @@ public:
 
   Utcb & init_frame(Utcb &utcb, unsigned op) { return init_frame_noid(utcb, op); }
 };
+
+/**
+ * Packs several requests to a service into a single call.
+ *
+ * Every request is started with add() and written to the UTCB as
+ * usual, but must not contain typed items. The requests are executed
+ * in order by the service, which replies with the result of each
+ * request. Other reply words are dropped, so requests that return
+ * data have to be sent on their own.
+ *
+ * The message is: TYPE_BATCH, count, { words, request }*
+ */
+template <class P>
+class RequestBatch {
+  P &      _proto;
+  Utcb &   _utcb;
+  unsigned _count;
+  unsigned _start;  ///< index of the length word of the current request
+  unsigned _res;
+
+  void finish() { if (_start) _utcb.msg[_start] = _utcb.head.untyped - _start - 1; }
+
+public:
+  /**
+   * Start a new request.
+   */
+  Utcb & add() {
+    finish();
+    _count++;
+    _start = _utcb.head.untyped;
+    return _utcb << 0U;
+  }
+
+  /**
+   * Whether another request with the given number of words fits
+   * into the UTCB.
+   */
+  bool fits(unsigned words) {
+    _utcb.head.untyped += words + 1;
+    bool res = _utcb.validate_send_bounds();
+    _utcb.head.untyped -= words + 1;
+    return res;
+  }
+
+  unsigned count() { return _count; }
+
+  /**
+   * Send the batch. Returns an error if the batch as a whole failed.
+   */
+  unsigned call() {
+    finish();
+    _utcb.msg[1] = _count;
+    _res = _proto.call_server_keep(_utcb);
+    if (!_res && _utcb.head.untyped < _count + 1) _res = EPROTO;
+    return _res;
+  }
+
+  /**
+   * The result of the nr-th request.
+   */
+  unsigned result(unsigned nr) { return _res ? _res : _utcb.msg[nr + 1]; }
+
+  RequestBatch(P &proto, Utcb &utcb) : _proto(proto), _utcb(utcb), _count(0), _start(0), _res(EPROTO) {
+    _proto.init_frame(_utcb, ParentProtocol::TYPE_BATCH) << 0U;
+  }
+  ~RequestBatch() { _utcb.drop_frame(); }
+};
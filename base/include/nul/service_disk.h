@@ -135,6 +135,18 @@ struct DiskProtocol : public GenericNoXlateProtocol {
     return call_server_drop(utcb);
   }
 
+  typedef RequestBatch<DiskProtocol> Batch;
+
+  /**
+   * Queue a request in a batch, batch.result() returns its result.
+   */
+  void read_write(Batch &batch, bool read, unsigned disk, unsigned long usertag, unsigned long long sector,
+                  unsigned dmacount, DmaDescriptor *dma)
+  {
+    Utcb &utcb = batch.add() << (read ? TYPE_READ : TYPE_WRITE) << disk << usertag << sector << dmacount;
+    for (unsigned i=0; i < dmacount; i++)  utcb << dma[i];
+  }
+
   unsigned read(Utcb &utcb, unsigned disk, unsigned long usertag, unsigned long long sector, unsigned dmacount, DmaDescriptor *dma)
   { return read_write(utcb, true, disk, usertag, sector, dmacount, dma); }
 
@@ -20,15 +20,134 @@
 #include "parent.h"
 
 /**
+ * A log ring in memory shared between a client and the log service.
+ *
+ * The client appends a record per line without IPC. The service
+ * drains the ring when the client asks for it, i.e. when the ring
+ * gets half full or for every line if the service mirrors the log.
+ * Writers of one ring have to be serialized by the client.
+ */
+struct LogRing {
+  enum {
+    ORDER = 14,
+    SIZE  = 1 << ORDER,
+  };
+
+  struct Record {
+    unsigned short     size;   ///< 0 means the next record is at the start
+    unsigned short     len;
+    unsigned long long tsc;
+    char               text[];
+  } PACKED;
+
+  unsigned volatile head;      ///< written by the client
+  unsigned volatile tail;      ///< written by the service
+  unsigned volatile dropped;
+  unsigned          notify;    ///< the service wants to see every line
+  enum { DATA = SIZE - 4 * sizeof(unsigned) };
+  char              data[DATA];
+
+  bool empty() { return head == tail; }
+  unsigned used() { unsigned h = head, t = tail; return h >= t ? h - t : DATA - t + h; }
+
+  /**
+   * Append a line. One byte always stays free, so that head == tail
+   * means empty.
+   */
+  bool put(char const *text, unsigned len, unsigned long long tsc) {
+    unsigned size = (sizeof(Record) + len + 3) & ~3u;
+    unsigned h = head, t = tail;
+    if (h + size >= DATA) {
+      if (t > h || size >= t) goto full;
+      reinterpret_cast<Record *>(data + h)->size = 0;
+      h = 0;
+    } else if (t > h && h + size >= t) goto full;
+
+    {
+      Record *r = reinterpret_cast<Record *>(data + h);
+      r->size = size;
+      r->len  = len;
+      r->tsc  = tsc;
+      memcpy(r->text, text, len);
+    }
+    MEMORY_BARRIER;
+    head = h + size;
+    return true;
+  full:
+    dropped++;
+    return false;
+  }
+
+  /**
+   * Hand the text and timestamp of all records to the consumer. The
+   * header is read once, as the client may change it at any time.
+   */
+  template <typename F>
+  void drain(F &f) {
+    unsigned t = tail;
+    // the client may write garbage - never leave the ring and never loop forever
+    for (unsigned i = 0; t != head && i < DATA / sizeof(Record); i++) {
+      MEMORY_BARRIER;
+      if (t > DATA - sizeof(Record)) { t = 0; continue; }
+      Record *r = reinterpret_cast<Record *>(data + t);
+      unsigned size = r->size;
+      unsigned len  = r->len;
+      unsigned long long tsc = r->tsc;
+      MEMORY_BARRIER;
+      if (!size) { t = 0; continue; }
+      if (size < sizeof(Record) || size > DATA - t || len > size - sizeof(Record)) { t = 0; break; }
+      f(r->text, len, tsc);
+      t += size;
+      MEMORY_BARRIER;
+      tail = t;
+    }
+    tail = t;
+  }
+};
+
+
+/**
+ * Log lines are sent to the service by IPC until a LogRing is
+ * attached.
+ *
  * Missing: handle very-long strings
  */
 struct LogProtocol : public GenericProtocol {
   enum {
     TYPE_LOG = ParentProtocol::TYPE_GENERIC_END,
+    TYPE_RING,
+    TYPE_FLUSH,
   };
+
+  LogRing *_ring;
+
   unsigned log(Utcb &utcb, const char *line) {
+    if (_ring) {
+      unsigned len = strlen(line);
+      bool notify = _ring->empty() && _ring->notify;
+      if (!_ring->put(line, len, Cpu::rdtsc())) {
+        flush(utcb);
+        _ring->put(line, len, Cpu::rdtsc());
+      }
+      if (notify || _ring->used() > LogRing::DATA / 2) return flush(utcb);
+      return ENONE;
+    }
     return call_server(init_frame(utcb, TYPE_LOG) << Utcb::String(line), true);
   }
 
-  LogProtocol(unsigned cap_base, unsigned instance=0) : GenericProtocol("log", instance, cap_base, true) {}
+  unsigned flush(Utcb &utcb) { return call_server_drop(init_frame(utcb, TYPE_FLUSH)); }
+
+  /**
+   * Let the service map a LogRing to the given window, which has to
+   * be LogRing::SIZE large, aligned and not yet mapped.
+   */
+  unsigned attach(Utcb &utcb, void *window) {
+    unsigned long addr = reinterpret_cast<unsigned long>(window);
+    assert(!(addr & (LogRing::SIZE - 1)));
+    unsigned res = call_server_drop(init_frame(utcb, TYPE_RING) << addr << Crd(addr >> Utcb::MINSHIFT, LogRing::ORDER - Utcb::MINSHIFT, DESC_MEM_ALL));
+    if (res == ENONE) _ring = reinterpret_cast<LogRing *>(window);
+    return res;
+  }
+
+  LogProtocol(unsigned cap_base, unsigned instance=0) : GenericProtocol("log", instance, cap_base, true), _ring(0) {}
 };
@@ -88,5 +88,15 @@ struct TimerProtocol : public GenericProtocol {
     return call_server(init_frame(utcb, TYPE_REQUEST_TIMER) << t, true);
   }
 
+  typedef RequestBatch<TimerProtocol> Batch;
+
+  /**
+   * Queue a timer request in a batch.
+   */
+  void timer(Batch &batch, timevalue abstime) {
+    MessageTimer t(abstime);
+    batch.add() << TYPE_REQUEST_TIMER << t;
+  }
+
   TimerProtocol(unsigned cap_base, unsigned instance=0) : GenericProtocol("timer", instance, cap_base, true) {}
 };
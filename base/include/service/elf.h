@@ -56,12 +56,29 @@ struct Elf
   }
 
 
+  /**
+   * Get the whole pages of a read-only segment. They can be mapped
+   * directly from a page aligned image instead of being copied.
+   */
+  static bool ro_pages(struct ph32 *ph, unsigned long &offset, unsigned long &paddr, unsigned long &size)
+  {
+    if (ph->p_type != 1 || (ph->p_flags & 2) || ((ph->p_paddr ^ ph->p_offset) & 0xfff)) return false;
+    unsigned long skip = (0x1000 - (ph->p_paddr & 0xfff)) & 0xfff;
+    if (ph->p_filesz <= skip) return false;
+    offset = ph->p_offset + skip;
+    paddr  = ph->p_paddr + skip;
+    size   = (ph->p_filesz - skip) & ~0xffful;
+    return size;
+  }
+
+
   /**
    * Decode an elf32 binary. I.e. copy the ELF segments from ELF image
-   * pointed by module to the memory at phys_mem.
+   * pointed by module to the memory at phys_mem. With skip_ro, the
+   * ro_pages() of a segment are left out.
    */
   static unsigned  decode_elf(char *module, unsigned long modsize, char *phys_mem, unsigned long &rip, unsigned long &maxptr, unsigned long mem_size,
-			      unsigned long mem_offset, unsigned long long magic)
+			      unsigned long mem_offset, unsigned long long magic, bool skip_ro = false)
   {
     unsigned res;
     struct eh32 *elf = reinterpret_cast<struct eh32 *>(module);
@@ -78,7 +95,12 @@ struct Elf
 	  magic = 0;
 	}
 	check1(9, !(mem_size >= ph->p_paddr + ph->p_memsz - mem_offset), "elf section out of memory %lx vs %x ofs %lx", mem_size, ph->p_paddr + ph->p_memsz, mem_offset);
-	memcpy(phys_mem + ph->p_paddr - mem_offset, module + ph->p_offset, ph->p_filesz);
+	unsigned long ro_offset, ro_paddr, ro_size;
+	if (skip_ro && ro_pages(ph, ro_offset, ro_paddr, ro_size)) {
+	  memcpy(phys_mem + ph->p_paddr - mem_offset, module + ph->p_offset, ro_paddr - ph->p_paddr);
+	  memcpy(phys_mem + ro_paddr + ro_size - mem_offset, module + ro_offset + ro_size, ph->p_filesz - (ro_paddr - ph->p_paddr) - ro_size);
+	} else
+	  memcpy(phys_mem + ph->p_paddr - mem_offset, module + ph->p_offset, ph->p_filesz);
 	memset(phys_mem + ph->p_paddr - mem_offset + ph->p_filesz, 0, ph->p_memsz - ph->p_filesz);
 	if (maxptr < ph->p_memsz + ph->p_paddr - mem_offset)
 	  maxptr = ph->p_paddr + ph->p_memsz - mem_offset;
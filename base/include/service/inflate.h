@@ -0,0 +1,343 @@
+/** @file
+ * Table-driven inflate for gzip compressed data.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+#include "service/string.h"
+
+/**
+ * Decompress deflate streams (RFC 1951) in gzip containers (RFC 1952).
+ *
+ * Huffman codes up to FAST_BITS long are decoded by a single table
+ * lookup, longer ones bit by bit from the canonical code. The object
+ * holds the tables, so it is too large for small stacks.
+ *
+ * All functions return zero on success and the line of the failing
+ * check otherwise.
+ */
+class Inflate
+{
+  enum {
+    FAST_BITS = 9,
+    MAX_BITS  = 15,
+    MAX_LIT   = 288,
+    MAX_DIST  = 30,
+  };
+
+  struct Huffman {
+    unsigned short fast[1 << FAST_BITS];  ///< symbol | length << 9, 0 if longer than FAST_BITS
+    unsigned short count[MAX_BITS + 1];
+    unsigned short symbol[MAX_LIT];
+  };
+
+  Huffman _lit, _dist, _fixed_lit, _fixed_dist;
+  bool    _fixed_done;
+  unsigned _crc_table[256];
+
+  const unsigned char *_in, *_in_end;
+  unsigned char *_out, *_out_start, *_out_end;
+  unsigned long  _buf;
+  unsigned       _cnt;
+  unsigned       _overrun;
+
+  void refill() {
+    while (_cnt <= 24) {
+      unsigned long byte = 0;
+      if (_in < _in_end) byte = *_in++; else _overrun++;
+      _buf |= byte << _cnt;
+      _cnt += 8;
+    }
+  }
+
+  unsigned bits(unsigned n) {
+    if (_cnt < n) refill();
+    unsigned res = _buf & ((1UL << n) - 1);
+    _buf >>= n;
+    _cnt  -= n;
+    return res;
+  }
+
+  static unsigned reverse(unsigned code, unsigned len) {
+    unsigned res = 0;
+    while (len--) { res = (res << 1) | (code & 1); code >>= 1; }
+    return res;
+  }
+
+  /**
+   * Build the decoding tables from a list of code lengths.
+   * Incomplete codes are allowed, over-subscribed ones are not.
+   */
+  static unsigned build(Huffman &h, const unsigned char *lengths, unsigned n)
+  {
+    memset(h.count, 0, sizeof(h.count));
+    for (unsigned i = 0; i < n; i++) h.count[lengths[i]]++;
+    h.count[0] = 0;
+
+    int left = 1;
+    for (unsigned len = 1; len <= MAX_BITS; len++) {
+      left = (left << 1) - h.count[len];
+      if (left < 0) return __LINE__;
+    }
+
+    unsigned short offs[MAX_BITS + 1];
+    offs[1] = 0;
+    for (unsigned len = 1; len < MAX_BITS; len++) offs[len + 1] = offs[len] + h.count[len];
+    for (unsigned i = 0; i < n; i++)
+      if (lengths[i]) h.symbol[offs[lengths[i]]++] = i;
+
+    // Deflate stores the codes MSB first, but we fetch bits LSB first.
+    memset(h.fast, 0, sizeof(h.fast));
+    unsigned code = 0, k = 0;
+    for (unsigned len = 1; len <= FAST_BITS; len++, code <<= 1)
+      for (unsigned j = 0; j < h.count[len]; j++, code++, k++)
+        for (unsigned e = reverse(code, len); e < (1U << FAST_BITS); e += 1U << len)
+          h.fast[e] = h.symbol[k] | (len << 9);
+    return 0;
+  }
+
+  /**
+   * Decode a symbol or return ~0 on an invalid code.
+   */
+  unsigned decode(Huffman &h) {
+    if (_cnt < MAX_BITS) refill();
+    unsigned e = h.fast[_buf & ((1U << FAST_BITS) - 1)];
+    if (e) {
+      _buf >>= e >> 9;
+      _cnt  -= e >> 9;
+      return e & 0x1ff;
+    }
+
+    // the slow path for long codes
+    int code = 0, first = 0, index = 0;
+    for (unsigned len = 1; len <= MAX_BITS; len++) {
+      code |= (_buf >> (len - 1)) & 1;
+      int count = h.count[len];
+      if (code - count < first) {
+        _buf >>= len;
+        _cnt  -= len;
+        return h.symbol[index + (code - first)];
+      }
+      index += count;
+      first  = (first + count) << 1;
+      code <<= 1;
+    }
+    return ~0U;
+  }
+
+  void build_fixed() {
+    if (_fixed_done) return;
+    unsigned char lengths[MAX_LIT];
+    unsigned i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < MAX_LIT; i++) lengths[i] = 8;
+    build(_fixed_lit, lengths, MAX_LIT);
+    for (i = 0; i < MAX_DIST; i++) lengths[i] = 5;
+    build(_fixed_dist, lengths, MAX_DIST);
+    _fixed_done = true;
+  }
+
+  unsigned dynamic_tables()
+  {
+    static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    unsigned char lengths[MAX_LIT + MAX_DIST];
+
+    unsigned nlen  = bits(5) + 257;
+    unsigned ndist = bits(5) + 1;
+    unsigned ncode = bits(4) + 4;
+    if (nlen > MAX_LIT || ndist > MAX_DIST) return __LINE__;
+
+    memset(lengths, 0, 19);
+    for (unsigned i = 0; i < ncode; i++) lengths[order[i]] = bits(3);
+    if (build(_lit, lengths, 19)) return __LINE__;
+
+    for (unsigned i = 0; i < nlen + ndist;) {
+      unsigned sym = decode(_lit);
+      if (sym < 16) { lengths[i++] = sym; continue; }
+
+      unsigned char len = 0;
+      unsigned rep;
+      switch (sym) {
+      case 16:
+        if (!i) return __LINE__;
+        len = lengths[i - 1];
+        rep = 3 + bits(2);
+        break;
+      case 17: rep = 3 + bits(3);  break;
+      case 18: rep = 11 + bits(7); break;
+      default: return __LINE__;
+      }
+      if (i + rep > nlen + ndist) return __LINE__;
+      while (rep--) lengths[i++] = len;
+    }
+
+    if (!lengths[256]) return __LINE__;
+    if (build(_lit, lengths, nlen) || build(_dist, lengths + nlen, ndist)) return __LINE__;
+    return 0;
+  }
+
+  unsigned codes(Huffman &lit, Huffman &dist)
+  {
+    static const unsigned short len_base[29] = {
+      3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+      35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const unsigned char len_extra[29] = {
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const unsigned short dist_base[30] = {
+      1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const unsigned char dist_extra[30] = {
+      0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    while (1) {
+      unsigned sym = decode(lit);
+      if (sym < 256) {
+        if (_out == _out_end) return __LINE__;
+        *_out++ = sym;
+        continue;
+      }
+      if (sym == 256) return 0;
+
+      sym -= 257;
+      if (sym >= 29) return __LINE__;
+      unsigned len = len_base[sym] + bits(len_extra[sym]);
+
+      sym = decode(dist);
+      if (sym >= MAX_DIST) return __LINE__;
+      unsigned d = dist_base[sym] + bits(dist_extra[sym]);
+
+      if (d > static_cast<unsigned long>(_out - _out_start) || len > static_cast<unsigned long>(_out_end - _out)) return __LINE__;
+      unsigned char *from = _out - d;
+      if (d >= len) memcpy(_out, from, len), _out += len;
+      else while (len--) *_out++ = *from++;
+    }
+  }
+
+  unsigned stored()
+  {
+    // drop the rest of the current byte
+    bits(_cnt & 7);
+    unsigned len  = bits(16);
+    unsigned nlen = bits(16);
+    if ((len ^ 0xffff) != nlen) return __LINE__;
+    if (len > static_cast<unsigned long>(_out_end - _out)) return __LINE__;
+
+    // bytes that are already in the bit buffer
+    for (; len && _cnt; len--) *_out++ = bits(8);
+    if (len > static_cast<unsigned long>(_in_end - _in)) return __LINE__;
+    memcpy(_out, _in, len);
+    _out += len;
+    _in  += len;
+    return 0;
+  }
+
+  unsigned crc32(const unsigned char *data, unsigned long len)
+  {
+    if (!_crc_table[1])
+      for (unsigned i = 0; i < 256; i++) {
+        unsigned c = i;
+        for (unsigned k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        _crc_table[i] = c;
+      }
+    unsigned crc = ~0U;
+    while (len--) crc = _crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+
+  static unsigned le32(const unsigned char *p) { return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24; }
+
+public:
+
+  /**
+   * Inflate a raw deflate stream. Returns the decompressed size in
+   * out_size.
+   */
+  unsigned inflate(char *out, unsigned long &out_size, const char *in, unsigned long in_size)
+  {
+    _in  = reinterpret_cast<const unsigned char *>(in);
+    _in_end = _in + in_size;
+    _out = _out_start = reinterpret_cast<unsigned char *>(out);
+    _out_end = _out + out_size;
+    _buf = _cnt = _overrun = 0;
+
+    unsigned last, res;
+    do {
+      last = bits(1);
+      switch (bits(2)) {
+      case 0: res = stored(); break;
+      case 1: build_fixed(); res = codes(_fixed_lit, _fixed_dist); break;
+      case 2: res = dynamic_tables(); if (!res) res = codes(_lit, _dist); break;
+      default: res = __LINE__;
+      }
+      if (res) return res;
+      if (_overrun * 8 > _cnt) return __LINE__;
+    } while (!last);
+
+    // give back the unused bytes
+    _in -= _cnt / 8 - _overrun;
+    out_size = _out - _out_start;
+    return 0;
+  }
+
+  static bool is_gzip(const char *data, unsigned long size)
+  {
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+    return size >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8;
+  }
+
+  /**
+   * The uncompressed size from the gzip trailer.
+   */
+  static unsigned long gzip_size(const char *data, unsigned long size)
+  {
+    return le32(reinterpret_cast<const unsigned char *>(data) + size - 4);
+  }
+
+  /**
+   * Decompress a gzip file. The output buffer has to be gzip_size()
+   * bytes large.
+   */
+  unsigned gunzip(char *out, unsigned long out_size, const char *in, unsigned long in_size)
+  {
+    enum { FHCRC = 2, FEXTRA = 4, FNAME = 8, FCOMMENT = 16 };
+    if (!is_gzip(in, in_size)) return __LINE__;
+
+    const unsigned char *p   = reinterpret_cast<const unsigned char *>(in);
+    const unsigned char *end = p + in_size - 8;
+    unsigned char flags = p[3];
+    if (flags & 0xe0) return __LINE__;
+    p += 10;
+
+    if (flags & FEXTRA) {
+      if (p + 2 > end) return __LINE__;
+      p += 2 + (p[0] | p[1] << 8);
+    }
+    if (flags & FNAME)    { while (p < end && *p) p++; p++; }
+    if (flags & FCOMMENT) { while (p < end && *p) p++; p++; }
+    if (flags & FHCRC) p += 2;
+    if (p > end) return __LINE__;
+
+    unsigned long size = out_size;
+    unsigned res = inflate(out, size, reinterpret_cast<const char *>(p), end - p);
+    if (res) return res;
+    if (size != gzip_size(in, in_size)) return __LINE__;
+    if (crc32(reinterpret_cast<unsigned char *>(out), size) != le32(end)) return __LINE__;
+    return 0;
+  }
+
+  Inflate() : _fixed_done(false), _crc_table() {}
+};
@@ -18,6 +18,9 @@
 
 #pragma once
 
+#include "service/cpu.h"
+#include "service/string.h"
+
 #define PVAR  ".long"
 #define COUNTER_INC(NAME)						\
   ({									\
@@ -33,3 +36,286 @@
 		  ".section .profile; "  PVAR " 1b; 2: " PVAR " 0,0;.previous;" \
 		  "mov %0,2b" : : "r"(static_cast<long>(VALUE)));	\
   }
+
+
+/**
+ * Contention statistics of a lock, in total and per call site.
+ * Profiles register themselves in a global list that is printed
+ * together with the counters.
+ *
+ * The statistics are only updated while the lock is held.
+ */
+struct LockProfile
+{
+  enum { SITES = 16 };
+
+  struct Site {
+    void const *       ip;     ///< return address of the acquire()
+    unsigned long      acquired;
+    unsigned long      contended;
+    unsigned long long wait;
+    unsigned long long hold;
+  };
+
+  char const *       name;
+  LockProfile *      next;
+  unsigned long      acquired;
+  unsigned long      contended;
+  unsigned long long wait;
+  unsigned long long hold;
+  unsigned long long since;
+  Site *             current;
+  Site               sites[SITES];
+
+  static LockProfile * volatile list;
+  static void dump(bool full = false);
+
+  Site *site(void const *ip) {
+    unsigned h = (reinterpret_cast<unsigned>(ip) * 0x9e3779b1u) >> 28;
+    for (unsigned i = 0; i < SITES; i++, h = (h + 1) % SITES) {
+      if (sites[h].ip == ip) return sites + h;
+      if (!sites[h].ip) { sites[h].ip = ip; return sites + h; }
+    }
+    return 0;
+  }
+
+  /**
+   * Account a successful lock. This is not inlined, so that the
+   * return address is the lock site in the caller of the (inlined)
+   * Semaphore::lock().
+   */
+  __attribute__((noinline)) void acquire(unsigned long long waited) {
+    since = Cpu::rdtsc();
+    current = site(__builtin_return_address(0));
+    acquired++;
+    if (current) current->acquired++;
+    if (waited) {
+      contended++;
+      wait += waited;
+      if (current) {
+        current->contended++;
+        current->wait += waited;
+      }
+    }
+  }
+
+  void release() {
+    unsigned long long held = Cpu::rdtsc() - since;
+    hold += held;
+    if (current) current->hold += held;
+  }
+
+  LockProfile(char const *_name) : name(_name), next(0), acquired(0), contended(0), wait(0), hold(0), since(0), current(0), sites()
+  {
+    do next = list;
+    while (Cpu::cmpxchg4b(&list, reinterpret_cast<unsigned>(next), reinterpret_cast<unsigned>(this)) != reinterpret_cast<unsigned>(next));
+  }
+};
+
+
+/**
+ * Cycles spent in the VM exit handlers of a VCPU. Every exit is
+ * accounted to its exit reason and, for I/O and MMIO exits, also to
+ * the port or the guest-physical page. Each key gets a histogram
+ * with power-of-two buckets.
+ *
+ * Only the handler thread of the VCPU updates its profile, so no
+ * locking is needed. Readers may see slightly inconsistent values.
+ * Other threads therefore only request a reset, which the handler
+ * thread performs at the end of its next exit.
+ */
+struct ExitProfile
+{
+  enum {
+    KIND_EXIT  = 0,
+    KIND_IO    = 1,
+    KIND_MMIO  = 2,
+    KIND_SHIFT = 28,
+    ENTRIES    = 256,
+    MIN_SHIFT  = 6,   ///< the first bucket is below 64 cycles
+    BUCKETS    = 24,
+  };
+
+  struct Entry {
+    unsigned           key;
+    char const *       name;
+    unsigned long      count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long      hist[BUCKETS];
+  };
+
+  void const *       owner;
+  unsigned           nr;
+  ExitProfile *      next;
+  unsigned long      dropped;
+  unsigned long      last_exits; ///< exits at the last rate() call
+  unsigned           _reason;
+  char const *       _name;
+  unsigned           _detail;
+  unsigned long long _tic;
+  volatile bool      _reset;
+  Entry              entries[ENTRIES];
+
+  static ExitProfile * volatile list;
+  static void dump(bool perf = false);
+  static void rate(unsigned period);
+  static void reset_all() { for (ExitProfile *p = list; p; p = p->next) p->_reset = true; }
+
+  static ExitProfile *get(void const *owner) {
+    for (ExitProfile *p = list; p; p = p->next)
+      if (p->owner == owner) return p;
+    return 0;
+  }
+
+  /**
+   * Account the current exit additionally to a port or MMIO page.
+   */
+  static void detail(void const *owner, unsigned kind, unsigned value) {
+    ExitProfile *p = list ? get(owner) : 0;
+    if (p && p->_name) p->_detail = kind << KIND_SHIFT | (value & ((1 << KIND_SHIFT) - 1));
+  }
+
+  /**
+   * Measures a VM exit handler. Nested handlers, e.g. the SVM ones
+   * that call their VMX counterpart, are accounted to the outermost.
+   */
+  class Sample {
+    ExitProfile *_p;
+  public:
+    Sample(void const *owner, unsigned reason, char const *name) : _p(list ? get(owner) : 0) {
+      if (!_p || _p->_name) { _p = 0; return; }
+      _p->_reason = reason;
+      _p->_name   = name;
+      _p->_detail = ~0u;
+      _p->_tic    = Cpu::rdtsc();
+    }
+    ~Sample() { if (_p) _p->stop(); }
+  };
+
+  Entry *lookup(unsigned key) {
+    unsigned h = (key * 0x9e3779b1u) >> 24;
+    for (unsigned i = 0; i < ENTRIES; i++, h = (h + 1) % ENTRIES) {
+      Entry &e = entries[h];
+      if (e.key == key) return &e;
+      if (e.key == ~0u) { e.key = key; return &e; }
+    }
+    return 0;
+  }
+
+  void account(unsigned key, char const *name, unsigned long long cycles) {
+    Entry *e = lookup(key);
+    if (!e) { dropped++; return; }
+    e->name = name;
+    e->count++;
+    e->sum += cycles;
+    if (cycles > e->max) e->max = cycles;
+    unsigned long long scaled = cycles >> MIN_SHIFT;
+    unsigned bucket = scaled >> 32 ? BUCKETS - 1 : (scaled ? Cpu::bsr(static_cast<unsigned>(scaled)) + 1 : 0);
+    e->hist[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+  }
+
+  void stop() {
+    unsigned long long cycles = Cpu::rdtsc() - _tic;
+    if (_reset) {
+      _reset = false;
+      reset();
+    }
+    account(KIND_EXIT << KIND_SHIFT | _reason, _name, cycles);
+    if (_detail != ~0u) account(_detail, 0, cycles);
+    _name = 0;
+  }
+
+  void summary(unsigned long &exits, unsigned long long &cycles) {
+    exits = 0;
+    cycles = 0;
+    for (unsigned i = 0; i < ENTRIES; i++)
+      if (entries[i].key != ~0u && (entries[i].key >> KIND_SHIFT) == KIND_EXIT) {
+        exits  += entries[i].count;
+        cycles += entries[i].sum;
+      }
+  }
+
+  void reset() {
+    memset(entries, 0, sizeof(entries));
+    for (unsigned i = 0; i < ENTRIES; i++) entries[i].key = ~0u;
+    dropped = 0;
+  }
+
+  ExitProfile(void const *_owner) : owner(_owner), nr(0), next(0), dropped(0), last_exits(0), _reason(0), _name(0), _detail(~0u), _tic(0), _reset(false)
+  {
+    reset();
+    do {
+      next = list;
+      nr = next ? next->nr + 1 : 0;
+    } while (Cpu::cmpxchg4b(&list, reinterpret_cast<unsigned>(next), reinterpret_cast<unsigned>(this)) != reinterpret_cast<unsigned>(next));
+  }
+};
+
+
+/**
+ * Periodic samples of the guest state of a VCPU. The VMM forces a
+ * recall of the VCPU and the recall handler records RIP, CR3 and CPL
+ * into a ring that keeps the newest samples.
+ */
+struct GuestProfile
+{
+  struct Sample {
+    unsigned rip;
+    unsigned cr3;
+    unsigned cpl;
+  };
+
+  void const *       owner;
+  unsigned           nr;
+  unsigned           recall;   ///< the capability to recall the VCPU
+  GuestProfile *     next;
+  unsigned volatile  pending;
+  unsigned long      idle;     ///< periods without an answer to the recall
+  unsigned long      head;
+  unsigned           size;
+  Sample *           ring;
+
+  static GuestProfile * volatile list;
+  static void dump();
+
+  static GuestProfile *get(void const *owner) {
+    for (GuestProfile *p = list; p; p = p->next)
+      if (p->owner == owner) return p;
+    return 0;
+  }
+
+  /**
+   * Record a sample if one was requested. The caller has to hold the
+   * lock dump() is called with.
+   */
+  static void sample(void const *owner, unsigned rip, unsigned cr3, unsigned cpl) {
+    GuestProfile *p = list ? get(owner) : 0;
+    if (!p || !p->pending) return;
+    Sample &s = p->ring[p->head++ & (p->size - 1)];
+    s.rip = rip;
+    s.cr3 = cr3;
+    s.cpl = cpl;
+    p->pending = 0;
+  }
+
+  /**
+   * Request a sample. Returns false if the last one is still pending.
+   */
+  bool request() {
+    if (pending) { idle++; return false; }
+    pending = 1;
+    return true;
+  }
+
+  GuestProfile(void const *_owner, unsigned _recall, unsigned entries)
+    : owner(_owner), nr(0), recall(_recall), next(0), pending(0), idle(0), head(0), size(1)
+  {
+    while (size < entries) size <<= 1;
+    ring = new Sample[size];
+    do {
+      next = list;
+      nr = next ? next->nr + 1 : 0;
+    } while (Cpu::cmpxchg4b(&list, reinterpret_cast<unsigned>(next), reinterpret_cast<unsigned>(this)) != reinterpret_cast<unsigned>(next));
+  }
+};
@@ -83,6 +83,177 @@ public:
 };
 
 
+/**
+ * Bounded ring with fixed items that can be filled by multiple
+ * producers at the same time.
+ *
+ * Every cell carries a sequence number that tells whether it is free
+ * for the producer or filled for the consumer (Vyukov's bounded
+ * queue). The free running read and write positions live on their
+ * own cache lines.
+ *
+ * A single consumer can use has_data(), get_buffer() and
+ * free_buffer() like with the Consumer. Multiple consumers have to
+ * use consume().
+ *
+ * A consumer that waits with wait() is only woken up by the first
+ * item of a burst. Consumers that block on the semaphore themselves
+ * get a wakeup for every item.
+ */
+template <typename T, unsigned SIZE>
+class RingConsumer
+{
+  static_assert(SIZE && !(SIZE & (SIZE - 1)), "SIZE has to be a power of two");
+public:
+  enum {
+    NOTIFY_ALWAYS = 0, ///< consumer does not use wait()
+    NOTIFY_AWAKE,
+    NOTIFY_ASLEEP,
+    CACHE_LINE = 64,
+  };
+
+  struct Cell {
+    volatile unsigned seq;
+    T                 value;
+  };
+
+  // Padded instead of aligned, as the consumer is allocated with plain new.
+  volatile unsigned  _wpos;
+  char               _pad0[CACHE_LINE - sizeof(unsigned)];
+  volatile unsigned  _rpos;
+  char               _pad1[CACHE_LINE - sizeof(unsigned)];
+  volatile unsigned  _notify;
+  char               _pad2[CACHE_LINE - sizeof(unsigned)];
+  Cell               _buffer[SIZE];
+
+  bool has_data() const { return _buffer[_rpos % SIZE].seq == _rpos + 1; }
+
+  T * get_buffer() { return &_buffer[_rpos % SIZE].value; }
+
+  void free_buffer()
+  {
+    unsigned pos = _rpos;
+    _buffer[pos % SIZE].seq = pos + SIZE;
+    _rpos = pos + 1;
+  }
+
+  /**
+   * Get an item. Can be called by multiple consumers.
+   */
+  bool consume(T &value)
+  {
+    unsigned pos = _rpos;
+    while (1) {
+      Cell &cell = _buffer[pos % SIZE];
+      int diff = cell.seq - (pos + 1);
+      if (diff < 0) return false;
+      if (!diff && Cpu::cmpxchg4b(&_rpos, pos, pos + 1) == pos) {
+        value = cell.value;
+        MEMORY_BARRIER;
+        cell.seq = pos + SIZE;
+        return true;
+      }
+      pos = _rpos;
+    }
+  }
+
+  unsigned consume(T *values, unsigned count)
+  {
+    unsigned i;
+    for (i = 0; i < count && consume(values[i]); i++)
+      ;
+    return i;
+  }
+
+  /**
+   * Block until there is data. Producers only up the semaphore after
+   * we have declared ourself asleep.
+   */
+  void wait(KernelSemaphore &sem)
+  {
+    while (!has_data()) {
+      Cpu::xchg(&_notify, static_cast<unsigned>(NOTIFY_ASLEEP));
+      if (has_data()) break;
+      sem.downmulti();
+    }
+    _notify = NOTIFY_AWAKE;
+  }
+
+  RingConsumer() : _wpos(0), _rpos(0), _notify(NOTIFY_ALWAYS)
+  {
+    for (unsigned i=0; i < SIZE; i++) _buffer[i].seq = i;
+  }
+};
+
+
+/**
+ * Producer for the RingConsumer. The produce functions can be called
+ * concurrently.
+ */
+template <typename T, unsigned SIZE>
+class RingProducer
+{
+protected:
+  RingConsumer<T, SIZE> *_consumer;
+  KernelSemaphore        _sem;
+  bool                   _dropping;
+
+  /**
+   * The ring is shared with the client, which can stall the loop by
+   * corrupting the sequence numbers. Giving up after SIZE attempts is
+   * treated as a full ring.
+   */
+  bool enqueue(const T &value)
+  {
+    unsigned pos = _consumer->_wpos;
+    for (unsigned tries = 0; tries < SIZE; tries++) {
+      typename RingConsumer<T, SIZE>::Cell &cell = _consumer->_buffer[pos % SIZE];
+      int diff = cell.seq - pos;
+      if (diff < 0) return false;
+      if (!diff && Cpu::cmpxchg4b(&_consumer->_wpos, pos, pos + 1) == pos) {
+        cell.value = value;
+        MEMORY_BARRIER;
+        cell.seq = pos + 1;
+        return true;
+      }
+      pos = _consumer->_wpos;
+    }
+    return false;
+  }
+
+  void notify()
+  {
+    // The locked instruction orders the item before reading the
+    // consumer state.
+    if (Cpu::cmpxchg4b(&_consumer->_notify, RingConsumer<T, SIZE>::NOTIFY_ASLEEP, RingConsumer<T, SIZE>::NOTIFY_AWAKE)
+        != RingConsumer<T, SIZE>::NOTIFY_AWAKE && _sem.up(false))
+      Logging::printf("  : ring producer issue - wake up failed\n");
+  }
+
+public:
+  /**
+   * Put a number of items in the buffer and wake up the consumer
+   * once. Returns the number of items produced.
+   */
+  unsigned produce(const T *values, unsigned count)
+  {
+    if (!_consumer) return 0;
+    unsigned i;
+    for (i = 0; i < count && enqueue(values[i]); i++)
+      ;
+    _dropping = i < count;
+    if (i) notify();
+    return i;
+  }
+
+  bool produce(T &value) { return produce(&value, 1); }
+
+  unsigned sm() { return _sem.sm(); }
+
+  RingProducer(RingConsumer<T, SIZE> *consumer = 0, unsigned nq = 0) : _consumer(consumer), _sem(nq), _dropping(false) {};
+};
+
+
 /**
  * Packet consumer that supports variable sized packets.
  */
@@ -37,15 +37,15 @@ enum {
 /**
  * Stdin push interface.
  */
-typedef Consumer<MessageInput, STDIN_SIZE> StdinConsumer;
-typedef Producer<MessageInput, STDIN_SIZE> StdinProducer;
+typedef RingConsumer<MessageInput, STDIN_SIZE> StdinConsumer;
+typedef RingProducer<MessageInput, STDIN_SIZE> StdinProducer;
 
 
 /**
  * Disk push interface.
  */
-typedef Consumer<MessageDiskCommit, DISKS_SIZE> DiskConsumer;
-typedef Producer<MessageDiskCommit, DISKS_SIZE> DiskProducer;
+typedef RingConsumer<MessageDiskCommit, DISKS_SIZE> DiskConsumer;
+typedef RingProducer<MessageDiskCommit, DISKS_SIZE> DiskProducer;
 
 
 /**
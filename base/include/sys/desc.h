@@ -69,6 +69,8 @@ enum {
   DESC_TYPE_IO   = 2,
   DESC_TYPE_CAP  = 3,
   DESC_RIGHT_R   = 0x4,
+  DESC_RIGHT_W   = 0x8,
+  DESC_RIGHT_X   = 0x10,
   DESC_RIGHT_EC_RECALL = 0x4,
   DESC_RIGHT_PD  = 0x4,
   DESC_RIGHT_EC  = 0x8,
@@ -78,6 +80,7 @@ enum {
   DESC_RIGHTS_ALL= 0x7c,
   DESC_RIGHT_PT_CTRL = 0x4,
   DESC_MEM_ALL   = DESC_TYPE_MEM | DESC_RIGHTS_ALL,
+  DESC_MEM_RX    = DESC_TYPE_MEM | DESC_RIGHT_R | DESC_RIGHT_X,
   DESC_IO_ALL    = DESC_TYPE_IO  | DESC_RIGHTS_ALL,
   DESC_CAP_ALL   = DESC_TYPE_CAP | DESC_RIGHTS_ALL,
   MAP_HBIT       = 0x801,
@@ -76,15 +76,57 @@ public:
  */
 class Semaphore
 {
+  enum {
+    SPIN_MIN = 16,
+    SPIN_MAX = 256,
+  };
   KernelSemaphore _sem;
-  long _value;
+  long volatile _value;
+  LockProfile *_profile;
 public:
   Semaphore(unsigned cap_sm = 0, bool create = false)
-    : _sem(cap_sm, create), _value(0) { };
+    : _sem(cap_sm, create), _value(0), _profile(0) { };
 
   void down() {  if (Cpu::atomic_xadd(&_value, -1) <= 0)  _sem.down(); }
   void up()   {  if (Cpu::atomic_xadd(&_value, +1) <  0)  _sem.up();   }
   unsigned sm() {  return  _sem.sm();  }
+
+  bool trydown() {
+    long v = _value;
+    return v > 0 && Cpu::cmpxchg4b(&_value, v, v - 1) == static_cast<unsigned>(v);
+  }
+
+  /**
+   * Take the semaphore as a lock. On contention we spin with
+   * exponential backoff first, as most critical sections are shorter
+   * than the semdown/semup syscalls needed to block. Always inlined,
+   * so that a LockProfile sees the lock site.
+   */
+  __attribute__((always_inline)) void lock() {
+    unsigned long long waited = 0;
+    if (!trydown()) {
+      COUNTER_INC("LOCK contended");
+      unsigned long long start = Cpu::rdtsc();
+      unsigned delay = SPIN_MIN;
+      for (; delay <= SPIN_MAX; delay <<= 1) {
+        for (unsigned i = 0; i < delay; i++) Cpu::pause();
+        if (trydown()) break;
+      }
+      if (delay > SPIN_MAX) down();
+      waited = Cpu::rdtsc() - start;
+    }
+    if (_profile) _profile->acquire(waited);
+  }
+
+  void unlock() {
+    if (_profile) _profile->release();
+    up();
+  }
+
+  /**
+   * Collect contention statistics for this lock.
+   */
+  void profile(LockProfile *profile) { _profile = profile; }
 };
 
 
@@ -94,11 +136,10 @@ public:
 class SemaphoreGuard
 {
   Semaphore &_sem;
-  unsigned long long _start;
 public:
-  SemaphoreGuard(Semaphore &sem) : _sem(sem) {
+  __attribute__((always_inline)) SemaphoreGuard(Semaphore &sem) : _sem(sem) {
     COUNTER_INC("LOCK count");
-    _sem.down();
+    _sem.lock();
   }
-  ~SemaphoreGuard() { _sem.up(); }
+  ~SemaphoreGuard() { _sem.unlock(); }
 };
@@ -94,6 +94,10 @@ struct Utcb
     Utcb *_utcb;
     unsigned _end;
     unsigned _consumed;
+    unsigned _first;  ///< first untyped word of the frame
+    unsigned _words;  ///< number of untyped words or ~0u for all words of the UTCB
+
+    unsigned limit() { return _words == ~0u ? _utcb->head.untyped : _first + _words; }
   public:
 
     /**
@@ -133,7 +137,7 @@ struct Utcb
     }
 
 
-    unsigned untyped() { return _utcb->head.untyped; }
+    unsigned untyped() { return limit() - _first; }
     unsigned typed()   { return _utcb->head.typed; }
     unsigned get_crd() { return _utcb->head.crd; }
 
@@ -145,26 +149,42 @@ struct Utcb
     template <typename T>
     bool get_word(T &value) {
       unsigned words = (sizeof(T) + sizeof(unsigned) - 1) / sizeof(unsigned);
-      if (_consumed + words > _utcb->head.untyped) return true;
+      if (_consumed + words > limit()) return true;
       value = *reinterpret_cast<T *>(_utcb->msg+_consumed);
       _consumed += words;
       return false;
     }
     unsigned *get_ptr() {return _utcb->msg+_consumed;}
-    unsigned short unconsumed() { return untyped() - _consumed; }
+    unsigned short unconsumed() { return limit() - _consumed; }
     char *get_string(unsigned &len) {
-      if (_consumed >= _utcb->head.untyped) return 0;
+      if (_consumed >= limit()) return 0;
       len = *(_utcb->msg + _consumed);
       _consumed += 1;
       char *res =  reinterpret_cast<char *>(_utcb->msg + _consumed);
       _consumed += (len + sizeof(unsigned) - 1) / sizeof(unsigned);
-      if (_consumed > _utcb->head.untyped) {
+      if (_consumed > limit()) {
         len = 0;
         return 0;
       }
       return res;
     }
 
+    /**
+     * Split the next request of a batch (see
+     * ParentProtocol::TYPE_BATCH) off into its own frame. The typed
+     * items are shared with this frame.
+     * @return true on error, false on success.
+     */
+    bool get_frame(Frame &request) {
+      unsigned words;
+      if (get_word(words) || words > unconsumed()) return true;
+      request = *this;
+      request._first = _consumed;
+      request._words = words;
+      _consumed += words;
+      return false;
+    }
+
     char *get_zero_string(unsigned &len) {
       char *res = get_string(len);
       if (res) {
@@ -177,7 +197,7 @@ struct Utcb
     /// Set receive window for the next call. This will not work with StaticPortalFunc! Use this only in custom protocols.
     Frame& operator <<(Crd value) { _utcb->head.crd = value.value(); return *this; }
 
-    Frame(Utcb *utcb, unsigned end) : _utcb(utcb), _end(end), _consumed() {}
+    Frame(Utcb *utcb, unsigned end) : _utcb(utcb), _end(end), _consumed(), _first(), _words(~0u) {}
   };
 
   /** Converts index to UTCB data to UTCB "frame pointers". */
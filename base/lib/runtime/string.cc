@@ -17,20 +17,113 @@
  */
 
 #include <service/string.h>
+#include <service/cpu.h>
 
 /************************************************************************
  * Memory functions.
+ *
+ * Small sizes use the plain string instructions. Medium sizes use
+ * "rep movsb" and "rep stosb" if the CPU has enhanced rep strings
+ * (ERMS). Areas larger than the caches bypass them with non-temporal
+ * SSE2 stores.
  ************************************************************************/
 
+namespace {
+
+  enum {
+    STRING_INIT = 1 << 0,
+    STRING_SSE2 = 1 << 1,
+    STRING_ERMS = 1 << 2,
+    ERMS_MIN    = 128,
+    NT_MIN      = 1 << 20,
+  };
+
+  unsigned string_features;
+
+  /**
+   * CPUID is expensive, especially in a VM, so we ask only once.
+   */
+  unsigned features() {
+    unsigned res = string_features;
+    if (res) return res;
+
+    unsigned ebx = 0, ecx = 0, edx = 0;
+    unsigned max = Cpu::cpuid(0, ebx, ecx, edx);
+    res = STRING_INIT;
+    ebx = ecx = edx = 0;
+    Cpu::cpuid(1, ebx, ecx, edx);
+    if (edx & (1 << 26)) res |= STRING_SSE2;
+    if (max >= 7) {
+      ebx = ecx = edx = 0;
+      Cpu::cpuid(7, ebx, ecx, edx);
+      if (ebx & (1 << 9)) res |= STRING_ERMS;
+    }
+    return string_features = res;
+  }
+
+  /**
+   * Copy with non-temporal stores to a 16 byte aligned destination.
+   */
+  __attribute__((target("sse2")))
+  void copy_nt(void *dst, const void *src, size_t count) {
+    size_t head = -reinterpret_cast<unsigned long>(dst) & 0xf;
+    count -= head;
+    asm volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(head) : : "memory");
+
+    size_t blocks = count / 64;
+    asm volatile ("1: movdqu (%1), %%xmm0; movdqu 16(%1), %%xmm1; movdqu 32(%1), %%xmm2; movdqu 48(%1), %%xmm3;"
+                  "movntdq %%xmm0, (%0); movntdq %%xmm1, 16(%0); movntdq %%xmm2, 32(%0); movntdq %%xmm3, 48(%0);"
+                  "add $64, %0; add $64, %1; dec %2; jnz 1b; sfence"
+                  : "+r"(dst), "+r"(src), "+r"(blocks) : : "memory", "xmm0", "xmm1", "xmm2", "xmm3");
+
+    count &= 63;
+    asm volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+  }
+
+  /**
+   * Fill with non-temporal stores to a 16 byte aligned destination.
+   */
+  __attribute__((target("sse2")))
+  void fill_nt(void *dst, unsigned value, size_t count) {
+    size_t head = -reinterpret_cast<unsigned long>(dst) & 0xf;
+    count -= head;
+    asm volatile ("rep stosb" : "+D"(dst), "+c"(head) : "a"(value) : "memory");
+
+    size_t blocks = count / 64;
+    asm volatile ("movd %2, %%xmm0; pshufd $0, %%xmm0, %%xmm0;"
+                  "1: movntdq %%xmm0, (%0); movntdq %%xmm0, 16(%0); movntdq %%xmm0, 32(%0); movntdq %%xmm0, 48(%0);"
+                  "add $64, %0; dec %1; jnz 1b; sfence"
+                  : "+r"(dst), "+r"(blocks) : "r"(value) : "memory", "xmm0");
+
+    count &= 63;
+    asm volatile ("rep stosb" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+  }
+}
+
 BEGIN_EXTERN_C
 
 void *memcpy(void *dst, const void *src, size_t count) {
 
   void *res = dst;
-  if (count & 1) asm volatile ("movsb" : "+D"(dst), "+S"(src) : : "memory");
+  if (count >= ERMS_MIN) {
+    unsigned f = features();
+    if (count >= NT_MIN && (f & STRING_SSE2)) {
+      copy_nt(dst, src, count);
+      return res;
+    }
+    if (f & STRING_ERMS) {
+      asm volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+      return res;
+    }
+    // misaligned stores are more expensive than misaligned loads
+    size_t head = -reinterpret_cast<unsigned long>(dst) & 3;
+    count -= head;
+    asm volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(head) : : "memory");
+  }
+  size_t words = count / 4;
+  asm volatile ("rep movsl" : "+D"(dst), "+S"(src), "+c" (words) : : "memory");
   if (count & 2) asm volatile ("movsw" : "+D"(dst), "+S"(src) : : "memory");
-  count /= 4;
-  asm volatile ("rep movsl" : "+D"(dst), "+S"(src), "+c" (count) : : "memory");
+  if (count & 1) asm volatile ("movsb" : "+D"(dst), "+S"(src) : : "memory");
   return res;
 }
 
@@ -52,20 +145,39 @@ void * memset(void *dst, int c, size_t count) {
 
   void *res = dst;
   unsigned value = (c & 0xff) * 0x01010101;
-  if (count & 1) asm volatile ("stosb" : "+D"(dst) : "a"(value) : "memory");
+  if (count >= ERMS_MIN) {
+    unsigned f = features();
+    if (count >= NT_MIN && (f & STRING_SSE2)) {
+      fill_nt(dst, value, count);
+      return res;
+    }
+    if (f & STRING_ERMS) {
+      asm volatile ("rep stosb" : "+D"(dst), "+c"(count) : "a"(value) : "memory");
+      return res;
+    }
+    size_t head = -reinterpret_cast<unsigned long>(dst) & 3;
+    count -= head;
+    asm volatile ("rep stosb" : "+D"(dst), "+c"(head) : "a"(value) : "memory");
+  }
+  size_t words = count / 4;
+  asm volatile ("rep stosl" : "+D"(dst), "+c"(words) : "a"(value)  : "memory");
   if (count & 2) asm volatile ("stosw" : "+D"(dst) : "a"(value) : "memory");
-  count /= 4;
-  asm volatile ("rep stosl" : "+D"(dst), "+c"(count) : "a"(value)  : "memory");
+  if (count & 1) asm volatile ("stosb" : "+D"(dst) : "a"(value) : "memory");
   return res;
 }
 
 
 int memcmp(const void *dst, const void *src, size_t count) {
-  const char *d = reinterpret_cast<const char *>(dst);
-  const char *s = reinterpret_cast<const char *>(src);
-  unsigned diff = 0;
-  while (!diff && count--) diff = *d++ - *s++;
-  return diff;
+  typedef unsigned long __attribute__((may_alias)) word;
+  const unsigned char *d = reinterpret_cast<const unsigned char *>(dst);
+  const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+
+  // skip equal words, the differing byte is searched below
+  for (; count >= sizeof(word); count -= sizeof(word), d += sizeof(word), s += sizeof(word))
+    if (*reinterpret_cast<const word *>(d) != *reinterpret_cast<const word *>(s)) break;
+  for (; count; count--, d++, s++)
+    if (*d != *s) return *d - *s;
+  return 0;
 }
 
 
@@ -0,0 +1,163 @@
+/** @file
+ * Lock profiling.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "service/profile.h"
+#include "service/logging.h"
+#include "service/math.h"
+#include "service/vprintf.h"
+
+LockProfile * volatile LockProfile::list;
+
+void
+LockProfile::dump(bool full)
+{
+  for (LockProfile *p = list; p; p = p->next) {
+    if (!p->acquired && !full) continue;
+    Logging::printf("\tLOCK %12s acq %8lu cont %8lu wait %10llu hold %10llu avg hold %llu\n", p->name, p->acquired, p->contended,
+                    p->wait, p->hold, p->acquired ? Math::muldiv128(p->hold, 1, p->acquired) : 0ULL);
+    for (unsigned i = 0; i < SITES; i++) {
+      Site &s = p->sites[i];
+      if (!s.acquired || (!s.contended && !full)) continue;
+      Logging::printf("\t     %12p acq %8lu cont %8lu wait %10llu hold %10llu\n", s.ip, s.acquired, s.contended, s.wait, s.hold);
+    }
+  }
+}
+
+
+ExitProfile * volatile ExitProfile::list;
+
+/**
+ * Print the exits per second of every VCPU since the last call as a
+ * PERF line. The period is given in milliseconds.
+ */
+void
+ExitProfile::rate(unsigned period)
+{
+  for (ExitProfile *p = list; p; p = p->next) {
+    unsigned long exits;
+    unsigned long long cycles;
+    p->summary(exits, cycles);
+    // the profile may have been reset in between
+    unsigned long delta = exits >= p->last_exits ? exits - p->last_exits : exits;
+    p->last_exits = exits;
+    Logging::printf("! %s:%d PERF: vcpu%u_exit_rate %llu exits/s ok\n", __FILE__, __LINE__, p->nr, Math::muldiv128(delta, 1000, period));
+  }
+}
+
+/**
+ * Print the profiles with the most expensive keys first. With perf
+ * set, the lines are in the wvtest PERF format, so that they can be
+ * collected like the results of a test.
+ */
+void
+ExitProfile::dump(bool perf)
+{
+  static char const * const kinds[] = { "exit", "io", "mmio" };
+
+  for (ExitProfile *p = list; p; p = p->next) {
+    Entry *sorted[ENTRIES];
+    unsigned count = 0;
+    unsigned long long total;
+    unsigned long exits;
+    p->summary(exits, total);
+
+    // insertion sort by the cycles spent
+    for (unsigned i = 0; i < ENTRIES; i++) {
+      Entry *e = p->entries + i;
+      if (e->key == ~0u) continue;
+      unsigned j = count++;
+      for (; j && sorted[j - 1]->sum < e->sum; j--) sorted[j] = sorted[j - 1];
+      sorted[j] = e;
+    }
+
+    if (perf) {
+      Logging::printf("! %s:%d PERF: vcpu%u_exits %lu ok\n", __FILE__, __LINE__, p->nr, exits);
+      Logging::printf("! %s:%d PERF: vcpu%u_cycles %llu cycles ok\n", __FILE__, __LINE__, p->nr, total);
+    }
+    else
+      Logging::printf("\tEXITS vcpu%u exits %lu cycles %llu dropped %lu\n", p->nr, exits, total, p->dropped);
+
+    for (unsigned i = 0; i < count; i++) {
+      Entry *e = sorted[i];
+      unsigned kind = e->key >> KIND_SHIFT;
+      unsigned value = e->key & ((1 << KIND_SHIFT) - 1);
+      char name[32];
+      if (kind == KIND_EXIT && e->name)
+        Vprintf::snprintf(name, sizeof(name), "%s", e->name);
+      else
+        Vprintf::snprintf(name, sizeof(name), "%s_%#x", kind < sizeof(kinds) / sizeof(kinds[0]) ? kinds[kind] : "?", value);
+
+      unsigned long long avg = Math::muldiv128(e->sum, 1, e->count);
+      if (perf) {
+        Logging::printf("! %s:%d PERF: vcpu%u_%s_count %lu ok\n", __FILE__, __LINE__, p->nr, name, e->count);
+        Logging::printf("! %s:%d PERF: vcpu%u_%s_avg %llu cycles ok\n", __FILE__, __LINE__, p->nr, name, avg);
+        Logging::printf("! %s:%d PERF: vcpu%u_%s_max %llu cycles ok\n", __FILE__, __LINE__, p->nr, name, e->max);
+        continue;
+      }
+
+      Logging::printf("\t%16s count %8lu sum %12llu avg %8llu max %10llu %3u%%\n", name, e->count, e->sum, avg, e->max,
+                      total ? static_cast<unsigned>(Math::muldiv128(e->sum, 100, total)) : 0);
+      Logging::printf("\t%16s", "");
+      for (unsigned b = 0; b < BUCKETS; b++)
+        if (e->hist[b]) Logging::printf(" <%u:%lu", 1u << (b + MIN_SHIFT), e->hist[b]);
+      Logging::printf("\n");
+    }
+  }
+}
+
+
+GuestProfile * volatile GuestProfile::list;
+
+/**
+ * Print the samples as "gp:" lines, one per distinct (CPL, CR3, RIP)
+ * with its count, and empty the rings. tools/guestprof.py turns them
+ * into a flat profile. The caller holds the lock sample() is called
+ * with.
+ */
+void
+GuestProfile::dump()
+{
+  for (GuestProfile *p = list; p; p = p->next) {
+    // a sample requested before is dropped
+    p->pending = 0;
+    unsigned count = p->head < p->size ? p->head : p->size;
+    Sample *s = p->ring;
+
+    // shellsort by cr3, rip and cpl
+    for (unsigned gap = count / 2; gap; gap /= 2)
+      for (unsigned i = gap; i < count; i++) {
+        Sample tmp = s[i];
+        unsigned j = i;
+        for (; j >= gap; j -= gap) {
+          Sample &o = s[j - gap];
+          if (o.cr3 < tmp.cr3 || (o.cr3 == tmp.cr3 && (o.rip < tmp.rip || (o.rip == tmp.rip && o.cpl <= tmp.cpl)))) break;
+          s[j] = o;
+        }
+        s[j] = tmp;
+      }
+
+    Logging::printf("gp: begin vcpu %u samples %lu idle %lu\n", p->nr, p->head, p->idle);
+    for (unsigned i = 0, n; i < count; i += n) {
+      for (n = 1; i + n < count && s[i + n].cr3 == s[i].cr3 && s[i + n].rip == s[i].rip && s[i + n].cpl == s[i].cpl; n++) {}
+      Logging::printf("gp: %u %u %x %x %u\n", p->nr, s[i].cpl, s[i].cr3, s[i].rip, n);
+    }
+    Logging::printf("gp: end\n");
+
+    p->head = 0;
+    p->idle = 0;
+  }
+}
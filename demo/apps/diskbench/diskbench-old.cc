@@ -102,7 +102,7 @@ public:
     while (requests - requests_done < outstanding) submit_disk();
 
     while (1) {
-      sem->downmulti();
+      diskconsumer->wait(*sem);
       while (diskconsumer->has_data()) {
 
 	MessageDiskCommit *msg = diskconsumer->get_buffer();
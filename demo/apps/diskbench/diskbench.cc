@@ -28,6 +28,7 @@ unsigned long blocksize = 512;
 unsigned outstanding=5;
 bool wvtest = false;
 bool lorem_ipsum = false;
+bool batch = false;
 PARAM_HANDLER(blocksize,
 	      "blocksize:value - override the default blocksize", "Example: 'blocksize:65536'")
 {
@@ -51,6 +52,7 @@ PARAM_HANDLER(outstanding,
 
 PARAM_HANDLER(wvtest) {wvtest = true;}
 PARAM_HANDLER(lorem_ipsum) {lorem_ipsum = true;}
+PARAM_HANDLER(batch, "batch - submit all missing requests in a single batch") {batch = true;}
 
 class App : public NovaProgram, ProgramConsole
 {
@@ -74,6 +76,21 @@ class App : public NovaProgram, ProgramConsole
     if (res) Logging::panic("submit(%ld) failed: %x\n", blocksize, res);
   }
 
+  void submit_batch() {
+    DmaDescriptor dma;
+    dma.byteoffset = 0;
+    dma.bytecount  = blocksize;
+    DiskProtocol::Batch b(*disk, *myutcb());
+    // op, disk, usertag, sector, dmacount and one descriptor
+    while (requests - requests_done < outstanding && b.fits(4 + (sizeof(unsigned long long) + sizeof(dma)) / sizeof(unsigned)))
+      disk->read_write(b, true, /*disk*/0, /*usertag*/requests++, /*sector*/0, /*dmacount*/1, &dma);
+    if (!b.count()) return;
+    unsigned res = b.call();
+    if (res) Logging::panic("batch of %u failed: %x\n", b.count(), res);
+    for (unsigned i = 0; i < b.count(); i++)
+      if (b.result(i)) Logging::panic("batched submit(%ld) failed: %x\n", blocksize, b.result(i));
+  }
+
 public:
   NORETURN
   int run(Utcb *utcb, Hip *hip)
@@ -107,6 +124,7 @@ public:
     timevalue start = mb->clock()->clock(FREQ);
 
     // prefill the buffer
+    if (batch) submit_batch();
     while (requests - requests_done < outstanding) submit_disk();
 
     while (1) {
@@ -155,8 +173,9 @@ public:
 	  start = now;
 	}
 	// submit the next request
-	submit_disk();
+	if (!batch) submit_disk();
       }
+      if (batch) submit_batch();
     }
   }
 };
@@ -210,7 +210,7 @@ public:
       if (last_page != page) show_page(page);
       last_page = page;
 
-      sem.downmulti();
+      stdinconsumer.wait(sem);
       while (stdinconsumer.has_data()) {
         MessageInput *kmsg = stdinconsumer.get_buffer();
         switch (kmsg->data & ~KBFLAG_NUM) {
@@ -43,7 +43,7 @@ struct Tutor : public NovaProgram,
 
     print_screen1(_console_data.screen_address, line);
     while (1) {
-      sem.downmulti();
+      stdinconsumer.wait(sem);
       while (stdinconsumer.has_data()) {
         MessageInput *kmsg = stdinconsumer.get_buffer();
         switch (kmsg->data & ~KBFLAG_NUM) {
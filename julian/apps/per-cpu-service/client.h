@@ -4,6 +4,8 @@
 #include <nul/baseprogram.h>
 #include <nul/parent.h>
 
+#include "service.h"
+
 /// A simple per-cpu client. Constructing a CpuLocalClient implicitly
 /// creates a session to the given service. Sessions are not closed on
 /// object destruction, as it might interfere with modularity (see
@@ -30,6 +32,16 @@ public:
     return nova_call(_session);
   }
 
+  // Move the session state to the service worker on another CPU. The
+  // session portal of this client becomes invalid. A client on the
+  // other CPU has to open the session again with the same pseudonym.
+  unsigned migrate(phy_cpu_no cpu)
+  {
+    _utcb.add_frame()
+      << BaseService::TYPE_MIGRATE << cpu << Utcb::TypedMapCap(_pseudonym);
+    return ParentProtocol::call(_utcb, _portal, true, false);
+  }
+
   // Create session for the calling CPU.
   Client(Utcb &utcb, CapAllocator *cap, const char *service, unsigned instance, bool blocking = true, bool single = false)
     : _utcb(utcb), _cap_alloc(cap), _service(service), _single(single)
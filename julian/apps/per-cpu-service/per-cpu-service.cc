@@ -81,6 +81,26 @@ public:
       Logging::printf("call cycles %llu\n", (Cpu::rdtsc() - start) / 0x1000);
     }
 
+    // Migrate a session
+    {
+      Client c(*utcb, this, "s0/pcpus", 0);
+      WVPASSEQ(c.migrate(Config::MAX_CPUS), static_cast<unsigned>(EPROTO));
+      WVPASSEQ(c.migrate(BaseProgram::mycpu()), static_cast<unsigned>(ENONE));
+      WVPASSEQ(c.call(), static_cast<unsigned>(ENONE));
+
+      for (unsigned i = 0; i < hip->cpu_desc_count(); i++) {
+        Hip_cpu const &cpu = hip->cpus()[i];
+        if (not cpu.enabled() || i == BaseProgram::mycpu()) continue;
+
+        WVPASSEQ(c.migrate(i), static_cast<unsigned>(ENONE));
+        // The session portal of this CPU is gone.
+        WVPASS(c.call() != ENONE);
+        // The session is not found here anymore.
+        WVPASSEQ(c.migrate(i), static_cast<unsigned>(EPROTO));
+        break;
+      }
+    }
+
     WV("Done");
     WvTest::exit(0);
     block_forever();
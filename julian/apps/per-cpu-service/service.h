@@ -8,26 +8,42 @@
 #include <nul/program.h>
 #include <sigma0/console.h>
 
+#include "closure.h"
 #include "queue.h"
 
 class BaseService {
 
+public:
+  enum {
+    // Ask the service to move the session of the given pseudonym to
+    // the worker of another CPU. Reopen the session there to get its
+    // new portal.
+    TYPE_MIGRATE = ParentProtocol::TYPE_GENERIC_END,
+  };
+
 protected:
   struct BaseSession : public Queue<BaseSession>::ListElement {
     cap_sel          sm_pseudonym;
     const cap_sel    pt;
     Closure          closure;
+    BaseSession     *index_next; // next session in the same index slot
 
     // Called during session destruction when no worker holds a
     // reference to this session object anymore.
     virtual void cleanup() { }
 
+    // Called in ec_service of the new CPU after the session was
+    // migrated and before its portal is recreated.
+    virtual void migrated(phy_cpu_no cpu) { }
+
     explicit BaseSession(cap_sel pt) : pt(pt) { }
   };
 
   Queue<BaseSession>     _free_sessions;
 
   struct per_cpu {
+    enum { INDEX_SIZE = 256 };
+
     cap_sel ec_service;         // session life-cycle (open, close)
     cap_sel pt_service;         // runs on ec_service
 
@@ -35,26 +51,40 @@ protected:
     cap_sel ec_client;          // normal client<->server interaction
     cap_sel pt_flush;           // drain clients
 
-    // Structure of this list is only modified in ec_service!
-    BaseSession *sessions;
+    // Sessions indexed by their pseudonym selector. Selectors come
+    // from a cap allocator and are mostly dense, so collisions are
+    // rare and chained via index_next.
+    // Structure of the index is only modified in ec_service!
+    BaseSession *index[INDEX_SIZE];
+
+    // Sessions migrated from other CPUs. They are added to the index
+    // by ec_service on its next request.
+    Queue<BaseSession> incoming;
+
+    static unsigned slot(cap_sel sm_pseudonym) { return sm_pseudonym & (INDEX_SIZE - 1); }
 
     BaseSession *find_session(cap_sel sm_pseudonym)
     {
-      for (BaseSession *c = sessions; c != NULL; c = c->next)
+      for (BaseSession *c = index[slot(sm_pseudonym)]; c != NULL; c = c->index_next)
         if (c->sm_pseudonym == sm_pseudonym)
           return c;
       return NULL;
     }
 
+    void add_session(BaseSession *s)
+    {
+      BaseSession **head = &index[slot(s->sm_pseudonym)];
+      s->index_next = *head;
+      MEMORY_BARRIER;
+      *head = s;
+    }
+
     void remove_session(BaseSession *s)
     {
-      if (sessions == s) {
-        sessions = sessions->next;
-      } else for (BaseSession *c = sessions; c != NULL; c = c->next) {
-          if (c->next == s) {
-            c->next = s->next;
-            return;
-          }
+      for (BaseSession **c = &index[slot(s->sm_pseudonym)]; *c != NULL; c = &(*c)->index_next)
+        if (*c == s) {
+          *c = s->index_next;
+          return;
         }
     }
 
@@ -78,14 +108,44 @@ protected:
     // concurrency. Remember: Session list modifications only happen
     // in ec_service.
 
-    for (BaseSession *s = local.sessions; s != NULL; s = s->next) {
-      if (nova_lookup(Crd(s->sm_pseudonym, 0, DESC_CAP_ALL)).value() == 0) {
-        Logging::printf("Garbage collect session %p\n", s);
-        close_session(local, s);
+    for (unsigned i = 0; i < per_cpu::INDEX_SIZE; i++)
+      for (BaseSession *s = local.index[i], *next; s != NULL; s = next) {
+        // s goes to the free list in close_session()
+        next = s->index_next;
+        if (nova_lookup(Crd(s->sm_pseudonym, 0, DESC_CAP_ALL)).value() == 0) {
+          Logging::printf("Garbage collect session %p\n", s);
+          close_session(local, s);
+        }
       }
+  }
+
+  void adopt_sessions(per_cpu &local)
+  {
+    // This has to run in ec_service!
+    for (BaseSession *s; (s = local.incoming.dequeue()) != NULL;) {
+      s->migrated(BaseProgram::mycpu());
+      unsigned res = nova_create_pt(s->pt, local.ec_client,
+                                    s->closure.value(), 0);
+      assert(res == NOVA_ESUCCESS);
+      local.add_session(s);
     }
   }
 
+  virtual void migrate_session(per_cpu &local, BaseSession *s, phy_cpu_no cpu)
+  {
+    // This has to run in ec_service!
+
+    // Like close_session(), but the pseudonym and the session object
+    // stay alive. The portal selector is recreated on the new CPU.
+    nova_revoke(Crd(s->pt, 0, DESC_CAP_ALL), true);
+
+    unsigned res = nova_call(local.pt_flush);
+    assert(res == NOVA_ESUCCESS);
+
+    local.remove_session(s);
+    _per_cpu[cpu].incoming.enqueue(s);
+  }
+
   virtual void close_session(per_cpu &local, BaseSession *s)
   {
     // This has to run in ec_service!
@@ -122,6 +182,8 @@ public:
     per_cpu &local = _per_cpu[BaseProgram::mycpu()];
     unsigned res;
 
+    adopt_sessions(local);
+
     switch (op) {
     case ParentProtocol::TYPE_OPEN: {
       BaseSession *s = local.find_session(input.received_cap());
@@ -144,10 +206,8 @@ public:
 
       // No synchronization needed. Only modified in this EC
       s->sm_pseudonym = input.received_cap();
-      s->next = local.sessions;
-      MEMORY_BARRIER;
-      local.sessions = s;
-      
+      local.add_session(s);
+
       map_session:
       utcb << Utcb::TypedMapCap(s->pt);
       return ENONE;
@@ -159,6 +219,16 @@ public:
       close_session(local, s);
       return ENONE;
     }
+    case TYPE_MIGRATE: {
+      unsigned cpu;
+      check1(EPROTO, input.get_word(cpu));
+      if (cpu >= Config::MAX_CPUS || _per_cpu[cpu].ec_service == 0) return EPROTO;
+
+      BaseSession *s = local.find_session(input.received_cap());
+      if (s == 0) return EPROTO;
+      if (cpu != BaseProgram::mycpu()) migrate_session(local, s, cpu);
+      return ENONE;
+    }
     };
 
     return EPROTO;
@@ -182,7 +252,7 @@ public:
       Hip_cpu const &cpu = Global::hip.cpus()[i];
       if (not cpu.enabled()) continue;
 
-      _per_cpu[i].sessions = NULL;
+      memset(_per_cpu[i].index, 0, sizeof(_per_cpu[i].index));
 
       // Create client EC
       Utcb *utcb_client;
@@ -0,0 +1,144 @@
+/**
+ * @file
+ * IPC round-trip latency of a service depending on the number of
+ * open sessions.
+ *
+ * The test is service and client at the same time. A worker thread
+ * serves a portal that looks up the session of the caller in a
+ * ClientDataStorage. The client calls it with the identity of the
+ * oldest session, which is the last one in the session list. This is
+ * a hit in the identity cache after the first call.
+ *
+ * As a baseline, the first call of every new session is measured as
+ * well. It misses the cache and walks the session list.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <wvprogram.h>
+#include <nul/generic_service.h>
+#include <nul/motherboard.h>
+#include <service/math.h>
+
+unsigned tries = 10000;
+unsigned max_sessions = 1024;
+
+PARAM_HANDLER(tries)    { tries = argv[0]; }
+PARAM_HANDLER(sessions) { max_sessions = argv[0]; }
+
+class SessionPerf : public WvProgram
+{
+  enum { TYPE_PING = ParentProtocol::TYPE_GENERIC_END };
+
+  /// Sessions are created locally, so there is no parent to ask for quota.
+  struct ClientData : public GenericClientData {
+    unsigned count;
+    static unsigned get_quota(Utcb &utcb, unsigned _pseudonym, const char *name, long value_in, long *value_out=0) { return ENONE; }
+    void session_close(Utcb &utcb) {}
+  };
+
+  typedef ClientDataStorage<ClientData, SessionPerf, false> Storage;
+
+  ALIGNED(8) Storage _storage;
+  unsigned _pt;
+
+public:
+
+  inline unsigned alloc_crd() { return Crd(alloc_cap(), 0, DESC_CAP_ALL).value(); }
+
+  unsigned portal_func(Utcb &utcb, Utcb::Frame &input, bool &free_cap, cap_sel pid)
+  {
+    unsigned op, res;
+    check1(EPROTO, input.get_word(op));
+    if (op != TYPE_PING) return EPROTO;
+
+    Storage::Guard guard_c(&_storage);
+    ClientData *data = 0;
+    check1(res, res = _storage.get_client_data(utcb, data, input.identity()));
+    data->count++;
+    return ENONE;
+  }
+
+  unsigned ping(Utcb &utcb, unsigned identity) {
+    ParentProtocol::init_frame(utcb, TYPE_PING, identity);
+    return ParentProtocol::call(utcb, _pt, true, false);
+  }
+
+  void measure(Utcb *utcb, unsigned sessions, unsigned identity)
+  {
+    uint64 tic, tac, sum = 0, min = ~0ull;
+
+    WVPASSEQ(ping(*utcb, identity), 0U); // warmup
+    for (unsigned i = 0; i < tries; i++) {
+      tic = Cpu::rdtsc();
+      ping(*utcb, identity);
+      tac = Cpu::rdtsc();
+      sum += tac - tic;
+      min  = MIN(min, tac - tic);
+    }
+    uint64 avg = Math::muldiv128(sum, 1, tries);
+    Logging::printf("sessions %u\n", sessions);
+    WVPERF(avg, "cycles");
+    WVPERF(min, "cycles");
+  }
+
+  void measure_miss(Utcb *utcb, unsigned sessions, unsigned *identities, unsigned count)
+  {
+    uint64 tic, sum = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+      tic = Cpu::rdtsc();
+      ping(*utcb, identities[i]);
+      sum += Cpu::rdtsc() - tic;
+    }
+    uint64 miss = Math::muldiv128(sum, 1, count);
+    Logging::printf("sessions %u first call\n", sessions);
+    WVPERF(miss, "cycles");
+  }
+
+  void wvrun(Utcb *utcb, Hip *hip)
+  {
+    Motherboard *mb = new Motherboard(new Clock(hip->freq_tsc*1000), hip);
+    mb->parse_args(reinterpret_cast<const char *>(hip->get_mod(0)->aux));
+
+    Utcb *utcb_worker;
+    unsigned cpu = utcb->head.nul_cpunr;
+    unsigned ec  = create_ec4pt(this, cpu, alloc_cap(16), &utcb_worker, alloc_cap());
+    WVPASS(ec);
+    utcb_worker->head.crd = alloc_crd();
+    utcb_worker->head.crd_translate = Crd(0, 31, DESC_CAP_ALL).value();
+
+    _pt = alloc_cap();
+    unsigned long portal_func = reinterpret_cast<unsigned long>(StaticPortalFunc<SessionPerf>::portal_func);
+    WVNOVA(nova_create_pt(_pt, ec, portal_func, 0));
+
+    // The first session ends up last in the list.
+    ClientData *first = 0, *data;
+    WVNUL(_storage.alloc_client_data(*utcb, first, ParentProtocol::CAP_PARENT_ID, this));
+
+    // the identities of the sessions that were not called yet
+    unsigned *fresh = new unsigned[max_sessions];
+    for (unsigned sessions = 1; sessions <= max_sessions; sessions *= 2) {
+      measure(utcb, sessions, first->get_identity());
+      for (unsigned i = sessions; i < 2 * sessions; i++) {
+        WVNUL(_storage.alloc_client_data(*utcb, data, ParentProtocol::CAP_PARENT_ID, this));
+        fresh[i - sessions] = data->get_identity();
+      }
+      measure_miss(utcb, 2 * sessions, fresh, sessions);
+    }
+    delete [] fresh;
+  }
+};
+
+ASMFUNCS(SessionPerf, WvTest)
@@ -0,0 +1,91 @@
+/**
+ * @file
+ * Capability allocator recycling and contiguous allocation
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <wvprogram.h>
+#include <util/capalloc_partition.h>
+
+class CapAllocTest : public WvProgram
+{
+  enum { ORDER = 12, ROUNDS = 10000 };
+  typedef CapAllocatorAtomicPartition<1 << ORDER> Partition;
+
+  void bump()
+  {
+    unsigned base = alloc_cap_region(1 << ORDER, ORDER);
+    CapAllocator ca(base, base, ORDER);
+    unsigned a, b;
+
+    // the last allocation is rolled back
+    WVPASSEQ(a = ca.alloc_cap(4), base);
+    WV(ca.dealloc_cap(a, 4));
+    WVPASSEQ(ca.alloc_cap(4), base);
+
+    // single selectors in the middle are reused
+    WVPASS(b = ca.alloc_cap());
+    WVPASS(ca.alloc_cap());
+    WV(ca.dealloc_cap(b));
+    WVPASSEQ(ca.alloc_cap(), b);
+
+    // a long running service must not run out of selectors
+    unsigned start = ca._cap_;
+    for (unsigned i = 0; i < ROUNDS; i++) ca.dealloc_cap(ca.alloc_cap());
+    WVPASSEQ(static_cast<unsigned>(ca._cap_), start);
+    dealloc_cap_region(base, 1 << ORDER);
+  }
+
+  void partition(Hip *hip)
+  {
+    unsigned base = alloc_cap_region(1 << ORDER, ORDER);
+    Partition *pa = new Partition(base, hip->cpu_count());
+    unsigned a, b, c;
+
+    WVPASS(a = pa->alloc_cap());
+    WV(pa->dealloc_cap(a));
+    WVPASSEQ(pa->alloc_cap(), a);
+
+    // contiguous ranges, also crossing bitmap words
+    WVPASS(b = pa->alloc_cap(40));
+    WVPASS(c = pa->alloc_cap(40));
+    WVPASS(c >= b + 40 || c + 40 <= b);
+    WV(pa->dealloc_cap(b, 40));
+    WV(pa->dealloc_cap(c, 40));
+
+    // ranges are returned to the bitmap
+    unsigned failed = 0;
+    for (unsigned i = 0; i < ROUNDS; i++) {
+      if (!(b = pa->alloc_cap(40))) failed++;
+      else pa->dealloc_cap(b, 40);
+    }
+    WVPASSEQ(failed, 0u);
+
+    uint64 tic = Cpu::rdtsc();
+    for (unsigned i = 0; i < ROUNDS; i++) pa->dealloc_cap(pa->alloc_cap());
+    uint64 alloc_dealloc = Math::muldiv128(Cpu::rdtsc() - tic, 1, ROUNDS);
+    WVPERF(alloc_dealloc, "cycles");
+    dealloc_cap_region(base, 1 << ORDER);
+  }
+
+public:
+  void wvrun(Utcb *utcb, Hip *hip)
+  {
+    bump();
+    partition(hip);
+  }
+};
+
+ASMFUNCS(CapAllocTest, WvTest)
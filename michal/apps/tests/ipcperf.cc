@@ -0,0 +1,385 @@
+/**
+ * @file
+ * IPC round-trip and service latency benchmark
+ *
+ * Measures the latency of portal calls depending on the payload and
+ * the number of typed items, of semaphore round-trips on the same and
+ * on another CPU, and of the calls to the services of sigma0 with an
+ * increasing number of concurrent clients. Every measurement is
+ * reported as percentiles in PERF lines.
+ *
+ * Portal calls are always local to a CPU in NOVA, so the cross-CPU
+ * case is measured with a semaphore ping-pong.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <wvprogram.h>
+#include <nul/generic_service.h>
+#include <nul/motherboard.h>
+#include <nul/service_timer.h>
+#include <nul/service_disk.h>
+#include <nul/service_fs.h>
+#include <nul/service_admission.h>
+#include <service/math.h>
+
+enum {
+  MAXTRIES   = 4096,
+  MAXCLIENTS = 8,
+  BATCH      = 32,
+};
+
+unsigned tries = 1000;
+unsigned max_clients = MAXCLIENTS;
+
+PARAM_HANDLER(tries)   { tries = MIN(static_cast<unsigned>(MAXTRIES), argv[0]); }
+PARAM_HANDLER(clients) { max_clients = MIN(static_cast<unsigned>(MAXCLIENTS), argv[0]); }
+
+class IpcPerf : public WvProgram
+{
+  enum { TYPE_PING = ParentProtocol::TYPE_GENERIC_END };
+
+  struct Samples {
+    uint64   value[MAXTRIES * MAXCLIENTS];
+    unsigned count;
+  };
+
+  struct Client {
+    KernelSemaphore start;
+    KernelSemaphore partner;   ///< for the semaphore ping-pong
+    Samples         samples;
+    bool            pingpong;
+  };
+
+  Samples           _samples;
+  Client *          _clients[MAXCLIENTS];
+  unsigned          _nclients;
+  KernelSemaphore   _done;
+  TimerProtocol *   _timer;
+  unsigned          _pt;
+  unsigned          _sm;
+
+  static void startup(unsigned pid, void *tls, Utcb *utcb) __attribute__((regparm(1)))
+  {
+    utcb->eip = reinterpret_cast<unsigned *>(utcb->esp)[0];
+    asmlinkage_protect("g"(tls), "g"(utcb));
+  }
+
+  /**
+   * Sort the samples and report them as percentiles.
+   */
+  static void report(char const *name, Samples &s)
+  {
+    // shellsort - the samples are mostly sorted already
+    for (unsigned gap = s.count / 2; gap; gap /= 2)
+      for (unsigned i = gap; i < s.count; i++)
+        for (unsigned j = i; j >= gap && s.value[j - gap] > s.value[j]; j -= gap) {
+          uint64 tmp = s.value[j];
+          s.value[j] = s.value[j - gap];
+          s.value[j - gap] = tmp;
+        }
+
+    static struct { char const *name; unsigned permille; } const points[] = {
+      { "min", 0 }, { "p50", 500 }, { "p90", 900 }, { "p99", 990 }, { "max", 1000 } };
+    for (unsigned i = 0; s.count && i < sizeof(points) / sizeof(points[0]); i++) {
+      char text[64];
+      Vprintf::snprintf(text, sizeof(text), "PERF: %s_%s", name, points[i].name);
+      WvTest t(__FILE__, __LINE__, text);
+      t.check_perf(s.value[MIN(s.count - 1, s.count * points[i].permille / 1000)], "cycles");
+    }
+  }
+
+  template <class F>
+  static void measure(Samples &s, F &func)
+  {
+    s.count = 0;
+    func(); // warmup
+    for (unsigned i = 0; i < tries; i++) {
+      uint64 tic = Cpu::rdtsc();
+      func();
+      s.value[s.count++] = Cpu::rdtsc() - tic;
+    }
+  }
+
+  template <class F>
+  void bench(char const *name, F func)
+  {
+    measure(_samples, func);
+    report(name, _samples);
+  }
+
+public:
+
+  inline unsigned alloc_crd() { return Crd(alloc_cap(), 0, DESC_CAP_ALL).value(); }
+
+  unsigned portal_func(Utcb &utcb, Utcb::Frame &input, bool &free_cap, cap_sel pid)
+  {
+    unsigned op;
+    check1(EPROTO, input.get_word(op));
+    return op == TYPE_PING ? ENONE : EPROTO;
+  }
+
+  /**
+   * Call the local portal with the given number of untyped words and
+   * translated items.
+   */
+  struct Ping {
+    IpcPerf *tls;
+    unsigned words;
+    unsigned items;
+    void operator()() {
+      Utcb &utcb = *BaseProgram::myutcb();
+      utcb.add_frame() << TYPE_PING;
+      utcb.head.untyped = words;
+      for (unsigned i = 0; i < items; i++) utcb << Utcb::TypedIdentifyCap(Crd(tls->_sm, 0, DESC_CAP_ALL));
+      unsigned res = ParentProtocol::call(utcb, tls->_pt, true, false);
+      assert(res == ENONE);
+    }
+  };
+
+  struct SemPing {
+    Client *client;
+    KernelSemaphore &done;
+    void operator()() { client->partner.up(); done.down(); }
+  };
+
+  struct TimerTime {
+    TimerProtocol *timer;
+    void operator()() { timevalue wall, ts; timer->time(*BaseProgram::myutcb(), wall, ts); }
+  };
+
+  /**
+   * A client thread. It either serves the semaphore ping-pong or calls
+   * the timer service for a round of measurements.
+   */
+  static void client(IpcPerf *tls, Utcb *utcb) __attribute__((regparm(0), noreturn))
+  {
+    Client *c = tls->_clients[tls->_nclients];
+    tls->_done.up();
+    while (1) {
+      c->start.down();
+      if (c->pingpong)
+        for (unsigned i = 0; i < tries + 1; i++) {
+          c->partner.down();
+          tls->_done.up();
+        }
+      else {
+        TimerTime func = { tls->_timer };
+        measure(c->samples, func);
+        tls->_done.up();
+      }
+    }
+  }
+
+  void create_clients(Utcb *utcb, Hip *hip, AdmissionProtocol &admission)
+  {
+    unsigned exc[Config::MAX_CPUS];
+    AdmissionProtocol::sched sched(AdmissionProtocol::sched::TYPE_APERIODIC);
+
+    for (unsigned cpu = 0; cpu < hip->cpu_desc_count() && cpu < Config::MAX_CPUS; cpu++) {
+      exc[cpu] = 0;
+      if (!hip->cpus()[cpu].enabled()) continue;
+      unsigned exc_ec = create_ec4pt(this, cpu, 0);
+      WVPASS(exc_ec);
+      exc[cpu] = alloc_cap(32);
+      WVNOVA(nova_create_pt(exc[cpu] + 30, exc_ec, reinterpret_cast<unsigned long>(startup), MTD_RSP | MTD_RIP_LEN));
+    }
+
+    // round robin over the CPUs, the first client shares our CPU
+    unsigned cpu = utcb->head.nul_cpunr;
+    for (_nclients = 0; _nclients < max_clients; ) {
+      Client *c = new Client;
+      c->start   = KernelSemaphore(alloc_cap(), true);
+      c->partner = KernelSemaphore(alloc_cap(), true);
+      _clients[_nclients] = c;
+
+      Utcb *u;
+      cap_sel ec = create_ec_helper(this, cpu, exc[cpu], &u, reinterpret_cast<void *>(&client));
+      WVPASS(ec);
+      WVNUL(admission.alloc_sc(*utcb, ec, sched, cpu, "ipcperf"));
+      _done.down();
+      _nclients++;
+
+      do cpu = (cpu + 1) % hip->cpu_desc_count(); while (!exc[cpu]);
+    }
+  }
+
+  void payload()
+  {
+    static unsigned const words[] = { 1, 16, 64, 256, 448 };
+    static unsigned const items[] = { 0, 1, 4, 16 };
+    char name[32];
+
+    for (unsigned i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+      Ping ping = { this, words[i], 0 };
+      Vprintf::snprintf(name, sizeof(name), "portal_words%u", words[i]);
+      bench(name, ping);
+    }
+    for (unsigned i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+      Ping ping = { this, 1, items[i] };
+      Vprintf::snprintf(name, sizeof(name), "portal_items%u", items[i]);
+      bench(name, ping);
+    }
+  }
+
+  /**
+   * Semaphore round-trip to the first client (same CPU) and to the
+   * second client (next CPU, if there is one).
+   */
+  void semaphores(Hip *hip)
+  {
+    for (unsigned i = 0; i < 2 && i < _nclients; i++) {
+      if (i && hip->cpu_count() < 2) break;
+      Client *c = _clients[i];
+      SemPing ping = { c, _done };
+      c->pingpong = true;
+      c->start.up();
+      bench(i ? "sem_cross_cpu" : "sem_same_cpu", ping);
+      c->pingpong = false;
+    }
+  }
+
+  struct ParentOpen {
+    unsigned cap;
+    void operator()() {
+      Utcb &utcb = *BaseProgram::myutcb();
+      unsigned res = ParentProtocol::get_pseudonym(utcb, "timer", 0, cap);
+      assert(res == ENONE);
+      ParentProtocol::release_pseudonym(utcb, cap);
+      nova_revoke(Crd(cap, 0, DESC_CAP_ALL), true);
+    }
+  };
+
+  struct LogFlush {
+    LogProtocol *log;
+    void operator()() { log->flush(*BaseProgram::myutcb()); }
+  };
+
+  struct DiskCount {
+    DiskProtocol *disk;
+    void operator()() { unsigned count; disk->get_disk_count(*BaseProgram::myutcb(), count); }
+  };
+
+  struct FsInfo {
+    FsProtocol::File *file;
+    void operator()() { FsProtocol::dirent info; file->get_info(*BaseProgram::myutcb(), info); }
+  };
+
+  struct AdmissionName {
+    AdmissionProtocol *admission;
+    void operator()() { admission->set_name(*BaseProgram::myutcb(), "ipcperf"); }
+  };
+
+  struct TimerSingle {
+    TimerProtocol *timer;
+    timevalue      abstime;
+    void operator()() { for (unsigned i = 0; i < BATCH; i++) timer->timer(*BaseProgram::myutcb(), abstime); }
+  };
+
+  struct TimerBatch {
+    TimerProtocol *timer;
+    timevalue      abstime;
+    void operator()() {
+      TimerProtocol::Batch batch(*timer, *BaseProgram::myutcb());
+      for (unsigned i = 0; i < BATCH; i++) timer->timer(batch, abstime);
+      unsigned res = batch.call();
+      assert(!res && !batch.result(BATCH - 1));
+    }
+  };
+
+  void services(Utcb *utcb, Hip *hip, AdmissionProtocol &admission)
+  {
+    ParentOpen parent = { alloc_cap() };
+    bench("parent_open_close", parent);
+
+    LogFlush log = { _console_data.log };
+    bench("log_flush", log);
+
+    TimerTime timer = { _timer };
+    bench("timer_time", timer);
+
+    // far in the future, so that the timer does not fire
+    timevalue abstime = Cpu::rdtsc() + 3600ull * hip->freq_tsc * 1000;
+    TimerSingle single = { _timer, abstime };
+    bench("timer_32_single", single);
+    TimerBatch batch = { _timer, abstime };
+    bench("timer_32_batch", batch);
+
+    DiskProtocol *disk = new DiskProtocol(this, 0);
+    unsigned count;
+    WVNUL(disk->get_disk_count(*utcb, count));
+    DiskCount diskcount = { disk };
+    bench("disk_count", diskcount);
+
+    FsProtocol *fs = new FsProtocol(alloc_cap(FsProtocol::CAP_SERVER_PT + hip->cpu_desc_count()), "fs/rom");
+    FsProtocol::File *file = new FsProtocol::File(*fs, alloc_cap());
+    WVNUL(fs->get(*utcb, *file, "bin/apps/ipcperf.nul"));
+    FsProtocol::dirent info;
+    WVNUL(file->get_info(*utcb, info));
+    FsInfo fsinfo = { file };
+    bench("fs_info", fsinfo);
+
+    AdmissionName name = { &admission };
+    bench("admission_set_name", name);
+  }
+
+  /**
+   * All clients call the timer service at the same time.
+   */
+  void concurrent()
+  {
+    for (unsigned n = 1; n <= _nclients; n *= 2) {
+      for (unsigned i = 0; i < n; i++) _clients[i]->start.up();
+      for (unsigned i = 0; i < n; i++) _done.down();
+
+      _samples.count = 0;
+      for (unsigned i = 0; i < n; i++) {
+        Samples &s = _clients[i]->samples;
+        memcpy(_samples.value + _samples.count, s.value, s.count * sizeof(s.value[0]));
+        _samples.count += s.count;
+      }
+      char name[32];
+      Vprintf::snprintf(name, sizeof(name), "timer_time_clients%u", n);
+      report(name, _samples);
+    }
+  }
+
+  void wvrun(Utcb *utcb, Hip *hip)
+  {
+    Motherboard *mb = new Motherboard(new Clock(hip->freq_tsc*1000), hip);
+    mb->parse_args(reinterpret_cast<const char *>(hip->get_mod(0)->aux));
+
+    Utcb *utcb_worker;
+    unsigned ec = create_ec4pt(this, utcb->head.nul_cpunr, alloc_cap(16), &utcb_worker, alloc_cap());
+    WVPASS(ec);
+    utcb_worker->head.crd = alloc_crd();
+    utcb_worker->head.crd_translate = Crd(0, 31, DESC_CAP_ALL).value();
+    _pt = alloc_cap();
+    WVNOVA(nova_create_pt(_pt, ec, reinterpret_cast<unsigned long>(StaticPortalFunc<IpcPerf>::portal_func), 0));
+    WVNOVA(nova_create_sm(_sm = alloc_cap()));
+
+    _done  = KernelSemaphore(alloc_cap(), true);
+    _timer = new TimerProtocol(alloc_cap_region(TimerProtocol::CAP_SERVER_PT + hip->cpu_desc_count(), 0));
+    AdmissionProtocol admission(alloc_cap(AdmissionProtocol::CAP_SERVER_PT + hip->cpu_desc_count()));
+    WVNUL(admission.set_name(*utcb, "ipcperf"));
+
+    payload();
+    create_clients(utcb, hip, admission);
+    semaphores(hip);
+    services(utcb, hip, admission);
+    concurrent();
+  }
+};
+
+ASMFUNCS(IpcPerf, WvTest)
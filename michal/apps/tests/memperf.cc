@@ -0,0 +1,108 @@
+/**
+ * @file
+ * memcpy/memset/memcmp microbenchmark
+ *
+ * Checks the runtime memory functions against byte loops and sweeps
+ * sizes and alignments. The largest sizes use the non-temporal path.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <wvprogram.h>
+
+class MemPerf : public WvProgram
+{
+  enum {
+    MAXSIZE = 1 << 20,
+    BUFSIZE = MAXSIZE + 64,
+    BYTES   = 1 << 22,
+  };
+
+  char *_src;
+  char *_dst;
+
+  unsigned check()
+  {
+    static unsigned const sizes[] = { 0, 1, 3, 4, 15, 127, 128, 129, 4097, MAXSIZE - 1, MAXSIZE, MAXSIZE + 1 };
+    unsigned errors = 0;
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+      for (unsigned align = 0; align < 4; align++) {
+        unsigned size = sizes[i];
+        // keep a guard byte in front of dst
+        char *dst = _dst + 1 + align;
+        char *src = _src + 3 - align;
+
+        memset(_dst, 0x55, BUFSIZE);
+        memcpy(dst, src, size);
+        for (unsigned j = 0; j < size; j++) errors += dst[j] != src[j];
+        errors += dst[-1] != 0x55 || dst[size] != 0x55;
+        errors += memcmp(dst, src, size) != 0;
+        if (size) {
+          dst[size - 1] ^= 1;
+          errors += memcmp(dst, src, size) == 0;
+        }
+
+        memset(dst, align, size);
+        for (unsigned j = 0; j < size; j++) errors += dst[j] != static_cast<char>(align);
+        errors += dst[-1] != 0x55 || dst[size] != 0x55;
+      }
+    return errors;
+  }
+
+  void perf(char const *name, unsigned size, unsigned align, uint64 cycles)
+  {
+    char text[40];
+    Vprintf::snprintf(text, sizeof(text), "PERF: %s_%u_align%u", name, size, align);
+    WvTest t(__FILE__, __LINE__, text);
+    t.check_perf(cycles, "cycles");
+  }
+
+  void sweep()
+  {
+    static unsigned const sizes[] = { 16, 64, 256, 1024, 4096, 65536, MAXSIZE };
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+      for (unsigned align = 0; align < 4; align += 3) {
+        unsigned size = sizes[i];
+        unsigned rounds = BYTES / size;
+        char *dst = _dst + align;
+        uint64 tic;
+
+        tic = Cpu::rdtsc();
+        for (unsigned r = 0; r < rounds; r++) memcpy(dst, _src, size);
+        perf("memcpy", size, align, Math::muldiv128(Cpu::rdtsc() - tic, 1, rounds));
+
+        tic = Cpu::rdtsc();
+        for (unsigned r = 0; r < rounds; r++) memset(dst, r, size);
+        perf("memset", size, align, Math::muldiv128(Cpu::rdtsc() - tic, 1, rounds));
+
+        memcpy(dst, _src, size);
+        tic = Cpu::rdtsc();
+        for (unsigned r = 0; r < rounds; r++) memcmp(dst, _src, size);
+        perf("memcmp", size, align, Math::muldiv128(Cpu::rdtsc() - tic, 1, rounds));
+      }
+  }
+
+public:
+  void wvrun(Utcb *utcb, Hip *hip)
+  {
+    WVPASS(_src = new char[BUFSIZE]);
+    WVPASS(_dst = new char[BUFSIZE]);
+    for (unsigned i = 0; i < BUFSIZE; i++) _src[i] = i * 7 + (i >> 8);
+
+    WVPASSEQ(check(), 0u);
+    sweep();
+  }
+};
+
+ASMFUNCS(MemPerf, WvTest)
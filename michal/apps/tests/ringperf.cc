@@ -0,0 +1,96 @@
+/**
+ * @file
+ * Producer/consumer microbenchmark
+ *
+ * Compares the single producer ring, which ups the semaphore for
+ * every item, with the multi-producer ring that notifies a sleeping
+ * consumer once per burst.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of NUL (NOVA user land).
+ *
+ * NUL is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * NUL is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <wvprogram.h>
+#include <sigma0/consumer.h>
+
+class RingPerf : public WvProgram
+{
+  enum {
+    SIZE   = 64,
+    BURST  = 32,
+    ROUNDS = 1000,
+  };
+
+  uint64 legacy()
+  {
+    KernelSemaphore sem(alloc_cap(), true);
+    Consumer<unsigned, SIZE> *consumer = new Consumer<unsigned, SIZE>();
+    Producer<unsigned, SIZE> producer(consumer, sem.sm());
+    uint64 cycles = 0;
+    unsigned count = 0;
+
+    for (unsigned r = 0; r < ROUNDS; r++) {
+      uint64 tic = Cpu::rdtsc();
+      for (unsigned i = 0; i < BURST; i++)
+        producer.produce(i);
+      sem.downmulti();
+      while (consumer->has_data()) {
+        consumer->free_buffer();
+        count++;
+      }
+      cycles += Cpu::rdtsc() - tic;
+    }
+    WVPASSEQ(count, static_cast<unsigned>(ROUNDS * BURST));
+    return Math::muldiv128(cycles, 1, ROUNDS * BURST);
+  }
+
+  uint64 ring()
+  {
+    typedef RingConsumer<unsigned, SIZE> Ring;
+    KernelSemaphore sem(alloc_cap(), true);
+    Ring *consumer = new Ring();
+    RingProducer<unsigned, SIZE> producer(consumer, sem.sm());
+    unsigned items[BURST], out[BURST];
+    uint64 cycles = 0;
+    unsigned count = 0, errors = 0;
+
+    for (unsigned i = 0; i < BURST; i++) items[i] = i;
+    for (unsigned r = 0; r < ROUNDS; r++) {
+      uint64 tic = Cpu::rdtsc();
+      // The consumer went to sleep in wait() before the burst.
+      Cpu::xchg(&consumer->_notify, static_cast<unsigned>(Ring::NOTIFY_ASLEEP));
+      producer.produce(items, BURST);
+      sem.downmulti();
+      unsigned n = consumer->consume(out, BURST);
+      cycles += Cpu::rdtsc() - tic;
+
+      for (unsigned i = 0; i < n; i++)
+        if (out[i] != i) errors++;
+      count += n;
+    }
+    WVPASSEQ(count, static_cast<unsigned>(ROUNDS * BURST));
+    WVPASSEQ(errors, 0u);
+    return Math::muldiv128(cycles, 1, ROUNDS * BURST);
+  }
+
+public:
+  void wvrun(Utcb *utcb, Hip *hip)
+  {
+    uint64 per_item_single = legacy();
+    WVPERF(per_item_single, "cycles");
+    uint64 per_item_ring = ring();
+    WVPERF(per_item_ring, "cycles");
+  }
+};
+
+ASMFUNCS(RingPerf, WvTest)
@@ -38,6 +38,21 @@ protected:
 
   mword get_portal_func_addr() { return reinterpret_cast<mword>(StaticPortalFunc<A>::portal_func); }
 
+  /// Executes the requests of a batch within a single session.
+  struct BatchRequest {
+    BaseSService * service;
+    Session *      session;
+    Utcb &         utcb;
+    bool &         free_cap;
+    unsigned operator()(Utcb::Frame &request) {
+      unsigned op;
+      check1(EPROTO, request.get_word(op));
+      return service->handle_request(session, op, request, utcb, free_cap);
+    }
+    BatchRequest(BaseSService *_service, Session *_session, Utcb &_utcb, bool &_free_cap)
+      : service(_service), session(_session), utcb(_utcb), free_cap(_free_cap) {}
+  };
+
 public:
 
   // I don't like this CAP (de)alloc stuff here, but it is currently
@@ -159,6 +174,10 @@ public:
       // Logging::printf("Cannot get client (id=0x%x) session: 0x%x\n", pid, res);
       return res;
     }
+    if (op == ParentProtocol::TYPE_BATCH) {
+      BatchRequest func(this, session, utcb, free_cap);
+      return handle_batch(utcb, input, func);
+    }
     return handle_request(session, op, input, utcb, free_cap);
   }
 
@@ -17,6 +17,8 @@ public:
 
     // Connect to the trace buffer
     _console_data.log = new LogProtocol(alloc_cap(LogProtocol::CAP_SERVER_PT + hip->cpu_count()));
+    unsigned long logring = _free_virt.alloc(LogRing::SIZE, LogRing::ORDER);
+    if (logring) _console_data.log->attach(*utcb, reinterpret_cast<void *>(logring));
 
     //Logging::printf("\nTesting \"%s\" in %s:\n", descr, file);
   }
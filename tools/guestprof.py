@@ -0,0 +1,80 @@
+#!/usr/bin/env python2
+"""Turn the guest profile samples (LCTRL-F3) of a serial log into a flat profile.
+
+Usage: guestprof.py [--elf file[@cr3]]... [--vcpu n] [--cpl n] [--top n] [logfile]
+
+Samples are symbolized against the given ELF files. An ELF file with a
+CR3 only matches samples of that address space, which is useful for
+user-level programs. Samples without a symbol are shown by address.
+"""
+
+from __future__ import print_function
+import sys, bisect, getopt, subprocess
+
+def samples(lines, vcpu, cpl):
+    "Yield (cpl, cr3, rip, count) of all exports in the log"
+    for line in lines:
+        pos = line.find("gp: ")
+        if pos < 0: continue
+        token = line[pos + 4:].split()
+        if len(token) != 5 or token[0] in ("begin", "end"): continue
+        nr, level, cr3, rip, count = int(token[0]), int(token[1]), int(token[2], 16), int(token[3], 16), int(token[4])
+        if vcpu is not None and nr != vcpu: continue
+        if cpl is not None and level != cpl: continue
+        yield level, cr3, rip, count
+
+class Symbols:
+    "The function symbols of an ELF file, optionally bound to a CR3"
+    def __init__(self, spec):
+        self.name, _, cr3 = spec.partition("@")
+        self.cr3 = int(cr3, 16) if cr3 else None
+        out = subprocess.check_output(["nm", "-n", "-S", "--defined-only", self.name]).decode("latin-1")
+        self.syms = []
+        for line in out.splitlines():
+            parts = line.split()
+            if len(parts) == 4 and parts[2] in "tTwW":
+                self.syms.append((int(parts[0], 16), int(parts[1], 16), parts[3]))
+            elif len(parts) == 3 and parts[1] in "tTwW":
+                self.syms.append((int(parts[0], 16), 0, parts[2]))
+        self.addrs = [s[0] for s in self.syms]
+
+    def lookup(self, cr3, rip):
+        if self.cr3 is not None and self.cr3 != cr3: return None
+        i = bisect.bisect_right(self.addrs, rip) - 1
+        if i < 0: return None
+        start, size, name = self.syms[i]
+        if size and rip >= start + size: return None
+        if not size and i + 1 == len(self.syms): return None
+        return name
+
+def main(argv):
+    opts, args = getopt.getopt(argv, "", ["elf=", "vcpu=", "cpl=", "top="])
+    elfs = [Symbols(v) for k, v in opts if k == "--elf"]
+    opts = dict(opts)
+    vcpu = int(opts["--vcpu"]) if "--vcpu" in opts else None
+    cpl  = int(opts["--cpl"]) if "--cpl" in opts else None
+    top  = int(opts.get("--top", 30))
+
+    # ELF files with a CR3 take precedence
+    elfs.sort(key=lambda e: e.cr3 is None)
+    profile, total = {}, 0
+    lines = open(args[0]) if args else sys.stdin
+    for level, cr3, rip, count in samples(lines, vcpu, cpl):
+        name = None
+        for elf in elfs:
+            name = elf.lookup(cr3, rip)
+            if name: break
+        if not name: name = "cpl%d %08x:%08x" % (level, cr3, rip)
+        profile[name] = profile.get(name, 0) + count
+        total += count
+
+    print("%7s %8s  %s" % ("%", "samples", "symbol"))
+    for name, count in sorted(profile.items(), key=lambda x: -x[1])[:top]:
+        print("%6.2f%% %8d  %s" % (100.0 * count / total, count, name))
+
+if __name__ == "__main__":
+    try:
+        main(sys.argv[1:])
+    except (getopt.GetoptError, ValueError, OSError, subprocess.CalledProcessError) as e:
+        print("%s\n%s" % (e, __doc__), file=sys.stderr)
+        sys.exit(1)
@@ -0,0 +1,66 @@
+#!/usr/bin/env python2
+"""Decode a tracebuffer export (LCTRL-F6) from a serial log.
+
+Usage: tbdecode.py [--guid n] [--level n] [--from ms] [--to ms] [logfile]
+"""
+
+from __future__ import print_function
+import sys, struct, base64, getopt
+
+RECORD = struct.Struct("<IHBBiQ")
+
+def exports(lines):
+    "Yield the binary data of all exports in the log"
+    data = None
+    for line in lines:
+        pos = line.find("tb: ")
+        if pos < 0: continue
+        token = line[pos + 4:].strip()
+        if token == "begin export":
+            data = []
+        elif token == "end export":
+            if data is not None:
+                yield base64.b64decode("".join(data))
+            data = None
+        elif data is not None:
+            data.append(token)
+
+def records(blob):
+    "Parse an export into (tsc, cpu, level, guid, text) tuples"
+    if blob[:4] != b"NTB1":
+        raise ValueError("not a tracebuffer export")
+    freq = struct.unpack("<I", blob[4:8])[0]
+    pos, res = 8, []
+    while pos + RECORD.size <= len(blob):
+        size, length, level, cpu, guid, tsc = RECORD.unpack_from(blob, pos)
+        if size < RECORD.size + length: break
+        text = blob[pos + RECORD.size:pos + RECORD.size + length]
+        res.append((tsc, cpu, level, guid, text.decode("latin-1")))
+        pos += size
+    return freq, res
+
+def main(argv):
+    opts, args = getopt.getopt(argv, "", ["guid=", "level=", "from=", "to="])
+    opts = dict(opts)
+    guid  = int(opts["--guid"]) if "--guid" in opts else None
+    level = int(opts.get("--level", 7))
+    start = float(opts.get("--from", 0))
+    end   = float(opts["--to"]) if "--to" in opts else None
+
+    lines = open(args[0]) if args else sys.stdin
+    for blob in exports(lines):
+        freq, recs = records(blob)
+        if not recs: continue
+        base = recs[0][0]
+        for tsc, cpu, lvl, g, text in recs:
+            ms = (tsc - base) / float(freq)
+            if lvl > level or (guid is not None and g != guid): continue
+            if ms < start or (end is not None and ms > end): continue
+            print("[%10.3f] %d (%d) <%d> %s" % (ms, cpu, g, lvl, text))
+
+if __name__ == "__main__":
+    try:
+        main(sys.argv[1:])
+    except (getopt.GetoptError, ValueError) as e:
+        print("%s\n%s" % (e, __doc__), file=sys.stderr)
+        sys.exit(1)
@@ -58,10 +58,16 @@ unsigned       _shared_sem[256];
 unsigned       _keyboard_modifier = KBFLAG_RWIN;
 bool           _dpci;
 unsigned       _ncpu=1;
+bool           _kvmclock = false;
+bool           _lazymap = false;
 bool           _tsc_offset = false;
 bool           _rdtsc_exit;
 bool           _service_events = false;
 bool           _donor_net = false;
+bool           _exitprofile;
+unsigned       _exitprofile_period;
+unsigned       _guestprofile_period;
+unsigned       _guestprofile_entries;
 unsigned long  _original_physsize;
 timevalue      _last_to = ~0ULL;
 
@@ -93,17 +99,34 @@ PARAM_ALIAS(PC_PS2, "an alias to create an PS2 compatible PC",
 	     " vbios_disk vbios_keyboard vbios_mem vbios_time vbios_reset vbios_multiboot"
 	     " msi ioapic pcihostbridge:0,0x10,0xcf8,0xe0000000 pmtimer:0x8000 vcpus")
 PARAM_HANDLER(ncpu, "ncpu - change the number of vcpus that are created" ) {_ncpu = argv[0];}
+PARAM_HANDLER(kvmclock, "kvmclock - give the vcpus created with 'vcpus' a paravirtual clock") {_kvmclock = true;}
 PARAM_HANDLER(vcpus,
 	      " vcpus - instantiate the vcpus defined with 'ncpu'")
 {
   for (unsigned count = 0; count < _ncpu; count++)
-    mb.parse_args("vcpu halifax vbios lapic");
+    mb.parse_args(_kvmclock ? "vcpu halifax vbios pvclock lapic" : "vcpu halifax vbios lapic");
 }
 
+PARAM_HANDLER(lazymap, "lazymap - map guest memory on EPT faults only instead of at startup, e.g. for overcommitted VMs") { _lazymap = true; }
 PARAM_HANDLER(tsc_offset, "Enable TSC offsetting.")        { _tsc_offset = true; }
 PARAM_HANDLER(rdtsc_exit, "Enable RDTSC exits.")           { _rdtsc_exit = true; }
 PARAM_HANDLER(service_events, "Enable generating events.") { _service_events = true; }
 PARAM_HANDLER(donor_net, "Enable network service to VM via cpuid/vmcall") {_donor_net = true; }
+PARAM_HANDLER(exitprofile,
+	      "exitprofile:period - profile the VM exits per VCPU, exit reason, I/O port and MMIO page.",
+	      "LCTRL-RWIN-LWIN-F2 prints the profile, CPUID 0x40000023 prints it as PERF lines and resets it.",
+	      "With a period in milliseconds, the exit rate of every VCPU is printed as PERF line.")
+{
+  _exitprofile = true;
+  _exitprofile_period = argv[0] == ~0UL ? 0 : argv[0];
+}
+PARAM_HANDLER(guestprofile,
+	      "guestprofile:period=1000,entries=4096 - sample RIP, CR3 and CPL of each VCPU every period microseconds.",
+	      "LCTRL-RWIN-LWIN-F3 or CPUID 0x40000024 print the samples, see tools/guestprof.py.")
+{
+  _guestprofile_period  = argv[0] == ~0UL ? 1000 : argv[0];
+  _guestprofile_entries = argv[1] == ~0UL ? 4096 : argv[1];
+}
 
 /****************************************************/
 /* Vancouver class                                  */
@@ -122,13 +145,15 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
   static EventsProtocol    * service_events;
   static DiskProtocol      * service_disk;
   FsProtocol *fs_obj;
+  unsigned    _guestprofile_timer;
+  unsigned    _exitprofile_timer;
   char fs_name[32], fs_tmp[32];
   #define VANCOUVER_CONFIG_SEPARATOR "||"
 
 #define PT_FUNC(NAME)  static void  NAME(unsigned pid, Vancouver *tls, Utcb *utcb) __attribute__((regparm(1)))
 #define VM_FUNC(NR, NAME, INPUT, CODE)					             \
   static void  NAME(unsigned pid, VCpu *tls, Utcb *utcb) __attribute__((regparm(1))) \
-  {  CODE;								\
+  {  { ExitProfile::Sample sample(tls, NR, #NAME); CODE; }		\
     asmlinkage_protect("g"(tls), "g"(utcb));				\
   }
   #include "vancouver.cc"
@@ -193,7 +218,7 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
     Sigma0Base::request_stdin(utcb, stdinconsumer, sem->sm());
 
     while (1) {
-      sem->downmulti();
+      stdinconsumer->wait(*sem);
       while (stdinconsumer->has_data()) {
       MessageInput *msg = stdinconsumer->get_buffer();
       switch ((msg->data & ~KBFLAG_NUM) ^ _keyboard_modifier)
@@ -226,6 +251,21 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
 	case KBFLAG_LCTRL | KBFLAG_RWIN |  KBFLAG_LWIN | 0x5:
 	  _mb->dump_counters();
 	  break;
+	case KBFLAG_LCTRL | KBFLAG_RWIN |  KBFLAG_LWIN | 0x6:
+	  ExitProfile::dump();
+	  if (service_events)
+	    for (ExitProfile *p = ExitProfile::list; p; p = p->next) {
+	      struct { unsigned vcpu; unsigned long exits; unsigned long long cycles; } summary = { p->nr, 0, 0 };
+	      p->summary(summary.exits, summary.cycles);
+	      service_events->send_event(*utcb, EventsProtocol::EVENT_EXIT_PROFILE, sizeof(summary), &summary);
+	    }
+	  break;
+	case KBFLAG_LCTRL | KBFLAG_RWIN |  KBFLAG_LWIN | 0x4:
+	  {
+	    SemaphoreGuard l(_lock);
+	    GuestProfile::dump();
+	  }
+	  break;
 	default:
 	  break;
 	}
@@ -336,6 +376,25 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
     if (_service_events)
       service_events = new EventsProtocol(alloc_cap(EventsProtocol::CAP_SERVER_PT + hip->cpu_desc_count()));
 
+    if (_guestprofile_period || _exitprofile_period)
+      _mb->bus_timeout.add(this, receive_static<MessageTimeout>);
+
+    if (_guestprofile_period) {
+      MessageTimer msg;
+      if (!_mb->bus_timer.send(msg)) Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
+      _guestprofile_timer = msg.nr;
+      MessageTimer msg2(_guestprofile_timer, _mb->clock()->abstime(_guestprofile_period, 1000000));
+      _mb->bus_timer.send(msg2);
+    }
+
+    if (_exitprofile_period) {
+      MessageTimer msg;
+      if (!_mb->bus_timer.send(msg)) Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
+      _exitprofile_timer = msg.nr;
+      MessageTimer msg2(_exitprofile_timer, _mb->clock()->abstime(_exitprofile_period, 1000));
+      _mb->bus_timer.send(msg2);
+    }
+
     _mb->bus_hwioin.debug_dump();
   }
 
@@ -364,6 +423,8 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
   {
     _lock = Semaphore(alloc_cap());
     check1(1, nova_create_sm(_lock.sm()));
+    static LockProfile lock_profile("vmm");
+    _lock.profile(&lock_profile);
 
     _pt_irq = alloc_cap(Config::EXC_PORTALS);
 
@@ -381,6 +442,8 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
 
   unsigned create_vcpu(VCpu *vcpu, bool use_svm, unsigned cpunr)
   {
+    if (_exitprofile) new ExitProfile(vcpu);
+
     // create worker
     unsigned cap_worker = create_ec4pt(vcpu, cpunr,
                                        //Config::EXC_PORTALS*cpunr /* Use s0 exception portals */
@@ -400,7 +463,10 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
     unsigned cap_start = alloc_cap(0x100);
     for (unsigned i=0; i < sizeof(vm_caps)/sizeof(vm_caps[0]); i++) {
       if (use_svm == (vm_caps[i].nr < PT_SVM)) continue;
-      check1(0, nova_create_pt(cap_start + (vm_caps[i].nr & 0xff), cap_worker, reinterpret_cast<unsigned long>(vm_caps[i].func), vm_caps[i].mtd));
+      unsigned mtd = vm_caps[i].mtd;
+      // the guest profile samples during recalls
+      if (_guestprofile_period && (vm_caps[i].nr & 0xff) == 0xff) mtd |= MTD_RIP_LEN | MTD_CR | MTD_CS_SS;
+      check1(0, nova_create_pt(cap_start + (vm_caps[i].nr & 0xff), cap_worker, reinterpret_cast<unsigned long>(vm_caps[i].func), mtd));
     }
 
     Logging::printf("\tcreate VCPU\n");
@@ -412,6 +478,7 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
     AdmissionProtocol::sched sched; //Qpd(1, 10000)
     if (service_admission->alloc_sc(*myutcb(), cap_block + 1, sched, cpunr, "vcpu"))
       Logging::panic("creating a VCPU failed - admission test issue");
+    if (_guestprofile_period) new GuestProfile(vcpu, cap_block + 1, _guestprofile_entries);
     return cap_block;
   }
 
@@ -435,6 +502,7 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
   static void handle_io(VCpu *vcpu, Utcb *utcb, bool is_in, unsigned io_order, unsigned port) {
 
     assert(vcpu);
+    ExitProfile::detail(vcpu, ExitProfile::KIND_IO, port);
     CpuMessage msg(is_in, static_cast<CpuState *>(utcb), io_order, port, &utcb->eax, utcb->mtd);
     skip_instruction(msg);
     {
@@ -490,7 +558,6 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
 
     MessageMemRegion msg(utcb->qual[1] >> 12);
 
-    // XXX use a push model on _startup instead
     // do we have not mapped physram yet?
     if (_mb->bus_memregion.send(msg, true) && msg.ptr) {
 
@@ -515,6 +582,32 @@ class Vancouver : public NovaProgram, public ProgramConsole, public StaticReceiv
     return false;
   }
 
+  /**
+   * Push as much guest RAM as fits into the reply of a startup
+   * exit, using the largest naturally aligned mappings.  Further
+   * VCPUs continue where we stopped and whatever is left is mapped on
+   * EPT violations.
+   */
+  static void map_memory_eager(Utcb *utcb)
+  {
+    enum { MAX_ITEMS = 128 };
+    static unsigned long page;
+
+    if (_lazymap) return;
+    SemaphoreGuard l(_lock);
+    while (page < (_original_physsize >> 12)) {
+      MessageMemRegion msg(page);
+      if (!_mb->bus_memregion.send(msg, true) || !msg.ptr) { page++; continue; }
+
+      Crd own = request_mapping(msg.ptr, msg.count << 12, (page - msg.start_page) << 12);
+      unsigned long guest = (msg.start_page << 12) + (own.base() - reinterpret_cast<unsigned long>(msg.ptr));
+      unsigned long left = utcb->add_mappings(own.base(), own.size(), guest | MAP_EPT | (_dpci ? MAP_DPT : 0), own.attr(), false, MAX_ITEMS);
+      page = (guest + own.size() - left) >> 12;
+      if (left) break;
+    }
+    COUNTER_SET("eager map", page);
+  }
+
   static struct donor_buffer * translate_donor_vmm(unsigned cr3, unsigned ptr) {
     check1(0, ptr & 0x3fffffU, "invalid pointer from donor %#x", ptr);
     check1(0, _original_physsize < (cr3|0xfff), "invalid cr3 from donor %#x", cr3);
@@ -611,6 +704,15 @@ public:
         msg.cpu->ecx = _hip->freq_tsc;
       }
       break;
+    case 0x40000023:
+      // exit profile leaf
+      ExitProfile::dump(true);
+      ExitProfile::reset_all();
+      break;
+    case 0x40000024:
+      // guest profile leaf
+      GuestProfile::dump();
+      break;
 
     default:
       /*
@@ -766,9 +868,9 @@ public:
         msg.vcpu->executor.add(this, receive_static<CpuMessage>);
         break;
       case MessageHostOp::OP_VCPU_BLOCK:
-        _lock.up();
+        _lock.unlock();
         res = NOVA_ESUCCESS == nova_semdown(msg.value);
-        _lock.down();
+        _lock.lock();
         break;
       case MessageHostOp::OP_VCPU_RELEASE:
         if (msg.len) { res = NOVA_ESUCCESS == nova_semup(msg.value); if (!res) Logging::printf("vcpu release: semup failed\n");}
@@ -808,7 +910,7 @@ public:
     service_disk = new DiskProtocol(this, 0);
     assert(service_disk);
     KernelSemaphore *sem = new KernelSemaphore(alloc_cap(), true);
-    DiskConsumer *diskconsumer = new (1<<12) DiskConsumer();
+    DiskProtocol::DiskConsumer *diskconsumer = new (1<<12) DiskProtocol::DiskConsumer();
     assert(diskconsumer);
     cap_sel tmp_portal = alloc_cap();
     check2(err, service_disk->attach(*myutcb(), reinterpret_cast<void*>(_physmem), _physsize, tmp_portal, diskconsumer, sem));
@@ -924,6 +1026,25 @@ public:
     return true;
   }
 
+  /**
+   * Print the exit rate or recall all VCPUs to take a guest profile
+   * sample.
+   */
+  bool  receive(MessageTimeout &msg) {
+    if (_exitprofile_period && msg.nr == _exitprofile_timer) {
+      ExitProfile::rate(_exitprofile_period);
+      MessageTimer msg2(_exitprofile_timer, _mb->clock()->abstime(_exitprofile_period, 1000));
+      _mb->bus_timer.send(msg2);
+      return true;
+    }
+    if (!_guestprofile_period || msg.nr != _guestprofile_timer) return false;
+    for (GuestProfile *p = GuestProfile::list; p; p = p->next)
+      if (p->request()) nova_recall(p->recall);
+    MessageTimer msg2(_guestprofile_timer, _mb->clock()->abstime(_guestprofile_period, 1000000));
+    _mb->bus_timer.send(msg2);
+    return true;
+  }
+
   bool  receive(MessageTime &msg) {
     return !service_timer->time(*myutcb(), msg.wallclocktime, msg.timestamp);
   }
@@ -946,6 +1067,8 @@ public:
     char *args = reinterpret_cast<char *>(hip->get_mod(0)->aux);
     Logging::printf("Vancouver: hip %p utcb %p args '%s'\n", hip, utcb, args);
     _console_data.log = new LogProtocol(alloc_cap(LogProtocol::CAP_SERVER_PT + hip->cpu_desc_count()));
+    unsigned long logring = _free_virt.alloc(LogRing::SIZE, LogRing::ORDER);
+    if (logring) _console_data.log->attach(*utcb, reinterpret_cast<void *>(logring));
 
     _physmem = reinterpret_cast<unsigned long>(&__freemem);
     _original_physsize = 0;
@@ -1089,13 +1212,16 @@ VM_FUNC(PT_VMX + 48,  vmx_mmio, MTD_ALL,
 	 * Idea: optimize the default case - mmio to general purpose register
 	 * Need state: GPR_ACDB, GPR_BSD, RIP_LEN, RFLAGS, CS, DS, SS, ES, RSP, CR, EFER
 	 */
-	if (!map_memory_helper(tls, utcb, utcb->qual[0] & 0x38))
+	if (!map_memory_helper(tls, utcb, utcb->qual[0] & 0x38)) {
 	  // this is an access to MMIO
+	  ExitProfile::detail(tls, ExitProfile::KIND_MMIO, utcb->qual[1] >> 12);
 	  handle_vcpu(pid, false, CpuMessage::TYPE_SINGLE_STEP, tls, utcb);
+	}
 	)
 VM_FUNC(PT_VMX + 0xfe,  vmx_startup, MTD_IRQ,
 	Logging::printf("startup\n");
 	handle_vcpu(pid, false, CpuMessage::TYPE_HLT, tls, utcb);
+	map_memory_eager(utcb);
 	utcb->mtd |= MTD_CTRL;
         utcb->ctrl[0] = 0;
 	if (_tsc_offset) utcb->ctrl[0] |= (1 << 3 /* tscoff */);
@@ -1111,6 +1237,11 @@ MTD_IRQ,
 #endif
 	COUNTER_INC("recall");
 	COUNTER_SET("REIP", utcb->eip);
+	if (GuestProfile::list) {
+	  // dump() sorts and empties the rings under the same lock
+	  SemaphoreGuard l(_lock);
+	  GuestProfile::sample(tls, utcb->eip, utcb->cr3, (utcb->ss.ar >> 5) & 3);
+	}
 	handle_vcpu(pid, false, CpuMessage::TYPE_CHECK_IRQ, tls, utcb);
 	)
 
@@ -1138,8 +1269,10 @@ VM_FUNC(PT_SVM + 0x7b,  svm_ioio,    MTD_RIP_LEN | MTD_QUAL | MTD_GPR_ACDB | MTD
 VM_FUNC(PT_SVM + 0x7c,  svm_msr,     MTD_ALL, svm_invalid(pid, tls, utcb); )
 VM_FUNC(PT_SVM + 0x7f,  svm_shutdwn, MTD_ALL, vmx_triple(pid, tls, utcb); )
 VM_FUNC(PT_SVM + 0xfc,  svm_npt,     MTD_ALL,
-	if (!map_memory_helper(tls, utcb, utcb->qual[0] & 1))
+	if (!map_memory_helper(tls, utcb, utcb->qual[0] & 1)) {
+	  ExitProfile::detail(tls, ExitProfile::KIND_MMIO, utcb->qual[1] >> 12);
 	  svm_invalid(pid, tls, utcb);
+	}
 	)
 VM_FUNC(PT_SVM + 0xfd, svm_invalid, MTD_ALL,
 	COUNTER_INC("invalid");
@@ -1148,6 +1281,6 @@ VM_FUNC(PT_SVM + 0xfd, svm_invalid, MTD_ALL,
 	utcb->ctrl[0] = 1 << 18; // cpuid
 	utcb->ctrl[1] = 1 << 0;  // vmrun
 	)
-VM_FUNC(PT_SVM + 0xfe,  svm_startup,MTD_ALL,  vmx_irqwin(pid, tls, utcb); )
+VM_FUNC(PT_SVM + 0xfe,  svm_startup,MTD_ALL,  vmx_irqwin(pid, tls, utcb); map_memory_eager(utcb); )
 VM_FUNC(PT_SVM + 0xff,  svm_recall, MTD_IRQ,  do_recall(pid, tls, utcb); )
 #endif
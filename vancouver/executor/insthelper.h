@@ -346,11 +346,60 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
     SH_DOOP_OUT = 1 << 6
   };
 
+  /**
+   * Transfer a repeated INS or OUTS to or from guest RAM with a
+   * single counted I/O message per page. Returns false, if the
+   * remaining elements have to be done one by one, e.g. because no
+   * model supports string I/O on the port or the buffer is not RAM.
+   */
+  template<unsigned operand_size>
+  bool string_io(bool in)
+  {
+    if (!(_entry->prefixes & 0xff) || _cpu->efl & 0x400) return false;
+    CpuState::Descriptor *desc = in ? &_cpu->es : (&_cpu->es) + ((_entry->prefixes >> 8) & 0xf);
+
+    // the segment checks of handle_segment() for an expand-up segment
+    if (~desc->ar & 0x80 || (desc->ar & 0xc) == 4 || (in ? (desc->ar & 0xa) != 0x2 : (desc->ar & 0xa) == 0x8)) return false;
+
+    while (1) {
+      unsigned count  = _entry->address_size == 1 ? _cpu->cx : _cpu->ecx;
+      unsigned offset = in ? _cpu->edi : _cpu->esi;
+      if (_entry->address_size == 1) {
+        offset &= 0xffff;
+        count = MIN(count, (0x10000 - offset) >> operand_size);
+      }
+      if (!count) return !(_entry->address_size == 1 ? _cpu->cx : _cpu->ecx);
+
+      unsigned len = count << operand_size;
+      if (offset + len - 1 < offset || offset + len - 1 > desc->limit) return false;
+
+      void *ptr;
+      if (prepare_virtual_ram(offset + desc->base, len, user_access(in ? TYPE_W : TYPE_R), ptr)) return true;
+      count = len >> operand_size;
+      if (!ptr || !count) return false;
+
+      CpuMessage msg(in, _cpu, operand_size, _cpu->dx, ptr, _mtr_in, count);
+      _vcpu->executor.send(msg, true);
+      if (!msg.consumed) return false;
+
+      len = count << operand_size;
+      if (_entry->address_size == 1) {
+        _cpu->cx -= count;
+        if (in) _cpu->di += len; else _cpu->si += len;
+      }
+      else {
+        _cpu->ecx -= count;
+        if (in) _cpu->edi += len; else _cpu->esi += len;
+      }
+    }
+  }
+
 #define NCHECK(X)  { if (X) break; }
 #define FEATURE(X,Y) { if (feature & (X)) Y; }
   template<unsigned feature, unsigned operand_size>
   int __attribute__((regparm(3)))  string_helper()
   {
+    if (feature & (SH_DOOP_IN | SH_DOOP_OUT) && string_io<operand_size>(feature & SH_DOOP_IN)) return _fault;
     while (_entry->address_size == 1 && _cpu->cx || _entry->address_size == 2 && _cpu->ecx || !(_entry->prefixes & 0xff))
       {
 	void *src = &_cpu->eax;
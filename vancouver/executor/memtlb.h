@@ -207,5 +207,23 @@ protected:
   }
 
 
+  /**
+   * Translate an access of up to len bytes to guest RAM. The length
+   * is cut at the end of the page. The pointer is zero, if the page
+   * is not RAM.
+   */
+  int prepare_virtual_ram(unsigned virt, unsigned &len, Type type, void *&ptr)
+  {
+    unsigned long phys;
+    ptr = 0;
+    if (len > 0x1000 - (virt & 0xfff)) len = 0x1000 - (virt & 0xfff);
+    if (virt_to_phys(virt, type, phys)) return _fault;
+
+    MessageMemRegion msg(phys >> 12);
+    if (_memregion.send(msg, true) && msg.ptr) ptr = msg.ptr + (phys - (msg.start_page << 12));
+    return _fault;
+  }
+
+
   MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion) {}
 };
@@ -69,8 +69,11 @@ public:
     // XXX bug in 2.6.27?
     //if (!_need_initial_fis && ~PxCMD & 0x10) { Logging::printf("skip FIS %x\n", fis[0]); return; }
 
-    // update status and error fields
-    PxTFD = (PxTFD & 0xffff0000) | fis[0] >> 16;
+    // update status and error fields, SDB FISes do not touch BSY and DRQ
+    if ((fis[0] & 0xff) == 0xa1)
+      PxTFD = (PxTFD & 0xffff0088) | (fis[0] >> 16) & 0xff77;
+    else
+      PxTFD = (PxTFD & 0xffff0000) | fis[0] >> 16;
 
     switch (fis[0] & 0xff)
       {
@@ -92,13 +95,20 @@ public:
 	  unsigned mask = 1 << (fis[4] - 1);
 	  if (mask & ~_inprogress)
 	    Logging::panic("XXX broken %x,%x inprogress %x\n", fis[0], fis[4], _inprogress);
-	  _inprogress &= ~mask;
 	  PxCI &= ~mask;
-	  PxSACT &= ~mask;
+	  // queued commands stay active until the SDB FIS arrives
+	  if (~PxSACT & mask) _inprogress &= ~mask;
 	}
 	else
 	  Logging::printf("not finished %x,%x inprogress %x\n", fis[0], fis[4], _inprogress);
 	break;
+      case 0xa1: // set device bits fis
+	assert(fislen == 2);
+	copy_offset = 0x58;
+	PxSACT &= ~fis[1];
+	_inprogress &= ~fis[1];
+	PxIS |= 1 << 3; // SDBS
+	break;
       case 0x41: // dma setup fis
 	assert(fislen == 7);
 	copy_offset = 0;
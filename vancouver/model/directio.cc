@@ -23,7 +23,7 @@
  * Bridge between guest and host IOIO busses.
  *
  * State: stable
- * Features: IOIn, IOOut
+ * Features: IOIn, IOOut, string I/O
  */
 class DirectIODevice : public StaticReceiver<DirectIODevice>
 {
@@ -61,4 +61,6 @@ PARAM_HANDLER(dio,
   DirectIODevice *dev = new DirectIODevice(mb.bus_hwioin, mb.bus_hwioout, base, 1 << order);
   mb.bus_ioin.add(dev,  DirectIODevice::receive_static<MessageIOIn>);
   mb.bus_ioout.add(dev, DirectIODevice::receive_static<MessageIOOut>);
+  mb.bus_ioins.add(dev,  DirectIODevice::receive_static<MessageIOIn>);
+  mb.bus_ioouts.add(dev, DirectIODevice::receive_static<MessageIOOut>);
 }
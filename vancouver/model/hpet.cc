@@ -0,0 +1,362 @@
+/** @file
+ * HPET emulation.
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "nul/motherboard.h"
+#include "host/hpet.h"
+
+/**
+ * High Precision Event Timer.
+ *
+ * Every comparator gets its own timeout, so that an expiry costs only
+ * a single MSI or IRQ line message.  The main counter is derived from
+ * the motherboard clock, thus reading it does not need any state.
+ *
+ * State: testing
+ * Features: 64bit counter, one-shot+periodic comparators, 32bit mode, FSB/MSI, IOAPIC routing, level IRQs, legacy replacement, ACPI table
+ * Missing: one-shot rearming after a counter wrap, masking the PIT+RTC in legacy mode
+ * Documentation: IA-PC HPET Specification 1.0a, Intel ICH10 datasheet
+ */
+class Hpet : public DiscoveryHelper<Hpet>, public StaticReceiver<Hpet>, public BasicHpet {
+public:
+  enum {
+    HPET_BASE   = 0xfed00000,
+    FREQ        = 14318180,
+    PERIOD_FS   = 69841279,
+    MAX_TIMERS  = (0x400 - 0x100) / 0x20, // comparators that fit into the register window
+    // IOAPIC pins that can be used by the comparators
+    ROUTE_CAP   = 0x00f00000,
+    // additional comparator config bits
+    SIZE_CAP    = 1 << 5,
+    VAL_SET_CNF = 1 << 6,
+    ROUTE_SHIFT = 9,
+    ROUTE_MASK  = 0x1f << ROUTE_SHIFT,
+    CONFIG_RW   = ROUTE_MASK | FSB_INT_EN_CNF | MODE32_CNF | VAL_SET_CNF | TYPE_CNF | INT_ENB_CNF | INT_TYPE_CNF,
+  };
+  Motherboard &_mb;
+
+private:
+  struct Comparator {
+    unsigned  config;
+    unsigned  timer;
+    timevalue comp;
+    timevalue period;
+    unsigned  fsb[2];
+    bool      armed;
+  };
+
+  unsigned long _base;
+  unsigned   _count;
+  unsigned   _config;
+  unsigned   _isr;
+  timevalue  _counter;  ///< the counter value while halted, the offset to the clock otherwise
+  Comparator _comp[MAX_TIMERS];
+
+
+  timevalue counter() {
+    if (_config & ENABLE_CNF) return _mb.clock()->clock(FREQ) - _counter;
+    return _counter;
+  }
+
+
+  bool mode32(Comparator &c) { return c.config & MODE32_CNF; }
+
+  /**
+   * Which IRQ line does a comparator use?
+   */
+  unsigned irq(unsigned nr) {
+    if (_config & LEG_RT_CNF && nr < 2) return nr ? 8 : 0;
+    return (_comp[nr].config & ROUTE_MASK) >> ROUTE_SHIFT;
+  }
+
+
+  /**
+   * Ticks until the comparator matches, handling a 32bit wrap.
+   * A comparator in the past gives more than half the counter range.
+   */
+  timevalue ticks_left(Comparator &c, timevalue now) {
+    if (mode32(c)) return static_cast<unsigned>(c.comp - now);
+    return c.comp - now;
+  }
+
+  bool in_past(Comparator &c, timevalue left) { return left > (mode32(c) ? 0x7fffffffull : 0x7fffffffffffffffull); }
+
+
+  /**
+   * Program the timeout of a comparator.
+   */
+  void update_timer(unsigned nr) {
+    Comparator &c = _comp[nr];
+    if (!(_config & ENABLE_CNF) || !c.armed) return;
+
+    timevalue left = ticks_left(c, counter());
+    // a comparator in the past fires now
+    if (in_past(c, left)) left = 0;
+    MessageTimer msg(c.timer, _mb.clock()->abstime(left, FREQ));
+    _mb.bus_timer.send(msg);
+  }
+
+
+  /**
+   * Raise the interrupt of a comparator.
+   */
+  void trigger(unsigned nr) {
+    Comparator &c = _comp[nr];
+    bool level = c.config & INT_TYPE_CNF;
+    if (level) _isr |= 1 << nr;
+    if (!(c.config & INT_ENB_CNF)) return;
+
+    COUNTER_INC("hpet");
+    if (c.config & FSB_INT_EN_CNF) {
+      unsigned data = c.fsb[0];
+      MessageMem msg(false, c.fsb[1], &data);
+      _mb.bus_mem.send(msg);
+    }
+    else {
+      MessageIrqLines msg(level ? MessageIrq::ASSERT_IRQ : MessageIrq::ASSERT_NOTIFY, irq(nr));
+      _mb.bus_irqlines.send(msg);
+    }
+  }
+
+
+  /**
+   * Deassert level triggered IRQs that the guest acknowledged.
+   */
+  void clear_isr(unsigned value) {
+    value &= _isr;
+    _isr &= ~value;
+    for (unsigned i=0; i < _count; i++)
+      if (value & (1 << i) && !(_comp[i].config & FSB_INT_EN_CNF)) {
+	MessageIrqLines msg(MessageIrq::DEASSERT_IRQ, irq(i));
+	_mb.bus_irqlines.send(msg);
+      }
+  }
+
+
+  void write_config(unsigned value) {
+    timevalue now = counter();
+    _config = value & (ENABLE_CNF | LEG_RT_CNF);
+    _counter = (_config & ENABLE_CNF) ? _mb.clock()->clock(FREQ) - now : now;
+    for (unsigned i=0; i < _count; i++) update_timer(i);
+  }
+
+
+  void write_counter(unsigned value, bool high) {
+    timevalue now = counter();
+    if (high) now = (now & 0xffffffffull) | (static_cast<timevalue>(value) << 32);
+    else      now = (now & ~0xffffffffull) | value;
+    _counter = (_config & ENABLE_CNF) ? _mb.clock()->clock(FREQ) - now : now;
+    for (unsigned i=0; i < _count; i++) update_timer(i);
+  }
+
+
+  static timevalue set_half(timevalue old, unsigned value, bool high) {
+    if (high) return (old & 0xffffffffull) | (static_cast<timevalue>(value) << 32);
+    return (old & ~0xffffffffull) | value;
+  }
+
+
+  /**
+   * In periodic mode, a write sets the period and only with
+   * VAL_SET_CNF the comparator as well.
+   */
+  void write_comparator(unsigned nr, unsigned value, bool high) {
+    Comparator &c = _comp[nr];
+    if (high && mode32(c)) return;
+
+    if (~c.config & TYPE_CNF || c.config & VAL_SET_CNF) {
+      c.comp = set_half(c.comp, value, high);
+      c.config &= ~VAL_SET_CNF;
+    }
+    c.period = set_half(c.period, value, high);
+    if (mode32(c)) { c.comp &= 0xffffffffull; c.period &= 0xffffffffull; }
+    c.armed  = true;
+    update_timer(nr);
+  }
+
+
+  void write_timer_config(unsigned nr, unsigned value) {
+    Comparator &c = _comp[nr];
+    bool was_level = c.config & INT_TYPE_CNF;
+    c.config = (c.config & ~CONFIG_RW) | (value & CONFIG_RW);
+
+    // only allow routes to advertised pins
+    if (!(ROUTE_CAP & (1 << ((c.config & ROUTE_MASK) >> ROUTE_SHIFT)))) c.config &= ~ROUTE_MASK;
+    if (mode32(c)) { c.comp &= 0xffffffffull; c.period &= 0xffffffffull; }
+    if (was_level && ~c.config & INT_TYPE_CNF) clear_isr(1 << nr);
+    update_timer(nr);
+  }
+
+
+  bool read_timer(unsigned nr, unsigned offset, unsigned &value) {
+    Comparator &c = _comp[nr];
+    switch (offset) {
+    case 0x0:  value = c.config; break;
+    case 0x4:  value = ROUTE_CAP; break;
+    case 0x8:  value = c.comp; break;
+    case 0xc:  value = mode32(c) ? 0 : c.comp >> 32; break;
+    case 0x10: value = c.fsb[0]; break;
+    case 0x14: value = c.fsb[1]; break;
+    default:   return false;
+    }
+    return true;
+  }
+
+
+  bool write_timer(unsigned nr, unsigned offset, unsigned value) {
+    switch (offset) {
+    case 0x0:  write_timer_config(nr, value); break;
+    case 0x4:  break;
+    case 0x8:
+    case 0xc:  write_comparator(nr, value, offset == 0xc); break;
+    case 0x10: _comp[nr].fsb[0] = value; break;
+    case 0x14: _comp[nr].fsb[1] = value; break;
+    default:   return false;
+    }
+    return true;
+  }
+
+
+  void reset() {
+    _config  = 0;
+    _isr     = 0;
+    _counter = 0;
+    for (unsigned i=0; i < _count; i++) {
+      Comparator &c = _comp[i];
+      c.config = FSB_INT_DEL_CAP | PER_INT_CAP | SIZE_CAP;
+      c.comp   = ~0ull;
+      c.period = 0;
+      c.fsb[0] = c.fsb[1] = 0;
+      c.armed  = false;
+    }
+  }
+
+public:
+
+  bool  receive(MessageMem &msg)
+  {
+    if (!in_range(msg.phys, _base, 0x400)) return false;
+    unsigned offset = msg.phys - _base;
+
+    if (offset >= 0x100) {
+      unsigned nr = (offset - 0x100) / 0x20;
+      if (nr >= _count) return false;
+      if (msg.read) return read_timer(nr, offset & 0x1f, *msg.ptr);
+      return write_timer(nr, offset & 0x1f, *msg.ptr);
+    }
+
+    if (msg.read)
+      switch (offset) {
+      case 0x00: *msg.ptr = 0x8086a001 | ((_count - 1) << 8); break;
+      case 0x04: *msg.ptr = PERIOD_FS; break;
+      case 0x10: *msg.ptr = _config; break;
+      case 0x20: *msg.ptr = _isr; break;
+      case 0xf0: *msg.ptr = counter(); break;
+      case 0xf4: *msg.ptr = counter() >> 32; break;
+      default:   *msg.ptr = 0;
+      }
+    else
+      switch (offset) {
+      case 0x10: write_config(*msg.ptr); break;
+      case 0x20: clear_isr(*msg.ptr); break;
+      case 0xf0:
+      case 0xf4: write_counter(*msg.ptr, offset == 0xf4); break;
+      default:   break;
+      }
+    return true;
+  }
+
+
+  bool  receive(MessageTimeout &msg)
+  {
+    unsigned nr;
+    for (nr=0; nr < _count; nr++)
+      if (_comp[nr].timer == msg.nr) break;
+    if (nr == _count) return false;
+
+    // the timeout might be outdated
+    Comparator &c = _comp[nr];
+    if (!(_config & ENABLE_CNF) || !c.armed) return true;
+    timevalue now = counter();
+    timevalue left = ticks_left(c, now);
+    if (left && !in_past(c, left)) {
+      update_timer(nr);
+      return true;
+    }
+
+    trigger(nr);
+    if (c.config & TYPE_CNF && c.period) {
+      // skip missed periods
+      do c.comp += c.period; while (!ticks_left(c, now) || ticks_left(c, now) > c.period);
+      if (mode32(c)) c.comp &= 0xffffffffull;
+      update_timer(nr);
+    }
+    else
+      c.armed = false;
+    return true;
+  }
+
+
+  bool  receive(MessageLegacy &msg) {
+    if (msg.type != MessageLegacy::RESET) return false;
+    reset();
+    return true;
+  }
+
+
+  void discovery() {
+    // the HPET description table
+    discovery_write_dw("HPET", 36, 0x8086a001 | ((_count - 1) << 8), 4);
+    // the GAS: system memory, 64bit wide
+    discovery_write_dw("HPET", 40, 0x00004000, 4);
+    discovery_write_dw("HPET", 44, _base, 4);
+    discovery_write_dw("HPET", 48, 0, 4);
+    // HPET number, minimum tick and no page protection
+    discovery_write_dw("HPET", 52, (_base - HPET_BASE) >> 12, 1);
+    discovery_write_dw("HPET", 53, 0x80, 2);
+    discovery_write_dw("HPET", 55, 0, 1);
+  }
+
+
+  Hpet(Motherboard &mb, unsigned long base, unsigned count) : _mb(mb), _base(base), _count(count)
+  {
+    reset();
+    for (unsigned i=0; i < _count; i++) {
+      MessageTimer msg0;
+      if (!_mb.bus_timer.send(msg0))
+	Logging::panic("%s can't get a timer", __PRETTY_FUNCTION__);
+      _comp[i].timer = msg0.nr;
+    }
+    _mb.bus_mem.add(this,       receive_static<MessageMem>);
+    _mb.bus_timeout.add(this,   receive_static<MessageTimeout>);
+    _mb.bus_legacy.add(this,    receive_static<MessageLegacy>);
+    _mb.bus_discovery.add(this, discover);
+  }
+};
+
+
+PARAM_HANDLER(hpet,
+	      "hpet:timers=3 - create an HPET with the given number of comparators.",
+	      "Example: 'hpet:4'.",
+	      "Multiple HPETs are mapped at 0xfed00000, 0xfed01000...")
+{
+  static unsigned hpet_count;
+  unsigned timers = argv[0] == ~0UL ? 3 : argv[0];
+  if (!timers || timers > Hpet::MAX_TIMERS) Logging::panic("hpet: invalid number of timers %lx", argv[0]);
+
+  new Hpet(mb, Hpet::HPET_BASE + 0x1000 * hpet_count, timers);
+  hpet_count++;
+}
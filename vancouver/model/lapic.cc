@@ -24,7 +24,7 @@
  * Lapic model.
  *
  * State: testing
- * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables
+ * Features: MEM, MSR, MSR-base and CPUID, LVT, LINT0/1, EOI, prioritize IRQ, error, RemoteEOI, timer, TSC-deadline, IPI, lowest prio, reset, x2apic mode, BIOS ACPI tables, KVM PV-EOI
  * Missing:  focus checking, CR8/TPR setting
  * Difference:  no interrupt polarity, lowest prio is round-robin
  * Documentation: Intel SDM Volume 3a Chapter 10 253668-033.
@@ -41,7 +41,13 @@ class Lapic : public DiscoveryHelper<Lapic>, public StaticReceiver<Lapic>
     OFS_IRR   = 512,
     LVT_BASE  = _TIMER_offset,
     NUM_LVT   = 6,
-    APIC_ADDR = 0xfee00000
+    APIC_ADDR = 0xfee00000,
+    MSR_TSC_DEADLINE = 0x6e0,
+    TIMER_MODE_MASK  = 3 << 17,
+    TIMER_MODE_TSC_DEADLINE = 2 << 17,
+    MSR_PV_EOI       = 0x4b564d04,
+    CPUID_KVM_FEATURES = 0x40000001,
+    FEATURE_PV_EOI   = 1 << 6,
   };
 
 public:
@@ -55,6 +61,7 @@ private:
   // dynamic state
   unsigned  _timer_dcr_shift;
   timevalue _timer_start;
+  timevalue _tsc_deadline;
   unsigned long long _msr;
   unsigned  _vector[8*3];
   unsigned  _esr_shadow;
@@ -62,11 +69,15 @@ private:
   bool      _lvtds[NUM_LVT];
   bool      _rirr[NUM_LVT];
   unsigned  _lowest_rr;
+  unsigned long long _pv_eoi_msr;
+  unsigned *_pv_eoi;
+  unsigned  _pv_eoi_vector;
 
 
   bool sw_disabled() { return ~_SVR & 0x100; }
   bool hw_disabled() { return ~_msr & 0x800; }
   bool x2apic_mode() { return  (_msr & 0xc00) == 0xc00; }
+  bool tsc_deadline_mode() { return (_TIMER & TIMER_MODE_MASK) == TIMER_MODE_TSC_DEADLINE; }
   unsigned x2apic_ldr() { return ((_initial_apic_id & ~0xf) << 12) | ( 1 << (_initial_apic_id & 0xf)); }
 
 
@@ -83,12 +94,15 @@ private:
 
     // init dynamic state
     _timer_dcr_shift = 1 + _timer_clock_shift;
+    _tsc_deadline = 0;
     memset(_vector,  0, sizeof(_vector));
     memset(_lvtds,   0, sizeof(_lvtds));
     memset(_rirr,    0, sizeof(_rirr));
     _isrv = 0;
     _esr_shadow = 0;
     _lowest_rr = 0;
+    if (_pv_eoi_vector) Cpu::atomic_set_bit(_pv_eoi, 0, false);
+    _pv_eoi_vector = 0;
 
 
     _ID = old_id;
@@ -106,6 +120,8 @@ private:
     init();
     _ID = _initial_apic_id << 24;
     _msr = 0;
+    _pv_eoi_msr = 0;
+    _pv_eoi = 0;
     set_base_msr(APIC_ADDR | 0x800);
   }
 
@@ -173,10 +189,25 @@ private:
     return _ICT - done;
   }
 
+  /**
+   * Checks whether the TSC deadline has passed.
+   */
+  void check_deadline(timevalue now) {
+    if (!_tsc_deadline || now < _tsc_deadline) return;
+    _tsc_deadline = 0;
+    trigger_lvt(_TIMER_offset - LVT_BASE);
+  }
+
   /**
    * Reprogram a new host timer.
    */
   void update_timer(timevalue now) {
+    if (tsc_deadline_mode()) {
+      if (!_tsc_deadline || _TIMER & (1 << LVT_MASK_BIT)) return;
+      MessageTimer msg(_timer, _tsc_deadline);
+      _mb.bus_timer.send(msg);
+      return;
+    }
     unsigned value = get_ccr(now);
     if (!value || _TIMER & (1 << LVT_MASK_BIT)) return;
     MessageTimer msg(_timer, now + (value << _timer_dcr_shift));
@@ -268,6 +299,7 @@ private:
    * processor prio to inject.
    */
   unsigned prioritize_irq() {
+    pv_eoi_sync();
 
     // EXTINT pending?
     for (unsigned i=0; i < NUM_LVT; i++) {
@@ -317,6 +349,9 @@ private:
    */
   void accept_vector(unsigned char vector, bool level, bool value) {
 
+    // the guest has to exit on EOI, so that we can inject the new one
+    pv_eoi_clear();
+
     // lower vectors are reserved
     if (vector < 16) set_error(6);
     else {
@@ -344,11 +379,143 @@ private:
   }
 
   /**
+   * EOI the highest vector in service.
+   */
+  void eoi() {
+    COUNTER_INC("lapic eoi");
+    if (!_isrv) return;
+    Cpu::set_bit(_vector, OFS_ISR + _isrv, false);
+    broadcast_eoi(_isrv);
+
+    // if we eoi the timer IRQ, rearm the timer
+    if (_isrv == (_TIMER & 0xff)) update_timer(_mb.clock()->time());
+
+    _isrv = get_highest_bit(OFS_ISR);
+    update_irqs();
+  }
+
+
+  /**
+   * Take the PV-EOI flag back from the guest and do the EOI, if the
+   * guest already cleared it.
+   */
+  void pv_eoi_clear() {
+    if (!_pv_eoi_vector) return;
+    bool acked = !(Cpu::xchg(_pv_eoi, 0u) & 1);
+    _pv_eoi_vector = 0;
+    if (acked) {
+      COUNTER_INC("lapic pv eoi");
+      eoi();
+    }
+  }
+
+
+  /**
+   * Check whether the guest acknowledged the vector without an exit.
+   */
+  void pv_eoi_sync() {
+    if (_pv_eoi_vector && !(*_pv_eoi & 1)) pv_eoi_clear();
+  }
+
+
+  /**
+   * Let the guest acknowledge a vector by clearing the PV-EOI flag.
    *
+   * This is only possible for edge triggered vectors, when nothing
+   * else was in service or is pending, as we would not notice the EOI
+   * otherwise.  A running timer needs the EOI to be rearmed.
    */
+  void pv_eoi_set(unsigned vector, unsigned old_isrv) {
+    if (!_pv_eoi || old_isrv
+	|| Cpu::get_bit(_vector, OFS_TMR + vector)
+	|| get_highest_bit(OFS_IRR)
+	|| vector == (_TIMER & 0xff) && _timer_start) return;
+    _pv_eoi_vector = vector;
+    Cpu::atomic_set_bit(_pv_eoi, 0);
+  }
+
+
+  /**
+   * Fast path for the x2APIC registers that are written on every IRQ
+   * and IPI.  This avoids the generic register machinery.
+   *
+   * Returns false if the generic path should handle the write.
+   */
+  bool x2apic_fast_write(CpuState *cpu, bool &res) {
+    pv_eoi_sync();
+    switch (cpu->ecx) {
+    case 0x808: // TPR
+      if ((res = !(cpu->edx_eax() & ~0xffull))) {
+	_TPR = cpu->eax;
+	update_irqs();
+      }
+      return true;
+    case 0x80b: // EOI
+      if ((res = !cpu->edx_eax())) eoi();
+      return true;
+    case 0x830: // ICR
+      if ((res = !(cpu->eax & ~_ICR_mask))) {
+	_ICR  = cpu->eax;
+	_ICR1 = cpu->edx;
+	if (!send_ipi(_ICR, _ICR1)) COUNTER_INC("IPI missed");
+      }
+      return true;
+    default:
+      return false;
+    }
+  }
+
+
+  /**
+   * Enable or disable the PV-EOI flag at a guest-physical address.
+   */
+  bool set_pv_eoi_msr(unsigned long long value) {
+    if (value & 2) return false;
+    pv_eoi_clear();
+    _pv_eoi = 0;
+    _pv_eoi_msr = value;
+    if (~value & 1) return true;
+
+    unsigned long long addr = value & ~3ull;
+    MessageMemRegion msg(addr >> 12);
+    if (!_vcpu->memregion.send(msg) || !msg.ptr) {
+      Logging::printf("LAPIC: PV-EOI flag at %llx not in RAM\n", addr);
+      return true;
+    }
+    _pv_eoi = reinterpret_cast<unsigned *>(msg.ptr + (addr - (static_cast<unsigned long long>(msg.start_page) << 12)));
+    *_pv_eoi = 0;
+    return true;
+  }
+
+
+  /**
+   * Read and write the TSC deadline MSR.  The deadline is kept in
+   * host TSC time, so that it can be used directly as timeout.
+   */
+  bool tsc_deadline_msr(CpuMessage &msg, bool write) {
+    assert(msg.mtr_in & MTD_TSC);
+    long long tsc_off = (msg.mtr_out & MTD_TSC) ? msg.current_tsc_off : msg.cpu->tsc_off;
+
+    if (!write) {
+      msg.cpu->edx_eax(_tsc_deadline ? _tsc_deadline + tsc_off : 0);
+      return true;
+    }
+
+    // writes are ignored in the other timer modes
+    if (!tsc_deadline_mode()) return true;
+    COUNTER_INC("lapic deadline");
+    timevalue now = _mb.clock()->time();
+    _tsc_deadline = msg.cpu->edx_eax() ? msg.cpu->edx_eax() - tsc_off : 0;
+    if (_tsc_deadline && _tsc_deadline <= now) _tsc_deadline = now;
+    check_deadline(now);
+    update_timer(now);
+    return true;
+  }
+
 
   bool register_read(unsigned offset, unsigned &value) {
     COUNTER_INC("lapic read");
+    pv_eoi_sync();
     bool res = true;
     switch (offset) {
     case 0x0a:
@@ -378,6 +545,7 @@ private:
   bool register_write(unsigned offset, unsigned value, bool strict) {
     bool res;
     COUNTER_INC("lapic write");
+    pv_eoi_sync();
 
     // XXX
     if (sw_disabled() && in_range(offset, LVT_BASE, NUM_LVT))  value |= 1 << 16;
@@ -387,18 +555,8 @@ private:
       // the accesses are ignored
       return true;
     case 0xb: // EOI
-      COUNTER_INC("lapic eoi");
       if (strict && value) return false;
-      if (_isrv) {
-	Cpu::set_bit(_vector, OFS_ISR + _isrv, false);
-	broadcast_eoi(_isrv);
-
-	// if we eoi the timer IRQ, rearm the timer
-	if (_isrv == (_TIMER & 0xff)) update_timer(_mb.clock()->time());
-
-	_isrv = get_highest_bit(OFS_ISR);
-	update_irqs();
-      }
+      eoi();
       return true;
     default:
       if (!(res = Lapic_write(offset, value, strict))) {
@@ -550,7 +708,10 @@ public:
 
     // no need to call update timer here, as the CPU needs to do an
     // EOI first
-    get_ccr(_mb.clock()->time());
+    if (tsc_deadline_mode())
+      check_deadline(_mb.clock()->time());
+    else
+      get_ccr(_mb.clock()->time());
     return true;
   }
 
@@ -595,10 +756,13 @@ public:
       }
       else if (irrv) {
 	assert(irrv > _isrv);
+	pv_eoi_clear();
+	unsigned old_isrv = _isrv;
 	Cpu::atomic_set_bit(_vector, OFS_IRR + irrv, false);
 	Cpu::set_bit(_vector, OFS_ISR + irrv);
 	_isrv = irrv;
 	msg.value = irrv;
+	pv_eoi_set(irrv, old_isrv);
       } else
 	msg.value = _SVR & 0xff;
       update_irqs();
@@ -620,6 +784,8 @@ public:
 
       // handle APIC base MSR
       if (msg.cpu->ecx == 0x1b) { msg.cpu->edx_eax(_msr); return true; }
+      if (msg.cpu->ecx == MSR_TSC_DEADLINE) return !hw_disabled() && tsc_deadline_msr(msg, false);
+      if (msg.cpu->ecx == MSR_PV_EOI) { msg.cpu->edx_eax(_pv_eoi_msr); return true; }
 
       // check whether the register is available
       if (!in_range(msg.cpu->ecx, 0x800, 64)
@@ -639,9 +805,13 @@ public:
 
     // WRMSR
     if (msg.type == CpuMessage::TYPE_WRMSR) {
+      bool res;
+      if (x2apic_mode() && x2apic_fast_write(msg.cpu, res)) return res;
 
       // handle APIC base MSR
       if (msg.cpu->ecx == 0x1b)  return set_base_msr(msg.cpu->edx_eax());
+      if (msg.cpu->ecx == MSR_TSC_DEADLINE) return !hw_disabled() && tsc_deadline_msr(msg, true);
+      if (msg.cpu->ecx == MSR_PV_EOI)       return set_pv_eoi_msr(msg.cpu->edx_eax());
 
 
       // check whether the register is available
@@ -738,7 +908,8 @@ public:
   }
 
 
-  Lapic(Motherboard &mb, VCpu *vcpu, unsigned initial_apic_id, unsigned timer) : _mb(mb), _vcpu(vcpu), _initial_apic_id(initial_apic_id), _timer(timer)
+  Lapic(Motherboard &mb, VCpu *vcpu, unsigned initial_apic_id, unsigned timer)
+    : _mb(mb), _vcpu(vcpu), _initial_apic_id(initial_apic_id), _timer(timer), _pv_eoi(0), _pv_eoi_vector(0)
   {
     // find a FREQ that is not too high
     for (_timer_clock_shift=0; _timer_clock_shift < 32; _timer_clock_shift++)
@@ -751,10 +922,15 @@ public:
       CpuMessage(11, 3, 0, _initial_apic_id),
       // support for APIC timer that does not sleep in C-states
       CpuMessage(6, 0, ~(1 << 2), 1 << 2),
+      // support for the TSC-deadline timer mode
+      CpuMessage(1, 2, ~(1 << 24), 1 << 24),
     };
     for (unsigned i=0; i < sizeof(msg) / sizeof(*msg); i++)
       _vcpu->executor.send(msg[i]);
 
+    // announce PV-EOI to the model that provides the KVM CPUID leaves
+    _vcpu->set_cpuid(CPUID_KVM_FEATURES, 0, FEATURE_PV_EOI, FEATURE_PV_EOI);
+
     reset();
 
     mb.bus_legacy.add(this,   receive_static<MessageLegacy>);
@@ -800,7 +976,9 @@ REGSET(Lapic,
        REG_RW(_ESR,           0x28,          0, 0xffffffff, _ESR = Cpu::xchg(&_esr_shadow, 0U); return !value; )
        REG_RW(_ICR,           0x30,          0, 0x000ccfff, if (!send_ipi(_ICR, _ICR1)) COUNTER_INC("IPI missed");)
        REG_RW(_ICR1,          0x31,          0, 0xff000000,)
-       REG_RW(_TIMER,         0x32, 0x00010000, 0x310ff, )
+       REG_RW(_TIMER,         0x32, 0x00010000, 0x710ff,
+	      // switching the timer mode disarms the timer
+	      if (tsc_deadline_mode()) _ICT = _timer_start = 0; else _tsc_deadline = 0; )
        REG_RW(_TERM,          0x33, 0x00010000, 0x117ff, )
        REG_RW(_PERF,          0x34, 0x00010000, 0x117ff, )
        REG_RW(_LINT0,         0x35, 0x00010000, 0x1b7ff, )
@@ -808,6 +986,7 @@ REGSET(Lapic,
        REG_RW(_ERROR,         0x37, 0x00010000, 0x110ff, )
        REG_RW(_ICT,           0x38,          0, ~0u,
 	      COUNTER_INC("lapic ict");
+	      if (tsc_deadline_mode()) { _ICT = 0; return true; }
 	      _timer_start = _mb.clock()->time();
 	      update_timer(_timer_start); )
        REG_RW(_DCR,           0x3e,          0, 0xb
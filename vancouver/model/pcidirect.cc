@@ -17,6 +17,7 @@
  */
 
 #include "nul/motherboard.h"
+#include "nul/vcpu.h"
 #include "host/hostpci.h"
 #include "host/hostvf.h"
 #include "model/pci.h"
@@ -26,8 +27,8 @@
  * Directly assign a host PCI device to the guest.
  *
  * State: testing
- * Features: pcicfgspace, ioport operations, memory read/write, host irq, mem-alloc, DMA remapping
- * Missing: MSI, MSI-X
+ * Features: pcicfgspace, ioport operations, memory read/write, host irq, mem-alloc, DMA remapping, MSI, MSI-X, MSI routing cache
+ * Missing: MSI-X per-vector masking in the guest
  * Documentation: PCI spec v.2.2
  */
 class DirectPciDevice : public StaticReceiver<DirectPciDevice>, public HostVfPci
@@ -42,6 +43,18 @@ class DirectPciDevice : public StaticReceiver<DirectPciDevice>, public HostVfPci
     unsigned control;
   };
 
+  /**
+   * A decoded MSI, so that we can deliver it on the APIC bus without
+   * going through the memory bus.
+   */
+  struct MsiRoute {
+    bool     valid;
+    bool     apic;
+    bool     lowest;
+    unsigned icr;
+    unsigned dst;
+  };
+
   Motherboard &_mb;
   unsigned  _hostbdf;
   unsigned  _guestbdf;
@@ -49,6 +62,8 @@ class DirectPciDevice : public StaticReceiver<DirectPciDevice>, public HostVfPci
   unsigned *_host_irqs;
   MsiXTableEntry *_msix_table;
   MsiXTableEntry *_msix_host_table;
+  MsiRoute *_msi_routes;
+  unsigned  _lowest_rr;
   unsigned  _cfgspace[PCI_CFG_SPACE_DWORDS];
   unsigned  _bar_count;
   unsigned  _msi_cap;
@@ -190,6 +205,68 @@ private:
     return 0;
   }
 
+
+  /**
+   * Decode an MSI like the Msi model does.  Everything that does not
+   * target the LAPICs is delivered as memory write.
+   */
+  void build_route(MsiRoute &r, unsigned long long address, unsigned data) {
+    COUNTER_INC("PCID::MSI route");
+    r.valid = true;
+    r.apic  = false;
+    if (address >> 32 || !in_range(address, MessageMem::MSI_ADDRESS, 1 << 20)) return;
+
+    unsigned event = 1 << ((data >> 8) & 7);
+    if (event & (VCpu::EVENT_RRD | VCpu::EVENT_SIPI)) return;
+
+    r.apic   = true;
+    r.dst    = (address >> 12) & 0xff | (address << 4) & 0xff00;
+    r.icr    = data & 0xc7ff;
+    r.lowest = address & MessageMem::MSI_RH || event & VCpu::EVENT_LOWEST;
+    if (address & MessageMem::MSI_DM) r.icr |= MessageApic::ICR_DM;
+    // we send them round-robin as EVENT_FIXED
+    if (r.lowest) r.icr &= ~0x700;
+  }
+
+
+  void invalidate_routes() {
+    for (unsigned i=0; i < _irq_count; i++) _msi_routes[i].valid = false;
+  }
+
+
+  /**
+   * Account the delivery latency in a histogram of TSC cycles.
+   */
+  static void account_latency(timevalue cycles) {
+    switch (cycles >> 9 ? Cpu::bsr(cycles >> 9 > 0xff ? 0xff : cycles >> 9) + 1 : 0) {
+    case 0:  COUNTER_INC("PCID::MSI <512"); break;
+    case 1:  COUNTER_INC("PCID::MSI <1k");  break;
+    case 2:  COUNTER_INC("PCID::MSI <2k");  break;
+    case 3:  COUNTER_INC("PCID::MSI <4k");  break;
+    case 4:  COUNTER_INC("PCID::MSI <8k");  break;
+    default: COUNTER_INC("PCID::MSI >=8k"); break;
+    }
+  }
+
+
+  bool deliver_msi(unsigned index, unsigned long long address, unsigned data) {
+    timevalue start = Cpu::rdtsc();
+    MsiRoute &r = _msi_routes[index];
+    if (!r.valid) build_route(r, address, data);
+
+    bool res;
+    if (!r.apic) {
+      MessageMem msg(false, address, &data);
+      res = _mb.bus_mem.send(msg);
+    }
+    else {
+      MessageApic msg(r.icr, r.dst, 0);
+      res = r.lowest ? _mb.bus_apic.send_rr(msg, _lowest_rr) : _mb.bus_apic.send(msg);
+    }
+    account_latency(Cpu::rdtsc() - start);
+    return res;
+  }
+
  public:
 
 
@@ -247,6 +324,9 @@ private:
       if (msg.dword == (_msi_cap + (_msi_64bit ? 3 : 2))) mask = 0xffff;
     }
 
+    // the guest reprograms the MSI
+    if (_msi_cap && in_range(msg.dword, _msi_cap, _msi_64bit ? 4 : 3)) invalidate_routes();
+
     if (~mask)
       _cfgspace[msg.dword] = (_cfgspace[msg.dword] & ~mask) | (msg.value & mask);
     else {
@@ -274,15 +354,12 @@ private:
 	  unsigned multiple_msgs = 1 << ((_cfgspace[_msi_cap] >> 20) & 0x7);
 	  if (i < multiple_msgs) msi_data |= i;
 
-	  MessageMem msg2(false, msi_address, &msi_data);
-	  return _mb.bus_mem.send(msg2);
+	  return deliver_msi(i, msi_address, msi_data);
 	}
 
 	// MSI-X enabled?
-	if (_cfgspace[_msix_cap] >> 31 && _msix_table) {
-	  MessageMem msg2(false, _msix_table[i].address, &_msix_table[i].data);
-	  return _mb.bus_mem.send(msg2);
-	}
+	if (_cfgspace[_msix_cap] >> 31 && _msix_table)
+	  return deliver_msi(i, _msix_table[i].address, _msix_table[i].data);
 
 	// we send a single GSI
 	MessageIrqLines msg2(msg.type, _cfgspace[15] & 0xff);
@@ -314,10 +391,16 @@ private:
     else {
       COUNTER_INC("PCID::WRITE");
       *ptr = *msg.ptr;
-      // write msix control trough
-      if (_msix_host_table && ptr >= reinterpret_cast<unsigned *>(_msix_table) && ptr < reinterpret_cast<unsigned *>(_msix_table + _irq_count) && (msg.phys & 0xf) == 0xc) {
-	_msix_host_table[(ptr - reinterpret_cast<unsigned *>(_msix_table)) / 16].control = *msg.ptr;
-	COUNTER_INC("PCID::MSI-X");
+      if (_msix_host_table && ptr >= reinterpret_cast<unsigned *>(_msix_table) && ptr < reinterpret_cast<unsigned *>(_msix_table + _irq_count)) {
+	unsigned index = (ptr - reinterpret_cast<unsigned *>(_msix_table)) / 4;
+
+	// write msix control trough
+	if ((msg.phys & 0xf) == 0xc) {
+	  _msix_host_table[index].control = *msg.ptr;
+	  COUNTER_INC("PCID::MSI-X");
+	}
+	else
+	  _msi_routes[index].valid = false;
       }
     }
 
@@ -373,7 +456,7 @@ private:
 
 
   DirectPciDevice(Motherboard &mb, unsigned hbdf, unsigned guestbdf, bool assign, bool use_irqs=true, unsigned parent_bdf = 0, unsigned vf_no = 0, bool map = true)
-    : HostVfPci(mb.bus_hwpcicfg, mb.bus_hostop), _mb(mb), _hostbdf(hbdf), _msix_table(0), _msix_host_table(0), _bar_count(count_bars(_hostbdf))
+    : HostVfPci(mb.bus_hwpcicfg, mb.bus_hostop), _mb(mb), _hostbdf(hbdf), _msix_table(0), _msix_host_table(0), _lowest_rr(0), _bar_count(count_bars(_hostbdf))
   {
 
     _vf = parent_bdf != 0;
@@ -424,6 +507,8 @@ private:
     }
 
     _host_irqs = new unsigned[_irq_count];
+    _msi_routes = new MsiRoute[_irq_count];
+    memset(_msi_routes, 0, _irq_count * sizeof(*_msi_routes));
     for (unsigned i=0; i < _irq_count; i++)
       // XXX when do we need level?
       _host_irqs[i] = get_gsi(mb.bus_hostop, mb.bus_acpi, _hostbdf, i, false, _msix_host_table);
@@ -37,6 +37,7 @@ public:
   bool  receive(MessageIOIn &msg) {
 
     if (msg.port != _iobase || msg.type != MessageIOIn::TYPE_INL)  return false;
+    COUNTER_INC("pmtimer");
     msg.value = _mb.clock()->clock(FREQ);
     return true;
   }
@@ -0,0 +1,231 @@
+/** @file
+ * Paravirtual clock (kvmclock).
+ *
+ * Economic rights: Technische Universitaet Dresden (Germany)
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include "nul/motherboard.h"
+#include "nul/vcpu.h"
+
+/**
+ * A kvmclock compatible per-VCPU time page.
+ *
+ * The guest registers a pvclock_vcpu_time_info structure per MSR.  We
+ * fill in the scale from TSC to nanoseconds and a TSC/system-time
+ * pair once.  As the guest TSC runs with a constant offset to the
+ * host TSC, the guest can compute the time from RDTSC alone without
+ * any further exit.  The page is only rewritten if the guest sets its
+ * TSC.
+ *
+ * State: testing
+ * Features: CPUID signature, CLOCKSOURCE2 MSRs, wall clock, stable TSC bit
+ * Missing: legacy MSRs 0x11/0x12, async PF, steal time
+ * Documentation: Linux Documentation/virtual/kvm/msr.txt and cpuid.txt
+ */
+class PvClock : public StaticReceiver<PvClock>
+{
+  enum {
+    CPUID_SIGNATURE     = 0x40000000,
+    CPUID_FEATURES      = 0x40000001,
+    FEATURE_CLOCKSOURCE2 = 1 << 3,
+    FEATURE_STABLE      = 1 << 24,
+    MSR_WALL_CLOCK      = 0x4b564d00,
+    MSR_SYSTEM_TIME     = 0x4b564d01,
+    FLAG_TSC_STABLE     = 1 << 0,
+  };
+
+  struct TimeInfo {
+    unsigned  version;
+    unsigned  pad0;
+    unsigned long long tsc_timestamp;
+    unsigned long long system_time;
+    unsigned  tsc_to_system_mul;
+    signed char tsc_shift;
+    unsigned char flags;
+    unsigned char pad[2];
+  } __attribute__((packed));
+
+  struct WallClock {
+    unsigned version;
+    unsigned sec;
+    unsigned nsec;
+  } __attribute__((packed));
+
+  Motherboard &_mb;
+  VCpu        *_vcpu;
+  unsigned     _features;
+  TimeInfo    *_info;
+  unsigned     _mul;
+  int          _shift;
+  static timevalue _boot;  ///< host TSC that corresponds to system time 0 on all VCPUs
+
+  /**
+   * Get a host pointer for a guest-physical structure that does not
+   * cross a page.
+   */
+  void *guest_ptr(unsigned long long addr, unsigned size)
+  {
+    if ((addr & 0xfff) + size > 0x1000) return 0;
+    MessageMemRegion msg(addr >> 12);
+    if (!_vcpu->memregion.send(msg) || !msg.ptr) return 0;
+    return msg.ptr + (addr - (static_cast<unsigned long long>(msg.start_page) << 12));
+  }
+
+  /**
+   * Calculate mul and shift, so that ns = ((tsc << shift) * mul) >> 32.
+   */
+  void calc_scale(unsigned long long tsc_hz)
+  {
+    unsigned long long scaled = 1000000000ull;
+    unsigned long long tps64  = tsc_hz;
+    int shift = 0;
+
+    while (tps64 > scaled * 2 || tps64 >> 32) { tps64 >>= 1; shift--; }
+    unsigned tps32 = tps64;
+    while (tps32 <= scaled || scaled >> 32) {
+      if (scaled >> 32 || tps32 & 0x80000000) scaled >>= 1;
+      else tps32 <<= 1;
+      shift++;
+    }
+    // scaled < tps32, thus the fraction fits into 32 bits
+    unsigned long long frac = scaled << 32;
+    Math::div64(frac, tps32);
+    _mul   = frac;
+    _shift = shift;
+  }
+
+  /**
+   * Publish a new TSC/system-time pair.
+   */
+  void update(long long tsc_off)
+  {
+    if (!_info) return;
+    timevalue now = Cpu::rdtsc();
+
+    _info->version++;
+    MEMORY_BARRIER;
+    _info->tsc_timestamp     = now + tsc_off;
+    _info->system_time       = Math::muldiv128(now - _boot, 1000000000ull, _mb.clock()->freq());
+    _info->tsc_to_system_mul = _mul;
+    _info->tsc_shift         = _shift;
+    _info->flags             = FLAG_TSC_STABLE;
+    MEMORY_BARRIER;
+    _info->version++;
+  }
+
+  void write_wallclock(unsigned long long addr)
+  {
+    WallClock *wc = reinterpret_cast<WallClock *>(guest_ptr(addr, sizeof(WallClock)));
+    if (!wc) return;
+
+    MessageTime msg;
+    if (!_mb.bus_time.send(msg)) Logging::printf("pvclock: could not get wallclock time!\n");
+
+    // wallclock at system time 0
+    timevalue sec  = msg.wallclocktime - (msg.timestamp - _mb.clock()->clock(MessageTime::FREQUENCY, _boot));
+    unsigned  rest = Math::div64(sec, MessageTime::FREQUENCY);
+
+    wc->version++;
+    MEMORY_BARRIER;
+    wc->sec  = sec;
+    wc->nsec = Math::muldiv128(rest, 1000000000, MessageTime::FREQUENCY);
+    MEMORY_BARRIER;
+    wc->version++;
+  }
+
+  long long get_tsc_off(CpuMessage &msg)
+  {
+    return (msg.mtr_out & MTD_TSC) ? msg.current_tsc_off : msg.cpu->tsc_off;
+  }
+
+public:
+
+  bool  receive(CpuMessage &msg)
+  {
+    CpuState *cpu = msg.cpu;
+    if (msg.type == CpuMessage::TYPE_CPUID) {
+      if (msg.cpuid_index == CPUID_SIGNATURE) {
+        cpu->eax = CPUID_FEATURES;
+        cpu->ebx = 0x4b4d564b; // "KVMKVMKVM"
+        cpu->ecx = 0x564b4d56;
+        cpu->edx = 0x4d;
+      }
+      else if (msg.cpuid_index == CPUID_FEATURES) {
+        cpu->eax = _features;
+        cpu->ebx = cpu->ecx = cpu->edx = 0;
+      }
+      else return false;
+      msg.mtr_out |= MTD_GPR_ACDB;
+      return true;
+    }
+
+    // other models announce their KVM features here
+    if (msg.type == CpuMessage::TYPE_CPUID_WRITE) {
+      if (msg.nr != CPUID_FEATURES || msg.reg) return false;
+      _features = (_features & msg.mask) | msg.value;
+      return true;
+    }
+
+    if (msg.type == CpuMessage::TYPE_RDMSR) {
+      if (cpu->ecx != MSR_WALL_CLOCK && cpu->ecx != MSR_SYSTEM_TIME) return false;
+      cpu->edx_eax(0);
+      msg.mtr_out |= MTD_GPR_ACDB;
+      return true;
+    }
+
+    if (msg.type != CpuMessage::TYPE_WRMSR) return false;
+    switch (cpu->ecx) {
+    case MSR_WALL_CLOCK:
+      write_wallclock(cpu->edx_eax());
+      return true;
+    case MSR_SYSTEM_TIME:
+      _info = 0;
+      if (cpu->eax & 1) {
+        _info = reinterpret_cast<TimeInfo *>(guest_ptr(cpu->edx_eax() & ~1ull, sizeof(TimeInfo)));
+        if (!_info) Logging::printf("pvclock: time info at %llx not in RAM\n", cpu->edx_eax());
+        update(get_tsc_off(msg));
+      }
+      return true;
+    case 0x10:
+      // The guest sets its TSC. Let the VCPU handle it as well.
+      update(cpu->edx_eax() - Cpu::rdtsc());
+      return false;
+    default:
+      return false;
+    }
+  }
+
+
+  PvClock(Motherboard &mb, VCpu *vcpu) : _mb(mb), _vcpu(vcpu), _features(FEATURE_CLOCKSOURCE2 | FEATURE_STABLE), _info(0)
+  {
+    if (!_boot) _boot = Cpu::rdtsc();
+    calc_scale(_mb.clock()->freq());
+
+    // announce a hypervisor in CPUID.1:ECX
+    _vcpu->set_cpuid(1, 2, 1u << 31, 1u << 31);
+    _vcpu->executor.add(this, receive_static<CpuMessage>);
+  }
+};
+
+timevalue PvClock::_boot;
+
+PARAM_HANDLER(pvclock,
+	      "pvclock - provide a kvmclock compatible paravirtual clock for the last VCPU",
+	      "Example: 'vcpu,halifax,vbios,pvclock,lapic'",
+	      "It has to be created before the lapic to announce the PV-EOI feature of it.")
+{
+  if (!mb.last_vcpu) Logging::panic("no VCPU for this pvclock");
+
+  new PvClock(mb, mb.last_vcpu);
+}
@@ -23,8 +23,8 @@
  * RTL8029 device model.
  *
  * State: unstable
- * Features: PCI, send, receive, broadcast, promiscuous mode
- * Missing: multicast, CRC calculation, rep optimized
+ * Features: PCI, send, receive, broadcast, promiscuous mode, string I/O
+ * Missing: multicast, CRC calculation
  */
 #ifndef REGBASE
 class Rtl8029: public StaticReceiver<Rtl8029>
@@ -285,9 +285,11 @@ public:
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x1))
       return false;
 
-    // for every byte
-    for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
-      read_byte(addr, reinterpret_cast<unsigned char *>(&msg.value)+i);
+    // for every byte of every element
+    unsigned char *value = msg.count ? reinterpret_cast<unsigned char *>(msg.ptr) : reinterpret_cast<unsigned char *>(&msg.value);
+    for (unsigned n = 0; n < (msg.count ? msg.count : 1); n++)
+      for (unsigned i = 0; i < (1u<<msg.type); i++)
+	read_byte(addr + i, value++);
 
     return true;
   }
@@ -299,6 +301,14 @@ public:
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x1))
       return false;
 
+    if (msg.count) {
+      unsigned char *value = reinterpret_cast<unsigned char *>(msg.ptr);
+      for (unsigned n = 0; n < msg.count; n++)
+	for (unsigned i = 0; i < (1u<<msg.type); i++)
+	  write_byte(addr + i, *value++);
+      return true;
+    }
+
     for (unsigned i = 0; i < (1u<<msg.type); i++, addr++)
       write_byte(addr, msg.value >> (i*8));
     return true;
@@ -339,6 +349,8 @@ PARAM_HANDLER(rtl8029,
   mb.bus_pcicfg.add (dev, Rtl8029::receive_static<MessagePciConfig>);
   mb.bus_ioin.add   (dev, Rtl8029::receive_static<MessageIOIn>);
   mb.bus_ioout.add  (dev, Rtl8029::receive_static<MessageIOOut>);
+  mb.bus_ioins.add  (dev, Rtl8029::receive_static<MessageIOIn>);
+  mb.bus_ioouts.add (dev, Rtl8029::receive_static<MessageIOOut>);
   mb.bus_network.add(dev, Rtl8029::receive_static<MessageNetwork>);
 
 
@@ -27,7 +27,7 @@
  * speaks the SATA transport layer protocol with its FISes.
  *
  * State: unstable
- * Features: read,write,identify
+ * Features: read,write,identify,NCQ
  * Missing: better error handling, many commands
  */
 class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
@@ -42,22 +42,51 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   unsigned char _error;
   unsigned _dsf[7];
   unsigned _splits[32];
+  unsigned _ncq;     // slots with an outstanding queued command
+  unsigned _failed;  // slots where a disk request failed
   DiskParameter _params;
   static unsigned const DMA_DESCRIPTORS = 64;
   DmaDescriptor _dma[DMA_DESCRIPTORS];
+  // the PRD window, fetched with a single guest memory access
+  unsigned _prds[DMA_DESCRIPTORS][4];
+  unsigned _prd_start;
+  unsigned _prd_count;
+
+
+  /**
+   * Make sure the given PRD is in the PRD window.
+   */
+  unsigned *get_prd(unsigned prd)
+  {
+    if (prd < _prd_start || prd >= _prd_start + _prd_count)
+      {
+	unsigned long prdbase = union64(_dsf[2], _dsf[1]);
+	_prd_start = prd;
+	_prd_count = MIN(_dsf[3] - prd, DMA_DESCRIPTORS);
+	if (!copy_in(prdbase + prd*16, _prds, _prd_count*16)) _prd_count = 0;
+	if (!_prd_count) return 0;
+      }
+    return _prds[prd - _prd_start];
+  }
+
+
+  /**
+   * Forget the cached PRDs, as a new command comes with new ones.
+   */
+  void flush_prds() { _prd_count = 0; }
 
 
   /**
    * A command is completed.
    * We send a register d2h FIS to the host.
    */
-  void complete_command()
+  void complete_command(bool irq = true)
   {
     // remove DRQ
     _status = _status & ~0x8;
 
     unsigned d2h[5];
-    d2h[0] = _error << 24 | _status << 16 | 0x4000 | _regs[0] & 0x0f00 | 0x34;
+    d2h[0] = _error << 24 | _status << 16 | (irq ? 0x4000 : 0) | _regs[0] & 0x0f00 | 0x34;
     d2h[1] = _regs[1];
     d2h[2] = _regs[2];
     d2h[3] = _regs[3] & 0xffff;
@@ -69,6 +98,20 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   }
 
 
+  /**
+   * Queued commands are completed.
+   * We send a set device bits FIS to the host.
+   */
+  void send_sdb_fis(unsigned sactive, bool error)
+  {
+    unsigned char status = _status & 0x77 | (error ? 1 : 0);
+    unsigned sdb[2];
+    sdb[0] = (error ? 0x04 : 0) << 24 | status << 16 | 0x4000 | 0xa1;
+    sdb[1] = sactive;
+    _peer->receive_fis(2, sdb);
+  }
+
+
   void send_pio_setup_fis(unsigned short length, bool irq = false)
   {
     unsigned psf[5];
@@ -112,7 +155,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     identify[61] = maxlba28 >> 16;
     identify[64] = 3;      // pio 3+4
     identify[75] = 0x1f;   // NCQ depth 32
-    identify[76] = 0x002;   // disabled NCQ + 1.5gbit
+    identify[76] = 0x102;  // NCQ + 1.5gbit
     identify[80] = 1 << 6; // major version number: ata-6
     identify[83] = 0x4000 | 1 << 10; // lba48
     identify[86] = 1 << 10; // lba48 enabled
@@ -132,15 +175,11 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   unsigned push_data(unsigned length, void *data, bool &irq)
   {
     if (!_dsf[3]) return 0;
-    unsigned long prdbase = union64(_dsf[2], _dsf[1]);
-    Logging::printf("push data %x prdbase %lx _dsf %x %x %x\n", length, prdbase, _dsf[1], _dsf[2], _dsf[3]);
     unsigned prd = 0;
     unsigned offset = 0;
-    while (offset < length && prd < _dsf[3])
+    unsigned *prdvalue;
+    while (offset < length && prd < _dsf[3] && (prdvalue = get_prd(prd)))
       {
-	unsigned prdvalue[4];
-	copy_in(prdbase + prd*16, prdvalue, 16);
-
 	irq = irq || prdvalue[3] & 0x80000000;
 	unsigned sublen = (prdvalue[3] & 0x3fffff) + 1;
 	if (sublen > length - offset) sublen = length - offset;
@@ -150,11 +189,14 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
       }
     // mark them as consumed!
     _dsf[3] -= prd;
+    flush_prds();
     return offset;
   };
 
   /**
    * Read or write sectors from/to disk.
+   *
+   * Returns the number of disk requests that were issued.
    */
   unsigned readwrite_sectors(bool read, bool lba48_ext)
   {
@@ -174,78 +216,100 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	sector = _regs[1] & 0x0fffffff;
       }
 
-    if (!_dsf[3]) return 0;
-    unsigned long prdbase = union64(_dsf[2], _dsf[1]);
+    unsigned tag = _dsf[6];
+    assert(tag && tag <= 32);
+    assert(_splits[tag - 1] == 0);
+    flush_prds();
 
-    assert(_dsf[6] < 32);
-    assert(_splits[_dsf[6]] == 0);
+    // where each DMA descriptor starts in the PRD table
+    unsigned start_prd[DMA_DESCRIPTORS];
+    unsigned start_offset[DMA_DESCRIPTORS];
 
     unsigned prd = 0;
-    unsigned lastoffset = 0;
+    unsigned prdoffset = 0;
+    unsigned requests = 0;
     while (len)
       {
-
 	unsigned transfer = 0;
-	if (lastoffset) prd--;
 	unsigned dmacount = 0;
-	for (; prd < _dsf[3] && dmacount < DMA_DESCRIPTORS && len > transfer; prd++, dmacount++)
+	unsigned *prdvalue;
+	for (; prd < _dsf[3] && dmacount < DMA_DESCRIPTORS && len > transfer && (prdvalue = get_prd(prd)); dmacount++)
 	  {
-
-	    unsigned prdvalue[4];
-	    copy_in(prdbase + prd*16, prdvalue, 16);
-
-	    unsigned sublen = ((prdvalue[3] & 0x3fffff) + 1) - lastoffset;
+	    unsigned prdlen = (prdvalue[3] & 0x3fffff) + 1;
+	    unsigned sublen = prdlen - prdoffset;
 	    if (sublen > len - transfer) sublen = len - transfer;
 
-	    _dma[dmacount].byteoffset = union64(prdvalue[1], prdvalue[0]) + lastoffset;
+	    start_prd[dmacount]    = prd;
+	    start_offset[dmacount] = prdoffset;
+	    _dma[dmacount].byteoffset = union64(prdvalue[1], prdvalue[0]) + prdoffset;
 	    _dma[dmacount].bytecount = sublen;
 	    transfer += sublen;
-	    lastoffset = 0;
+	    prdoffset += sublen;
+	    if (prdoffset == prdlen) { prd++; prdoffset = 0; }
 	  }
 
-	// remove all entries that completly contribute to the even entry and split larger ones
-	while (transfer & 0x1ff)
+	// only transfer whole sectors, the rest is done by the next request
+	for (unsigned rest = transfer & 0x1ff; rest && dmacount; )
 	  {
-	    assert(dmacount);
-	    if (_dma[dmacount-1].bytecount > transfer & 0x1ff)
-	      {
-		lastoffset = _dma[dmacount-1].bytecount - transfer & 0x1ff;
-		transfer &= ~0x1ff;
-	      }
-	    else
-	      {
-		transfer -= _dma[dmacount-1].bytecount;
-		dmacount--;
-	      }
+	    DmaDescriptor &last = _dma[dmacount - 1];
+	    unsigned cut = MIN(rest, last.bytecount);
+	    last.bytecount -= cut;
+	    transfer -= cut;
+	    rest -= cut;
+	    prd = start_prd[dmacount - 1];
+	    prdoffset = start_offset[dmacount - 1] + last.bytecount;
+	    if (!last.bytecount) dmacount--;
 	  }
 
-	// are there bytes left to transfer, but we do not have enough PRDs?
-	assert(dmacount);
-	if (!dmacount && (len - transfer < 0x200)) return len - transfer;
+	// not enough PRDs for another sector
+	if (!dmacount) break;
 
-	/**
-	 * The new entries do not fit into DMA_DESCRIPTORS, do a single sector transfer
-	 * This means we have to do a read in our own buffer and than copy them out
-	 */
-	if (!dmacount)
-	  Logging::panic("single sector transfer unimplemented!");
-
-	_splits[_dsf[6]]++;
-
-	MessageDisk msg(read ? MessageDisk::DISK_READ : MessageDisk::DISK_WRITE, _hostdisk, _dsf[6], sector, dmacount, _dma, 0, ~0ul);
-	check1(1, !_bus_disk.send(msg), "DISK operation failed");
+	_splits[tag - 1]++;
+	MessageDisk msg(read ? MessageDisk::DISK_READ : MessageDisk::DISK_WRITE, _hostdisk, tag, sector, dmacount, _dma, 0, ~0ul);
+	if (!_bus_disk.send(msg))
+	  {
+	    Logging::printf("SATA: disk request for slot %x failed\n", tag - 1);
+	    _splits[tag - 1]--;
+	    break;
+	  }
+	requests++;
 
 	sector += transfer >> 9;
 	assert(len >= transfer);
 	len -= transfer;
-	transfer = 0;
-	// XXX check error code
-
       }
-    return 0;
+    if (len) _failed |= 1 << (tag - 1);
+    return requests;
   };
 
 
+  /**
+   * All disk requests of a command are done or none could be issued.
+   */
+  void finish_command(unsigned tag, bool error)
+  {
+    unsigned mask = 1 << (tag - 1);
+    error = error || _failed & mask;
+    _failed &= ~mask;
+    if (_ncq & mask)
+      {
+	_ncq &= ~mask;
+	send_sdb_fis(mask, error);
+	return;
+      }
+
+    if (error)
+      {
+	_error = 4;   // ABRT
+	_status |= 1; // ERR
+      }
+    else
+      _status &= ~1;
+    _dsf[6] = tag;
+    complete_command();
+  }
+
+
   /**
    * Execute ATA commands.
    */
@@ -267,7 +331,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  send_dma_setup_fis(true);
 	else
 	  send_pio_setup_fis(512);
-	readwrite_sectors(true, lba48_command);
+	if (!readwrite_sectors(true, lba48_command)) finish_command(_dsf[6], true);
 	break;
       case 0x34: // WRITE SECTOR EXT
       case 0x35: // WRITE DMA EXT
@@ -280,7 +344,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  send_dma_setup_fis(false);
 	else
 	  send_pio_setup_fis(512);
-	readwrite_sectors(false, lba48_command);
+	if (!readwrite_sectors(false, lba48_command)) finish_command(_dsf[6], true);
 	break;
       case 0x60: // READ  FPDMA QUEUED
 	read = true;
@@ -293,7 +357,14 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  _regs[0] = _regs[0] & 0x00ffffff | (feature << 24);
 	  _regs[2] = _regs[2] & 0x00ffffff | (feature << 16) & 0xff000000;
 	  send_dma_setup_fis(read);
-	  readwrite_sectors(read, true);
+
+	  unsigned tag = _dsf[6];
+	  _ncq |= 1 << (tag - 1);
+	  unsigned requests = readwrite_sectors(read, true);
+
+	  // release the slot, the completion comes with a SDB FIS
+	  complete_command(false);
+	  if (!requests) finish_command(tag, true);
 	}
 	break;
       case 0xc6: // SET MULTIPLE
@@ -342,6 +413,8 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     _error = 1;
     _ctrl = _regs[3] >> 24;
     memset(_splits, 0, sizeof(_splits));
+    _ncq = 0;
+    _failed = 0;
     complete_command();
   };
 
@@ -390,22 +463,21 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 
   bool receive(MessageDiskCommit &msg)
   {
-    if (msg.disknr != _hostdisk || msg.usertag > 32) return false;
+    if (msg.disknr != _hostdisk || !msg.usertag || msg.usertag > 32) return false;
     // we are done
     _status = _status & ~0x8;
-    assert(_splits[msg.usertag]);
-    assert(!msg.status);
-    if (!--_splits[msg.usertag])
-      {
-	_dsf[6] = msg.usertag;
-	complete_command();
-      }
+    unsigned slot = msg.usertag - 1;
+    // a stale completion from before a reset
+    if (!_splits[slot]) return true;
+    if (msg.status) _failed |= 1 << slot;
+    if (!--_splits[slot])
+      finish_command(msg.usertag, false);
     return true;
   }
 
 
   SataDrive(DBus<MessageDisk> &bus_disk, DBus<MessageMemRegion> *bus_memregion, DBus<MessageMem> *bus_mem, unsigned hostdisk, DiskParameter params)
-    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _ctrl(0), _params(params)
+    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _ctrl(0), _ncq(0), _failed(0), _params(params), _prd_start(0), _prd_count(0)
   {
     Logging::printf("SATA disk %x flags %x sectors %llx\n", hostdisk, _params.flags, _params.sectors);
   }
@@ -283,6 +283,13 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
   }
 
   void handle_ioin(CpuMessage &msg) {
+    if (msg.count) {
+      // string I/O - only the models that support it are asked
+      MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port, msg.count, msg.dst);
+      msg.consumed = _mb.bus_ioins.send(msg2, true);
+      return;
+    }
+
     MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
     bool res = _mb.bus_ioin.send(msg2);
 
@@ -297,6 +304,12 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
 
   void handle_ioout(CpuMessage &msg) {
+    if (msg.count) {
+      MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, msg.count, msg.dst);
+      msg.consumed = _mb.bus_ioouts.send(msg2, true);
+      return;
+    }
+
     MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
     Cpu::move(&msg2.value, msg.dst, msg.io_order);
 
@@ -396,6 +409,8 @@ public:
     case CpuMessage::TYPE_CPUID:    return handle_cpuid(msg);
     case CpuMessage::TYPE_CPUID_WRITE:
       {
+	// the hypervisor leaves are provided by other models
+	if ((msg.nr & 0xf0000000) == 0x40000000) return false;
 	unsigned reg = (msg.nr << 4) | msg.reg | msg.nr & 0x80000000;
 	unsigned old;
 	if (CPUID_read(reg, old) && CPUID_write(reg, (old & msg.mask) | msg.value)) {